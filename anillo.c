@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "anillo.h"
+
+#define FRAME_ALIGN(n) (((n) + 3) & ~(uint32_t)3) // las tramas empiezan en múltiplos de 4
+
+// Función para copiar bytes en el anillo a partir de una posición (dando la vuelta si hace falta)
+static void ring_write(Ring *ring, uint32_t pos, const void *data, uint32_t len) {
+    uint32_t offset = pos & (RING_SIZE - 1);
+    uint32_t first = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const char *)data + first, len - first);
+}
+
+// Función para copiar bytes del anillo a partir de una posición (dando la vuelta si hace falta)
+static void ring_read(const Ring *ring, uint32_t pos, void *out, uint32_t len) {
+    uint32_t offset = pos & (RING_SIZE - 1);
+    uint32_t first = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+    memcpy(out, ring->data + offset, first);
+    memcpy((char *)out + first, ring->data, len - first);
+}
+
+// Función para inicializar un anillo vacío con el consumidor esperando al timbre
+static void ring_init(Ring *ring) {
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+    atomic_store(&ring->idle, 1);
+}
+
+void ring_region_name(char *name, const char *client_pipe) {
+    const char *slash = strrchr(client_pipe, '/');
+    snprintf(name, RING_NAME_LEN, RING_NAME_FORMAT, slash ? slash + 1 : client_pipe);
+}
+
+RingRegion *ring_region_create(const char *name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(RingRegion)) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    RingRegion *region = mmap(NULL, sizeof(RingRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    region->magic = RING_MAGIC;
+    region->ring_size = RING_SIZE;
+    atomic_store(&region->attached, 0);
+    ring_init(&region->up);
+    ring_init(&region->down);
+    return region;
+}
+
+RingRegion *ring_region_attach(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != sizeof(RingRegion)) {
+        close(fd);
+        return NULL;
+    }
+    RingRegion *region = mmap(NULL, sizeof(RingRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    if (region->magic != RING_MAGIC || region->ring_size != RING_SIZE) {
+        munmap(region, sizeof(RingRegion));
+        return NULL;
+    }
+    return region;
+}
+
+void ring_region_detach(RingRegion *region) {
+    munmap(region, sizeof(RingRegion));
+}
+
+int ring_push(Ring *ring, const void *data, uint32_t len) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t needed = sizeof(uint32_t) + FRAME_ALIGN(len);
+    if (needed > RING_SIZE - (head - tail)) {
+        return 0;
+    }
+    ring_write(ring, head, &len, sizeof(len));
+    ring_write(ring, head + sizeof(len), data, len);
+    atomic_store(&ring->head, head + needed); // publica la trama antes de mirar idle
+    return 1;
+}
+
+int ring_needs_doorbell(Ring *ring) {
+    return atomic_exchange(&ring->idle, 0) == 1;
+}
+
+uint32_t ring_pop(Ring *ring, void *out, uint32_t cap) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+    uint32_t len;
+    ring_read(ring, tail, &len, sizeof(len));
+    if (len <= cap) {
+        ring_read(ring, tail + sizeof(len), out, len);
+    }
+    atomic_store_explicit(&ring->tail, tail + sizeof(len) + FRAME_ALIGN(len), memory_order_release);
+    return len;
+}
+
+int ring_sleep(Ring *ring) {
+    atomic_store(&ring->idle, 1);
+    // Si el productor publicó antes de ver idle, no tocará el timbre: seguir consumiendo
+    if (atomic_load(&ring->head) != atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+        atomic_store(&ring->idle, 0);
+        return 0;
+    }
+    return 1;
+}
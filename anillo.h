@@ -0,0 +1,67 @@
+#ifndef ANILLO_H
+#define ANILLO_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Transporte opcional por memoria compartida entre un cliente y el servidor.
+//
+// El cliente crea una región (shm_open) con dos anillos de un productor y un consumidor:
+// "up" para sus comandos y "down" para las respuestas y notificaciones del servidor.
+// Cada anillo guarda tramas de longitud prefijada. El consumidor marca idle antes de
+// dormir y el productor solo toca el timbre (un mensaje por la pipe de siempre) cuando
+// encuentra el anillo en ese estado, de modo que una ráfaga cuesta una única llamada
+// al sistema. Las pipes se mantienen para el inicio de sesión y como alternativa.
+
+#define RING_MAGIC 0x504d5247u // "PMRG"
+#define RING_SIZE (128 * 1024) // bytes de datos de cada anillo (potencia de 2, cabe la trama más larga)
+#define RING_NAME_FORMAT "/plataforma_%s" // nombre de la región de una sesión (nombre de la pipe del cliente)
+#define RING_NAME_LEN 300 // bytes para el nombre de una región
+
+// Anillo de un productor y un consumidor (cabeza y cola en líneas de caché distintas)
+typedef struct {
+    _Atomic uint32_t head; // bytes escritos por el productor
+    char pad1[60];
+    _Atomic uint32_t tail; // bytes consumidos por el consumidor
+    _Atomic uint32_t idle; // el consumidor espera al timbre
+    char pad2[56];
+    char data[RING_SIZE];
+} Ring;
+
+// Región compartida de una sesión
+typedef struct {
+    uint32_t magic; // RING_MAGIC
+    uint32_t ring_size; // RING_SIZE
+    _Atomic uint32_t attached; // el servidor ha proyectado la región y atiende el anillo up
+    char pad[52];
+    Ring up; // cliente -> servidor
+    Ring down; // servidor -> cliente
+} RingRegion;
+
+// Escribe en name (de RING_NAME_LEN bytes) el nombre de la región de la sesión que usa la pipe
+// client_pipe (sin su directorio: un proceso puede tener varias sesiones)
+void ring_region_name(char *name, const char *client_pipe);
+
+// Crea e inicializa la región con el nombre dado (lado del cliente); NULL si falla
+RingRegion *ring_region_create(const char *name);
+
+// Proyecta una región creada por un cliente y la valida (lado del servidor); NULL si falla
+RingRegion *ring_region_attach(const char *name);
+
+// Deshace la proyección de una región
+void ring_region_detach(RingRegion *region);
+
+// Productor: añade una trama (0 si no cabe)
+int ring_push(Ring *ring, const void *data, uint32_t len);
+
+// Productor: indica si tras añadir tramas hay que tocar el timbre (el consumidor dormía)
+int ring_needs_doorbell(Ring *ring);
+
+// Consumidor: saca la siguiente trama copiándola en out (devuelve su longitud, 0 si el anillo
+// está vacío; una trama mayor que cap se descarta y se devuelve igualmente su longitud)
+uint32_t ring_pop(Ring *ring, void *out, uint32_t cap);
+
+// Consumidor: se declara dormido; devuelve 0 si llegaron tramas mientras tanto y hay que seguir
+int ring_sleep(Ring *ring);
+
+#endif
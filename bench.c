@@ -0,0 +1,491 @@
+#include "util.h"
+#include "protocolo.h"
+#include <sys/wait.h>
+#include <stdatomic.h>
+
+// Generador de carga de extremo a extremo contra un servidor en marcha.
+//
+// Lanza un proceso por cada publicador y cada suscriptor simulado; todos usan el protocolo
+// real por las pipes. Cada mensaje lleva el instante en que se envió (CLOCK_MONOTONIC, común
+// a todos los procesos de la máquina) y los suscriptores calculan la latencia al recibirlo.
+// Cada proceso deja sus contadores y su histograma en una zona de memoria compartida que el
+// proceso principal suma al terminar.
+
+#define HIST_SUB_BITS 5 // 32 subdivisiones por potencia de 2 (error menor del 3%)
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+#define READY_TIMEOUT_MS 10000 // espera máxima a que todos los procesos inicien sesión
+#define REPLY_TIMEOUT_MS 10000 // espera máxima de un publicador sin recibir confirmaciones
+#define POLL_MS 50 // intervalo de comprobación de los suscriptores y del proceso principal
+
+// Parámetros de la prueba
+typedef struct {
+    int publishers; // -p
+    int subscribers; // -s
+    int topics; // -t
+    int fanout; // -f: suscriptores de cada tópico
+    long messages; // -n: mensajes por publicador
+    int size; // -m: bytes de cada mensaje
+    int persistent; // -P: porcentaje de mensajes persistentes
+    int lifetime; // -l: lifetime de los mensajes persistentes
+    int batch; // -b: mensajes por solicitud (1 = comando msg, más = lotes)
+    int window; // -w: solicitudes sin confirmar de cada publicador
+    int drain_ms; // -d: espera sin entregas nuevas antes de dar por perdidas las que faltan
+} BenchConfig;
+
+// Resultados de un proceso (publicador o suscriptor)
+typedef struct {
+    _Atomic long received; // entregas recibidas (suscriptor; se lee mientras la prueba sigue)
+    long sent; // mensajes enviados (publicador)
+    long accepted; // mensajes confirmados por el servidor (publicador)
+    long rejected; // mensajes rechazados por el servidor (publicador)
+    uint64_t start_ns, end_ns; // primer envío y última confirmación (publicador)
+    int failed; // el proceso no pudo completar la prueba
+    uint64_t hist[HIST_BUCKETS]; // latencias de extremo a extremo en nanosegundos (suscriptor)
+} BenchResult;
+
+// Zona compartida entre el proceso principal y los procesos de la prueba
+typedef struct {
+    _Atomic int ready; // procesos con la sesión iniciada (y suscritos, los suscriptores)
+    _Atomic int go; // los publicadores pueden empezar
+    _Atomic int stop; // los suscriptores deben terminar
+    BenchResult results[]; // publicadores primero, luego suscriptores
+} BenchShared;
+
+BenchConfig config = { 4, 4, 8, 2, 10000, 64, 0, 60, 1, 64, 2000 };
+BenchShared *shared;
+pid_t bench_pid;
+
+// Estado de la sesión del proceso de la prueba
+char username[MAX_NAME_FIELD + 1];
+char client_pipe[256];
+int client_fd = -1;
+int server_fd = -1;
+uint32_t seq = 0;
+FrameStream replies;
+
+// Función para obtener el instante actual en nanosegundos
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Función para obtener la posición del histograma de un valor
+int hist_index(uint64_t value) {
+    if (value < (1u << HIST_SUB_BITS)) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    return ((exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((value >> (exponent - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// Función para obtener el valor representativo (el centro) de una posición del histograma
+uint64_t hist_value(int index) {
+    if (index < (1 << HIST_SUB_BITS)) {
+        return index;
+    }
+    int exponent = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t base = (uint64_t)((1u << HIST_SUB_BITS) | (index & ((1u << HIST_SUB_BITS) - 1))) << (exponent - HIST_SUB_BITS);
+    return base + ((1ull << (exponent - HIST_SUB_BITS)) >> 1);
+}
+
+// Función para obtener un percentil (0..1) de un histograma con count valores
+uint64_t hist_percentile(const uint64_t *hist, uint64_t count, double percentile) {
+    uint64_t target = (uint64_t)(percentile * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > target) {
+            return hist_value(i);
+        }
+    }
+    return 0;
+}
+
+// Función para enviar una trama al servidor
+void send_frame(FrameWriter *writer) {
+    size_t len = frame_end(writer);
+    if (write(server_fd, writer->buf, len) != (ssize_t)len) {
+        perror("Error al escribir en la pipe del servidor");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Función para empezar una solicitud de la sesión del proceso
+void begin_command(FrameWriter *writer, char *buf, size_t cap, int type) {
+    frame_begin(writer, buf, cap, type, ++seq);
+    frame_put_int(writer, getpid());
+    frame_put_string(writer, username, MAX_NAME_FIELD);
+}
+
+// Función para abrir la pipe del proceso e iniciar sesión con el nombre dado
+void open_session(const char *prefix, int index) {
+    snprintf(username, sizeof(username), "%s%d_%d", prefix, index, bench_pid);
+    snprintf(client_pipe, sizeof(client_pipe), CLIENT_PIPE_FORMAT, getpid());
+    mkfifo(client_pipe, 0600);
+    client_fd = open(client_pipe, O_RDONLY | O_NONBLOCK);
+    server_fd = open(SERVER_PIPE, O_WRONLY);
+    if (client_fd == -1 || server_fd == -1) {
+        perror("Error al abrir las pipes");
+        unlink(client_pipe);
+        exit(EXIT_FAILURE);
+    }
+    frame_stream_init(&replies);
+
+    char frame[MAX_REQUEST_LEN];
+    FrameWriter writer;
+    begin_command(&writer, frame, sizeof(frame), CMD_LOGIN);
+    frame_put_string(&writer, client_pipe, sizeof(client_pipe) - 1);
+    send_frame(&writer);
+}
+
+// Función para cerrar la sesión del proceso
+void close_session() {
+    char frame[MAX_REQUEST_LEN];
+    FrameWriter writer;
+    begin_command(&writer, frame, sizeof(frame), CMD_EXIT);
+    send_frame(&writer);
+    unlink(client_pipe);
+}
+
+// Función para esperar tramas del servidor (0 si no llegó nada en timeout_ms)
+int wait_replies(int timeout_ms) {
+    struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    return frame_stream_fill(&replies, client_fd) > 0;
+}
+
+// Función para construir el texto de un mensaje: instante de envío y relleno hasta el tamaño pedido
+void build_message(char *text, size_t cap) {
+    int len = snprintf(text, cap, "%llu ", (unsigned long long)now_ns());
+    size_t size = config.size < (int)cap ? (size_t)config.size : cap - 1;
+    while ((size_t)len < size) {
+        text[len++] = 'x';
+    }
+    text[len] = '\0';
+}
+
+// Función principal de un publicador simulado
+void run_publisher(int index) {
+    BenchResult *result = &shared->results[index];
+    open_session("bp", index);
+
+    // Esperar la bienvenida del servidor antes de declararse listo
+    const char *frame;
+    size_t len;
+    int welcomed = 0;
+    uint64_t deadline = now_ns() + READY_TIMEOUT_MS * 1000000ull;
+    while (!welcomed && now_ns() < deadline) {
+        wait_replies(POLL_MS);
+        while (frame_stream_next(&replies, MAX_FRAME_LEN, &frame, &len) == 1) {
+            welcomed = 1;
+        }
+    }
+    atomic_fetch_add(&shared->ready, 1);
+    while (!atomic_load(&shared->go)) {
+        usleep(1000);
+    }
+
+    char request[MAX_REQUEST_LEN];
+    char text[TAM_MSG];
+    long outstanding = 0, request_count = 0, message_index = 0;
+    result->start_ns = now_ns();
+
+    while (message_index < config.messages || outstanding > 0) {
+        // Enviar mientras quede sitio en la ventana
+        while (outstanding < config.window && message_index < config.messages) {
+            int topic = (index + request_count++) % config.topics;
+            char topic_name[TOPIC_NAME_LEN];
+            snprintf(topic_name, sizeof(topic_name), "b%d_%d", bench_pid, topic);
+            FrameWriter writer;
+            int count = 0;
+            begin_command(&writer, request, sizeof(request), config.batch > 1 ? CMD_MSG_BATCH : CMD_MSG);
+            while (count < config.batch && message_index < config.messages) {
+                size_t mark = writer.len;
+                build_message(text, sizeof(text));
+                frame_put_string(&writer, topic_name, MAX_TOPIC_FIELD);
+                frame_put_int(&writer, (message_index % 100) < config.persistent ? config.lifetime : 0);
+                frame_put_string(&writer, text, TAM_MSG - 1);
+                if (writer.overflow) {
+                    writer.len = mark; // el lote está lleno
+                    writer.overflow = 0;
+                    break;
+                }
+                count++;
+                message_index++;
+            }
+            send_frame(&writer);
+            result->sent += count;
+            outstanding++;
+        }
+
+        // Recoger las confirmaciones (las notificaciones sin secuencia no cuentan)
+        if (!wait_replies(REPLY_TIMEOUT_MS)) {
+            fprintf(stderr, "%s: sin confirmaciones del servidor\n", username);
+            result->failed = 1;
+            break;
+        }
+        while (frame_stream_next(&replies, MAX_FRAME_LEN, &frame, &len) == 1) {
+            FrameHeader header;
+            FrameReader reader;
+            frame_open(&reader, &header, frame);
+            if (header.seq == 0) {
+                continue;
+            }
+            if (header.type == REPLY_ACK) {
+                result->accepted += frame_get_int(&reader);
+                result->rejected += frame_get_int(&reader);
+                outstanding--;
+            } else if (header.type == REPLY_TEXT && config.batch == 1) {
+                frame_get_string(&reader, text, sizeof(text));
+                if (strncmp(text, "Mensaje enviado", 15) == 0) {
+                    result->accepted++;
+                } else {
+                    result->rejected++;
+                }
+                outstanding--;
+            } else if (header.type == REPLY_ERROR && config.batch == 1) {
+                // El servidor responde los mensajes rechazados con su propio tipo de respuesta
+                result->rejected++;
+                outstanding--;
+            }
+        }
+    }
+    result->end_ns = now_ns();
+    close_session();
+}
+
+// Función principal de un suscriptor simulado
+void run_subscriber(int index) {
+    BenchResult *result = &shared->results[config.publishers + index];
+    open_session("bs", index);
+
+    // Suscribirse a los tópicos que le tocan: el tópico k lo siguen los suscriptores k .. k + fanout - 1
+    uint32_t first_subscribe = seq + 1;
+    int subscriptions = 0;
+    for (int topic = 0; topic < config.topics; topic++) {
+        if (((index - topic) % config.subscribers + config.subscribers) % config.subscribers < config.fanout) {
+            char frame[MAX_REQUEST_LEN];
+            char topic_name[TOPIC_NAME_LEN];
+            FrameWriter writer;
+            snprintf(topic_name, sizeof(topic_name), "b%d_%d", bench_pid, topic);
+            begin_command(&writer, frame, sizeof(frame), CMD_SUBSCRIBE);
+            frame_put_string(&writer, topic_name, MAX_TOPIC_FIELD);
+            send_frame(&writer);
+            subscriptions++;
+        }
+    }
+
+    // Esperar la respuesta de cada suscripción antes de declararse listo
+    const char *frame;
+    size_t len;
+    int confirmed = 0;
+    uint64_t deadline = now_ns() + READY_TIMEOUT_MS * 1000000ull;
+    while (confirmed < subscriptions && now_ns() < deadline) {
+        wait_replies(POLL_MS);
+        while (frame_stream_next(&replies, MAX_FRAME_LEN, &frame, &len) == 1) {
+            FrameHeader header;
+            memcpy(&header, frame, sizeof(header));
+            confirmed += header.seq >= first_subscribe;
+        }
+    }
+    if (confirmed < subscriptions) {
+        result->failed = 1;
+    }
+    atomic_fetch_add(&shared->ready, 1);
+
+    // Recibir las notificaciones hasta que el proceso principal dé la prueba por terminada
+    char text[TAM_MSG];
+    char topic[MAX_TOPIC_FIELD + 1];
+    char topic_prefix[TOPIC_NAME_LEN];
+    size_t prefix_len = snprintf(topic_prefix, sizeof(topic_prefix), "b%d_", bench_pid);
+    while (!atomic_load(&shared->stop)) {
+        if (!wait_replies(POLL_MS)) {
+            continue;
+        }
+        uint64_t now = now_ns();
+        while (frame_stream_next(&replies, MAX_FRAME_LEN, &frame, &len) == 1) {
+            FrameHeader header;
+            FrameReader reader;
+            frame_open(&reader, &header, frame);
+            if (header.type != REPLY_MESSAGE) {
+                continue;
+            }
+            // Mensaje publicado: número, tópico, usuario y "<instante> <relleno>" (solo cuentan los de esta prueba)
+            frame_get_u64(&reader);
+            frame_get_string(&reader, topic, sizeof(topic));
+            frame_get_string(&reader, text, sizeof(text)); // usuario
+            frame_get_string(&reader, text, sizeof(text));
+            if (reader.error || strncmp(topic, topic_prefix, prefix_len) != 0) {
+                continue;
+            }
+            uint64_t sent_ns = strtoull(text, NULL, 10);
+            result->hist[hist_index(now > sent_ns ? now - sent_ns : 0)]++;
+            atomic_fetch_add(&result->received, 1);
+        }
+    }
+    close_session();
+}
+
+// Función para lanzar un proceso de la prueba
+pid_t spawn(void (*run)(int), int index) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        run(index);
+        exit(EXIT_SUCCESS);
+    }
+    if (pid == -1) {
+        perror("Error al crear un proceso de la prueba");
+    }
+    return pid;
+}
+
+// Función para sumar las entregas recibidas hasta ahora
+long total_received() {
+    long total = 0;
+    for (int i = 0; i < config.subscribers; i++) {
+        total += atomic_load(&shared->results[config.publishers + i].received);
+    }
+    return total;
+}
+
+// Función para mostrar el uso del generador
+void usage(const char *program) {
+    fprintf(stderr, "Uso: %s [-p publicadores] [-s suscriptores] [-t tópicos] [-f suscriptores por tópico]\n"
+                    "          [-n mensajes por publicador] [-m bytes por mensaje] [-P %% persistentes]\n"
+                    "          [-l lifetime] [-b mensajes por solicitud] [-w ventana] [-d espera final en ms]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "p:s:t:f:n:m:P:l:b:w:d:")) != -1) {
+        switch (option) {
+            case 'p': config.publishers = atoi(optarg); break;
+            case 's': config.subscribers = atoi(optarg); break;
+            case 't': config.topics = atoi(optarg); break;
+            case 'f': config.fanout = atoi(optarg); break;
+            case 'n': config.messages = atol(optarg); break;
+            case 'm': config.size = atoi(optarg); break;
+            case 'P': config.persistent = atoi(optarg); break;
+            case 'l': config.lifetime = atoi(optarg); break;
+            case 'b': config.batch = atoi(optarg); break;
+            case 'w': config.window = atoi(optarg); break;
+            case 'd': config.drain_ms = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (config.publishers < 1 || config.subscribers < 0 || config.topics < 1 || config.messages < 1 ||
+        config.batch < 1 || config.window < 1 || config.size < 1 || config.size > TAM_MSG - 1) {
+        usage(argv[0]);
+    }
+    if (config.fanout > config.subscribers) {
+        config.fanout = config.subscribers;
+    }
+    if (access(SERVER_PIPE, F_OK) != 0) {
+        printf("No está el activo el servidor.\n");
+        return EXIT_FAILURE;
+    }
+
+    int processes = config.publishers + config.subscribers;
+    shared = mmap(NULL, sizeof(BenchShared) + processes * sizeof(BenchResult), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("Error al reservar la memoria compartida");
+        return EXIT_FAILURE;
+    }
+    bench_pid = getpid();
+    pid_t *pids = calloc(processes, sizeof(pid_t));
+
+    // Suscriptores y publicadores inician sesión; los publicadores esperan a la señal de salida
+    for (int i = 0; i < config.subscribers; i++) {
+        pids[config.publishers + i] = spawn(run_subscriber, i);
+    }
+    for (int i = 0; i < config.publishers; i++) {
+        pids[i] = spawn(run_publisher, i);
+    }
+    uint64_t deadline = now_ns() + READY_TIMEOUT_MS * 1000000ull;
+    while (atomic_load(&shared->ready) < processes && now_ns() < deadline) {
+        usleep(1000);
+    }
+    if (atomic_load(&shared->ready) < processes) {
+        fprintf(stderr, "No todos los procesos de la prueba iniciaron sesión.\n");
+    }
+    atomic_store(&shared->go, 1);
+
+    // Esperar a los publicadores
+    for (int i = 0; i < config.publishers; i++) {
+        waitpid(pids[i], NULL, 0);
+    }
+
+    // Totales de los publicadores; cada mensaje aceptado debe llegar a fanout suscriptores
+    long sent = 0, accepted = 0, rejected = 0;
+    uint64_t start = UINT64_MAX, end = 0;
+    int failed = 0;
+    for (int i = 0; i < config.publishers; i++) {
+        BenchResult *result = &shared->results[i];
+        sent += result->sent;
+        accepted += result->accepted;
+        rejected += result->rejected;
+        failed += result->failed;
+        start = result->start_ns < start ? result->start_ns : start;
+        end = result->end_ns > end ? result->end_ns : end;
+    }
+    long expected = accepted * config.fanout;
+
+    // Esperar a que lleguen todas las entregas o a que dejen de llegar durante drain_ms
+    long received = total_received(), last = -1;
+    uint64_t last_progress = now_ns();
+    while (received < expected && now_ns() - last_progress < config.drain_ms * 1000000ull) {
+        usleep(POLL_MS * 1000);
+        received = total_received();
+        if (received != last) {
+            last = received;
+            last_progress = now_ns();
+        }
+    }
+    uint64_t delivered_end = now_ns() - (received < expected ? config.drain_ms * 1000000ull : 0);
+    atomic_store(&shared->stop, 1);
+    for (int i = config.publishers; i < processes; i++) {
+        waitpid(pids[i], NULL, 0);
+    }
+
+    // Sumar los histogramas de los suscriptores
+    static uint64_t hist[HIST_BUCKETS];
+    uint64_t samples = 0, max = 0;
+    for (int i = config.publishers; i < processes; i++) {
+        failed += shared->results[i].failed;
+        for (int j = 0; j < HIST_BUCKETS; j++) {
+            hist[j] += shared->results[i].hist[j];
+            samples += shared->results[i].hist[j];
+            if (shared->results[i].hist[j]) {
+                max = hist_value(j) > max ? hist_value(j) : max;
+            }
+        }
+    }
+    received = total_received();
+
+    double seconds = end > start ? (end - start) / 1e9 : 0;
+    double delivery_seconds = delivered_end > start ? (delivered_end - start) / 1e9 : 0;
+    printf("Publicadores: %d, suscriptores: %d, tópicos: %d, suscriptores por tópico: %d\n",
+           config.publishers, config.subscribers, config.topics, config.fanout);
+    printf("Mensajes: %d bytes, %d%% persistentes, %d por solicitud, ventana de %d solicitudes\n",
+           config.size, config.persistent, config.batch, config.window);
+    printf("Publicados: %ld mensajes (aceptados %ld, rechazados %ld) en %.3f s: %.0f mensajes/s\n",
+           sent, accepted, rejected, seconds, seconds > 0 ? sent / seconds : 0.0);
+    printf("Entregas: %ld de %ld esperadas (pérdida %ld, %.2f%%) en %.3f s: %.0f entregas/s\n",
+           received, expected, expected - received, expected ? 100.0 * (expected - received) / expected : 0.0,
+           delivery_seconds, delivery_seconds > 0 ? received / delivery_seconds : 0.0);
+    if (samples > 0) {
+        printf("Latencia de extremo a extremo: p50 %.1f us, p99 %.1f us, p999 %.1f us, máx %.1f us\n",
+               hist_percentile(hist, samples, 0.50) / 1e3, hist_percentile(hist, samples, 0.99) / 1e3,
+               hist_percentile(hist, samples, 0.999) / 1e3, max / 1e3);
+    }
+    if (failed) {
+        printf("Procesos con errores: %d\n", failed);
+    }
+    free(pids);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
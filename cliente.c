@@ -1,42 +1,67 @@
 #include "util.h"
+#include "plataforma.h"
 
-// Struct de comunicación con el manager
+#define DEFAULT_BATCH_WINDOW 16 // lotes sin confirmar por defecto si no se define BATCH_WINDOW
+
+// Struct del modo por lotes (--batch)
 typedef struct {
-    char client_pipe[256];
-    int command_type;
-    char topic[50];
-    char username[50];
-    pid_t pid;
-    int lifetime;
-    char message[TAM_MSG];
-} Request;
-
-Request msg;
-
-// Función para enviar un comando al servidor
-void send_command_to_server(Request *msg) {
-    int fd = open(SERVER_PIPE, O_WRONLY);
-    if (fd == -1) {
-        perror("Error al abrir la pipe del servidor");
-        exit(EXIT_FAILURE);
+    int active;
+    int window; // lotes sin confirmar a partir de los cuales se deja de leer la entrada
+    long sent, accepted, rejected; // totales de mensajes
+    int count; // mensajes del lote en construcción
+    struct timespec start;
+} Batch;
+
+// Struct de la entrada de comandos (entrada estándar o fichero del modo por lotes)
+typedef struct {
+    int fd;
+    int open; // aún no se ha llegado al final
+    int pollable; // se puede vigilar con epoll (no es un fichero regular)
+    int watched; // está en el epoll
+    char buf[8192]; // líneas pendientes de completar
+    size_t len;
+} Input;
+
+Session *session; // sesión con el servidor (libplataforma)
+Batch batch;
+Input input;
+
+// Función para mostrar un mensaje recibido; su número sirve de cursor para volver a suscribirse
+// sin repetir lo ya visto
+void print_message(Session *s, const SessionMessage *message, void *arg) {
+    printf("[%llu] %s %s %s\n", (unsigned long long)message->id, message->topic, message->user, message->text);
+}
+
+// Función para mostrar el resultado de una solicitud
+void print_result(Session *s, const SessionResult *result, void *arg) {
+    printf("%s\n", result->text);
+}
+
+// Función para mostrar un aviso del servidor
+void print_notice(Session *s, const char *text, void *arg) {
+    printf("%s\n", text);
+}
+
+// Función para anotar la confirmación de un lote
+void batch_acknowledge(Session *s, const SessionResult *result, void *arg) {
+    batch.accepted += result->accepted;
+    batch.rejected += result->rejected;
+    if (!result->ok) {
+        printf("Error: el servidor no pudo guardar los mensajes del lote %u.\n", result->seq);
     }
-    write(fd, msg, sizeof(Request));
-    close(fd);
 }
 
 // Función para manejar la señal SIGINT (CTRL+C del cliente)
 void handle_sigint(int sig) {
     printf("\nSe recibió la señal SIGINT. Limpiando recursos...\n");
-    msg.command_type = 6;
-    send_command_to_server(&msg);
-    unlink(msg.client_pipe);
+    session_close(session, SESSION_INTERRUPT);
     exit(0);
 }
 
-// Función para manejar la señal SIGTERM (close, remove y CTRL+C del manager)
+// Función para manejar la señal SIGTERM
 void handle_sigterm(int sig) {
     printf("\nSe recibió la señal SIGTERM. Cerrando el cliente...\n");
-    unlink(msg.client_pipe);
+    session_close(session, SESSION_DROP);
     exit(0);
 }
 
@@ -61,73 +86,179 @@ void setup_signal_handlers() {
     }
 }
 
-// Función para procesar los comandos del usuario
-void handle_user_input() {
-    char input[512];
-    fgets(input, sizeof(input), stdin);
-    input[strcspn(input, "\n")] = 0;
+// Función para avisar de una solicitud que no se pudo enviar
+void check_sent(int status) {
+    if (status == -1) {
+        if (errno == EMSGSIZE) {
+            printf("Error: el comando es demasiado largo.\n");
+        } else {
+            perror("Error al escribir en la pipe del servidor");
+        }
+    }
+}
+
+// Función para leer el tópico, la duración y el mensaje de un comando "msg" (0 si no es válido)
+int parse_msg(const char *input, char *topic, int *duration, char *mensaje) {
+    *duration = 0;
+    mensaje[0] = '\0';
+
+    // Leer el tópico y la duración, y luego el mensaje completo
+    int args = sscanf(input + 4, "%128s %d %[^\n]", topic, duration, mensaje);
+
+    if (args < 2 && args == 1) {
+        // Si no se pasan ambos parámetros (tópico y duración), el mensaje sigue
+        strncpy(mensaje, input + 4 + strlen(topic) + 1, TAM_MSG - 1);  // Limita el mensaje a TAM_MSG - 1 para el '\0'
+        mensaje[TAM_MSG - 1] = '\0';  // Asegura el fin de la cadena
+    }
+
+    // Verificar que el mensaje no exceda el tamaño máximo (300 caracteres)
+    if (strlen(mensaje) > 300) {
+        printf("Error: El mensaje excede el límite de 300 caracteres.\n");
+        return 0;
+    }
+    return args >= 1;
+}
 
+// Función para procesar un comando del usuario
+void handle_user_input(const char *input) {
     if (strncmp(input, "subscribe ", 10) == 0) {
-        msg.command_type = 1;
-        strncpy(msg.topic, input + 10, sizeof(msg.topic));
-        send_command_to_server(&msg);
+        // subscribe <tópico> [all | latest | <número>]: desde qué mensaje retenido se reenvía
+        char topic[MAX_TOPIC_FIELD + 1];
+        char cursor[32];
+        int args = sscanf(input + 10, "%128s %31s", topic, cursor);
+        if (args < 1) {
+            printf("Uso: subscribe <tópico> [all | latest | <número de mensaje>]\n");
+            return;
+        }
+        uint64_t from = CURSOR_ALL;
+        if (args == 2) {
+            char *end;
+            from = strcmp(cursor, "all") == 0 ? CURSOR_ALL :
+                   strcmp(cursor, "latest") == 0 ? CURSOR_LATEST : strtoull(cursor, &end, 10);
+            if (from == 0 && strcmp(cursor, "all") != 0 && (end == cursor || *end != '\0')) {
+                printf("Cursor no válido: use all, latest o un número de mensaje.\n");
+                return;
+            }
+        }
+        check_sent(session_subscribe(session, topic, from, print_message, print_result, NULL));
 
     } else if (strcmp(input, "topics") == 0) {
-        msg.command_type = 2;
-        msg.topic[0] = '\0';
-        send_command_to_server(&msg);
+        check_sent(session_list_topics(session, print_result, NULL));
 
     } else if (strcmp(input, "exit") == 0) {
-        msg.command_type = 3;
         printf("Cliente: Saliendo...\n");
-        send_command_to_server(&msg);
+        session_close(session, SESSION_EXIT);
         exit(0);
 
     } else if (strncmp(input, "unsubscribe ", 12) == 0) {
-        msg.command_type = 4;
-        strncpy(msg.topic, input + 12, sizeof(msg.topic));
-        send_command_to_server(&msg);
+        check_sent(session_unsubscribe(session, input + 12, print_result, NULL));
 
     } else if (strncmp(input, "msg ", 4) == 0) {
         char topic[TOPIC_NAME_LEN];
-        int duration = 0;
+        int duration;
         char mensaje[TAM_MSG];  // Asegúrate de que TAM_MSG sea al menos 300
-
-        // Leer el tópico y la duración, y luego el mensaje completo
-        int args = sscanf(input + 4, "%s %d %[^\n]", topic, &duration, mensaje);
-
-        if (args < 2 && args == 1) {
-            // Si no se pasan ambos parámetros (tópico y duración), el mensaje sigue
-            strncpy(mensaje, input + 4 + strlen(topic) + 1, TAM_MSG - 1);  // Limita el mensaje a TAM_MSG - 1 para el '\0'
-            mensaje[TAM_MSG - 1] = '\0';  // Asegura el fin de la cadena
-        }
-
-        // Verificar que el mensaje no exceda el tamaño máximo (300 caracteres)
-        if (strlen(mensaje) > 300) {
-            printf("Error: El mensaje excede el límite de 300 caracteres.\n");
+        if (!parse_msg(input, topic, &duration, mensaje)) {
             return;
         }
+        check_sent(session_publish(session, topic, duration, mensaje, print_result, NULL));
+    } else {
+        printf("Comando no reconocido. Intente de nuevo.\n");
+    }
+}
 
-        // Copiar los datos a la estructura msg
-        strncpy(msg.topic, topic, sizeof(msg.topic) - 1);
-        msg.topic[sizeof(msg.topic) - 1] = '\0';  // Asegura el fin de la cadena
-        msg.lifetime = duration;
+// Función para enviar el lote en construcción
+void batch_flush() {
+    // La ventana se comprueba entre lecturas: una lectura puede completar algún lote más
+    if (batch.count > 0) {
+        int status = session_batch_flush(session);
+        check_sent(status);
+        if (status == 0) {
+            batch.sent += batch.count;
+            batch.count = 0;
+        }
+    }
+}
 
-        strncpy(msg.message, mensaje, TAM_MSG - 1);
-        msg.message[TAM_MSG - 1] = '\0';  // Asegura el fin de la cadena
+// Función para procesar una línea en el modo por lotes: los "msg" se agrupan y el resto de comandos
+// se envía después del lote en construcción para mantener el orden
+void handle_batch_input(const char *input) {
+    char topic[TOPIC_NAME_LEN];
+    int duration;
+    char mensaje[TAM_MSG];
+
+    if (strncmp(input, "msg ", 4) == 0) {
+        if (parse_msg(input, topic, &duration, mensaje)) {
+            int status = session_batch_add(session, topic, duration, mensaje);
+            check_sent(status);
+            if (status == 0) {
+                batch.count++;
+            }
+        }
+    } else if (input[0] != '\0') {
+        batch_flush();
+        handle_user_input(input);
+    }
+}
 
-        msg.command_type = 5;
+// Función para leer la entrada (en el modo por lotes, hasta que se vacía o se llena la ventana)
+void read_input() {
+    while (input.open && (!batch.active || session_pending(session) < batch.window)) {
+        ssize_t bytes_read = read(input.fd, input.buf + input.len, sizeof(input.buf) - 1 - input.len);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (bytes_read <= 0) {
+            input.open = 0; // fin de la entrada
+            if (input.len > 0) {
+                input.buf[input.len] = '\0';
+                batch.active ? handle_batch_input(input.buf) : handle_user_input(input.buf);
+                input.len = 0;
+            }
+            break;
+        }
+        input.len += bytes_read;
+
+        char *line = input.buf;
+        char *newline;
+        while ((newline = memchr(line, '\n', input.len - (line - input.buf))) != NULL) {
+            *newline = '\0';
+            batch.active ? handle_batch_input(line) : handle_user_input(line);
+            line = newline + 1;
+        }
+        input.len -= line - input.buf;
+        memmove(input.buf, line, input.len);
+        if (input.len == sizeof(input.buf) - 1) {
+            input.buf[input.len] = '\0';
+            batch.active ? handle_batch_input(input.buf) : handle_user_input(input.buf);
+            input.len = 0;
+        }
+        if (!batch.active) {
+            break; // en modo interactivo, una lectura por aviso
+        }
+    }
+    // Un lote a medio llenar se envía cuando la entrada no trae más por ahora
+    if (batch.active && (!input.open || session_pending(session) < batch.window)) {
+        batch_flush();
+    }
+}
 
-        // Enviar el comando al servidor
-        send_command_to_server(&msg);
-    } else {
-        printf("Comando no reconocido. Intente de nuevo.\n");
+// Función para vigilar la entrada solo mientras se puede leer de ella (los ficheros regulares,
+// que epoll no admite, están siempre listos)
+void update_input_watch(int epoll_fd) {
+    int wanted = input.open && (!batch.active || session_pending(session) < batch.window);
+    if (input.pollable && wanted != input.watched) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = input.fd };
+        epoll_ctl(epoll_fd, wanted ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, input.fd, &ev);
+        input.watched = wanted;
     }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Uso: %s <usuario>\n", argv[0]);
+    if (argc < 2 || (argc > 2 && strcmp(argv[2], "--batch") != 0) || argc > 4) {
+        fprintf(stderr, "Uso: %s <usuario> [--batch [fichero]]\n", argv[0]);
         return EXIT_FAILURE;
     }
     // Comprobar que solo ya está en ejecución el manager
@@ -136,60 +267,106 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    // Llamada a la función que configura los manejadores de señales
-    setup_signal_handlers();
+    // Modo por lotes: los "msg" de un fichero o de la entrada estándar se publican en lotes
+    input.fd = STDIN_FILENO;
+    input.open = 1;
+    if (argc > 2) {
+        batch.active = 1;
+        const char *window = getenv("BATCH_WINDOW");
+        batch.window = window && atoi(window) > 0 ? atoi(window) : DEFAULT_BATCH_WINDOW;
+        if (argc > 3 && (input.fd = open(argv[3], O_RDONLY)) == -1) {
+            perror("Error al abrir el fichero de mensajes");
+            return EXIT_FAILURE;
+        }
+        fcntl(input.fd, F_SETFL, fcntl(input.fd, F_GETFL) | O_NONBLOCK);
+        clock_gettime(CLOCK_MONOTONIC, &batch.start);
+    }
 
-    // Asignamos el nombre de usuario y PID al mensaje
-    strncpy(msg.username, argv[1], sizeof(msg.username) - 1);
-    msg.pid = getpid();
-    msg.username[sizeof(msg.username) - 1] = '\0'; // nos aseguramos que el último índice del array es la finalización
+    // Inicio de sesión: la biblioteca crea la pipe del cliente y avisa al servidor
+    // Un proceso por sesión: el servidor lo termina al rechazarla o con remove
+    SessionHandlers handlers = { print_result, print_message, print_notice, NULL, 1 };
+    session = session_open(argv[1], &handlers);
+    if (!session) {
+        perror("Error al abrir la sesión");
+        return EXIT_FAILURE;
+    }
+    session_batch_begin(session, batch_acknowledge, NULL);
 
-    // Usamos el PID para crear el nombre del pipe
-    snprintf(msg.client_pipe, sizeof(msg.client_pipe), "client_pipe_%d", msg.pid);
-    mkfifo(msg.client_pipe, 0600);
+    // Llamada a la función que configura los manejadores de señales
+    setup_signal_handlers();
 
-    // Comando para inicio de sesión (0)
-    msg.command_type = 0; 
-    send_command_to_server(&msg);
+    // Transporte opcional por memoria compartida; las pipes siguen como alternativa
+    const char *shm_transport = getenv("SHM_TRANSPORT");
+    if (shm_transport && atoi(shm_transport) == 1 && session_use_ring(session, print_result, NULL) == -1) {
+        perror("Error al crear la memoria compartida, se usan las pipes");
+    }
 
-    // Creamos el pipe del cliente
-    int client_fd = open(msg.client_pipe, O_RDONLY | O_NONBLOCK);
-    if (client_fd == -1) {
-        perror("Error al abrir la pipe del cliente");
-        unlink(msg.client_pipe);
+    // Bucle de eventos: la entrada y la pipe de la sesión en un mismo epoll
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        perror("Error al crear el bucle de eventos");
+        session_close(session, SESSION_EXIT);
         return EXIT_FAILURE;
     }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = input.fd };
+    input.pollable = input.watched = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input.fd, &ev) == 0;
+    ev.data.fd = session_fd(session);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session_fd(session), &ev);
 
     // Bucle infinito para leer y escribir comandos
     while (1) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds); // limpia el conjunto de descriptores de archivo
-        FD_SET(0, &read_fds); // añade la entrada estándar al conjunto.
-        FD_SET(client_fd, &read_fds); // añade el descriptor del pipe del cliente al conjunto.
+        // En el modo por lotes, terminar cuando se ha enviado toda la entrada y está confirmada
+        if (batch.active && !input.open && session_pending(session) == 0) {
+            // Un lote que no se pudo enviar cuenta como rechazado
+            batch.sent += batch.count;
+            batch.rejected += batch.count;
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double seconds = (end.tv_sec - batch.start.tv_sec) + (end.tv_nsec - batch.start.tv_nsec) / 1e9;
+            printf("Lotes terminados: %ld mensajes enviados (%ld aceptados, %ld rechazados) en %.3f s (%.0f mensajes/s).\n",
+                   batch.sent, batch.accepted, batch.rejected, seconds, seconds > 0 ? batch.sent / seconds : 0.0);
+            session_close(session, SESSION_EXIT);
+            return 0;
+        }
 
-        // Espera actividad en los descriptores de archivo especificados.
-        int activity = select(client_fd + 1, &read_fds, NULL, NULL, NULL);
+        // Un lote a medio llenar que esperaba a la ventana se envía en cuanto hay sitio
+        if (batch.active && session_pending(session) < batch.window) {
+            batch_flush();
+        }
+        update_input_watch(epoll_fd);
+        int input_ready = !input.pollable && input.open && (!batch.active || session_pending(session) < batch.window);
+        struct epoll_event events[2];
+        int activity = epoll_wait(epoll_fd, events, 2, input_ready ? 0 : -1);
 
-        // Comprueba si ocurrió un error en select
+        // Comprueba si ocurrió un error en epoll_wait
         if (activity == -1) {
-            perror("Error en select");
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error en epoll_wait");
             break;
         }
 
-        // Si hay actividad en la entrada del usuario, se envia el comando
-        if (FD_ISSET(0, &read_fds)) {
-            handle_user_input();
-        }
+        for (int i = 0; i < activity; i++) {
+            // Si hay actividad en la entrada del usuario, se envia cada comando completo
+            if (events[i].data.fd == input.fd) {
+                read_input();
+            }
 
-        // Si hay actividad en la respuesta del servidor, se imprime la respuesta
-        if (FD_ISSET(client_fd, &read_fds)) {
-            char response[256];
-            ssize_t bytes_read = read(client_fd, response, sizeof(response) - 1);
-            if (bytes_read > 0) {
-                response[bytes_read] = '\0'; // la cadena debe acabarse con el caracter nulo
-                printf("%s\n", response);
+            // Si hay actividad en la respuesta del servidor, la biblioteca llama a las funciones de retorno
+            if (events[i].data.fd == session_fd(session)) {
+                if (session_process(session) == -1) {
+                    // El servidor cerró su extremo de la pipe
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session_fd(session), NULL);
+                    printf("El servidor ha cerrado la sesión.\n");
+                }
+                fflush(stdout);
             }
         }
+        if (input_ready) {
+            read_input(); // fichero regular: siempre hay datos o fin de fichero
+        }
     }
+    session_close(session, SESSION_EXIT);
     return 0;
 }
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "cola.h"
+#include "metricas.h"
+
+struct TaskQueue {
+    _Alignas(64) _Atomic size_t tail; // siguiente posición que reservan los productores
+    _Alignas(64) size_t head; // siguiente posición que lee el consumidor (solo la usa él)
+    _Alignas(64) _Atomic int signaled; // ya se avisó al consumidor desde que encontró la cola vacía
+    _Atomic size_t *sequences; // secuencia de cada posición: pos = libre para la vuelta pos,
+                               // pos + 1 = tarea publicada
+    char *tasks; // tareas (anillo de mask + 1 posiciones)
+    size_t task_size;
+    size_t mask;
+    int event_fd; // activo mientras hay tareas
+};
+
+// Función para avisar al consumidor si no se le ha avisado desde que encontró la cola vacía
+static void signal_consumer(TaskQueue *queue) {
+    if (!atomic_exchange(&queue->signaled, 1)) {
+        uint64_t one = 1;
+        write(queue->event_fd, &one, sizeof(one));
+    }
+}
+
+// Función para sacar sin esperar hasta max tareas publicadas (se detiene en la primera posición
+// reservada cuyo productor aún no la ha publicado)
+static size_t dequeue(TaskQueue *queue, char *tasks, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        size_t pos = queue->head;
+        _Atomic size_t *sequence = &queue->sequences[pos & queue->mask];
+        if (atomic_load_explicit(sequence, memory_order_acquire) != pos + 1) {
+            break;
+        }
+        memcpy(tasks + n * queue->task_size, queue->tasks + (pos & queue->mask) * queue->task_size, queue->task_size);
+        // La posición queda libre para la siguiente vuelta del anillo
+        atomic_store_explicit(sequence, pos + queue->mask + 1, memory_order_release);
+        queue->head = pos + 1;
+        n++;
+    }
+    return n;
+}
+
+TaskQueue *task_queue_create(size_t task_size, size_t capacity) {
+    size_t cap = 2;
+    while (cap < capacity) {
+        cap *= 2;
+    }
+    TaskQueue *queue = aligned_alloc(64, (sizeof(TaskQueue) + 63) / 64 * 64);
+    if (!queue) {
+        return NULL;
+    }
+    memset(queue, 0, sizeof(TaskQueue));
+    queue->sequences = malloc(cap * sizeof(*queue->sequences));
+    queue->tasks = malloc(cap * task_size);
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!queue->sequences || !queue->tasks || queue->event_fd == -1) {
+        if (queue->event_fd != -1) {
+            close(queue->event_fd);
+        }
+        free(queue->sequences);
+        free(queue->tasks);
+        free(queue);
+        return NULL;
+    }
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&queue->sequences[i], i);
+    }
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->signaled, 0);
+    queue->task_size = task_size;
+    queue->mask = cap - 1;
+    return queue;
+}
+
+void task_queue_push(TaskQueue *queue, const void *task) {
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    int waited = 0;
+    for (;;) {
+        size_t sequence = atomic_load_explicit(&queue->sequences[pos & queue->mask], memory_order_acquire);
+        intptr_t diff = (intptr_t)(sequence - pos);
+        if (diff == 0) {
+            // Posición libre: reservarla (si otro productor se adelanta, pos pasa a su valor actual)
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Llena: la posición aún tiene la tarea de la vuelta anterior; esperar al consumidor
+            if (!waited) {
+                metrics_add(MET_QUEUE_FULL, 1);
+                waited = 1;
+            }
+            sched_yield();
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        } else {
+            // Otro productor ya reservó esta posición
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+    memcpy(queue->tasks + (pos & queue->mask) * queue->task_size, task, queue->task_size);
+    atomic_store_explicit(&queue->sequences[pos & queue->mask], pos + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    signal_consumer(queue);
+}
+
+size_t task_queue_pop(TaskQueue *queue, void *tasks, size_t max) {
+    size_t n = dequeue(queue, tasks, max);
+    if (n == max) {
+        return n; // puede haber más: el descriptor sigue activo
+    }
+
+    // Vacía: desactivar el descriptor y permitir que el siguiente productor vuelva a avisar. Las
+    // tareas de los productores que vieron el aviso anterior ya están publicadas y se recogen al
+    // repasar la cola; los que publiquen después avisan de nuevo
+    uint64_t value;
+    read(queue->event_fd, &value, sizeof(value));
+    atomic_store(&queue->signaled, 0);
+    atomic_thread_fence(memory_order_seq_cst);
+    n += dequeue(queue, (char *)tasks + n * queue->task_size, max - n);
+    if (n == max) {
+        signal_consumer(queue); // pueden quedar tareas cuyos productores no van a avisar
+    }
+    return n;
+}
+
+int task_queue_fd(const TaskQueue *queue) {
+    return queue->event_fd;
+}
+
+void task_queue_destroy(TaskQueue *queue) {
+    close(queue->event_fd);
+    free(queue->sequences);
+    free(queue->tasks);
+    free(queue);
+}
@@ -0,0 +1,35 @@
+#ifndef COLA_H
+#define COLA_H
+
+#include <stddef.h>
+
+// Cola de tareas entre hilos, acotada y sin cerrojos (varios productores y un único consumidor).
+//
+// Los productores copian tareas de tamaño fijo en un anillo de capacidad fija: cada posición
+// lleva un número de secuencia que indica si está libre o ya tiene una tarea publicada, de modo
+// que reservar una posición es una sola operación atómica sobre el final de la cola. Si la cola
+// está llena, el productor espera a que el consumidor saque tareas (contrapresión).
+//
+// El consumidor saca tareas por lotes sin operaciones atómicas de lectura-modificación. El
+// descriptor de task_queue_fd se activa cuando la cola pasa de vacía a tener tareas y se
+// desactiva cuando el consumidor la encuentra vacía, de modo que se puede vigilar con epoll.
+
+typedef struct TaskQueue TaskQueue;
+
+// Crea una cola de capacity tareas (se redondea a una potencia de 2) de task_size bytes (NULL si falla)
+TaskQueue *task_queue_create(size_t task_size, size_t capacity);
+
+// Añade una copia de una tarea al final de la cola (espera si está llena)
+void task_queue_push(TaskQueue *queue, const void *task);
+
+// Saca hasta max tareas del principio de la cola copiándolas en tasks; devuelve cuántas sacó.
+// Solo la llama el hilo consumidor
+size_t task_queue_pop(TaskQueue *queue, void *tasks, size_t max);
+
+// Descriptor que se activa mientras la cola tiene tareas
+int task_queue_fd(const TaskQueue *queue);
+
+// Libera la cola y las tareas que queden
+void task_queue_destroy(TaskQueue *queue);
+
+#endif
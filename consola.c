@@ -0,0 +1,187 @@
+#include "util.h"
+#include "consola.h"
+#include "metricas.h"
+
+static int request_pipe[2] = { -1, -1 }; // consola -> bucle de eventos (ConsoleRequest)
+static int reply_pipe[2] = { -1, -1 }; // bucle de eventos -> consola (punteros a View)
+static pthread_t console_thread;
+
+// Función para imprimir la lista de usuarios conectados
+static void print_users(const View *view) {
+    printf("Lista de usuarios conectados:\n");
+    if (view->count == 0) {
+        printf("No hay usuarios conectados.\n");
+        return;
+    }
+    for (int i = 0; i < view->count; i++) {
+        printf("- %s (Pipe: %s)\n", view->users[i].name, view->users[i].client_pipe);
+    }
+}
+
+// Función para imprimir la lista de tópicos
+static void print_topics(const View *view) {
+    printf("Tópicos:\n");
+    if (view->count == 0) {
+        printf("No se encontraron tópicos para listar.\n");
+        return;
+    }
+    for (int i = 0; i < view->count; i++) {
+        printf(" - %s (Suscriptores: %d)\n", view->topics[i].name, view->topics[i].subscribers);
+    }
+}
+
+// Función para imprimir los mensajes retenidos de un tópico
+static void print_messages(const View *view) {
+    if (!view->found) {
+        printf("El tópico '%s' no existe.\n", view->topic);
+        return;
+    }
+    if (view->count == 0) {
+        printf("No hay mensajes en el tópico '%s'.\n", view->topic);
+        return;
+    }
+    for (int i = 0; i < view->count; i++) {
+        printf("Usuario: %s, Mensaje: %s\n", view->messages[i].user, view->messages[i].message);
+    }
+}
+
+// Función para enviar una petición al bucle de eventos (cabe en PIPE_BUF: la escritura es atómica)
+static void send_request(const ConsoleRequest *request) {
+    if (write(request_pipe[1], request, sizeof(*request)) != sizeof(*request)) {
+        perror("Error al enviar el comando al servidor");
+    }
+}
+
+// Función para atender una línea de la consola
+static void handle_console_line(const char *line) {
+    ConsoleRequest request = { 0 };
+    char topic[TOPIC_NAME_LEN];
+
+    if (strcmp(line, "users") == 0) {
+        request.is_view = 1;
+        request.kind = VIEW_USERS;
+    } else if (strcmp(line, "topics") == 0) {
+        request.is_view = 1;
+        request.kind = VIEW_TOPICS;
+    } else if (strcmp(line, "stats") == 0) {
+        // Las métricas son atómicas: se leen directamente sin pasar por el bucle de eventos
+        metrics_print(stdout);
+        fflush(stdout);
+        return;
+    } else if (strncmp(line, "show ", 5) == 0 && sscanf(line + 5, "%128s", topic) == 1) {
+        request.is_view = 1;
+        request.kind = VIEW_MESSAGES;
+        snprintf(request.text, sizeof(request.text), "%s", topic);
+    } else {
+        // Los demás comandos modifican el estado: los ejecuta el bucle de eventos
+        snprintf(request.text, sizeof(request.text), "%s", line);
+        send_request(&request);
+        return;
+    }
+
+    // Pedir la vista y esperar a que el bucle de eventos la entregue
+    send_request(&request);
+    View *view;
+    if (read(reply_pipe[0], &view, sizeof(view)) != sizeof(view) || !view) {
+        printf("No se pudo obtener la información del servidor.\n");
+        return;
+    }
+    switch (view->kind) {
+        case VIEW_USERS:
+            print_users(view);
+            break;
+        case VIEW_TOPICS:
+            print_topics(view);
+            break;
+        case VIEW_MESSAGES:
+            print_messages(view);
+            break;
+    }
+    fflush(stdout);
+    free(view);
+}
+
+// Función principal del hilo de la consola: lee las líneas de la entrada estándar
+static void *console_loop(void *arg) {
+    char input[CONSOLE_LINE_LEN];
+    size_t input_len = 0;
+    ssize_t bytesRead;
+
+    while ((bytesRead = read(STDIN_FILENO, input + input_len, sizeof(input) - 1 - input_len)) != 0) {
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        input_len += bytesRead;
+
+        // Atender cada línea completa (o la línea entera si llena el buffer)
+        char *line = input;
+        char *newline;
+        while ((newline = memchr(line, '\n', input_len - (line - input))) != NULL) {
+            *newline = '\0';
+            handle_console_line(line);
+            line = newline + 1;
+        }
+        input_len -= line - input;
+        memmove(input, line, input_len);
+        if (input_len == sizeof(input) - 1) {
+            input[input_len] = '\0';
+            handle_console_line(input);
+            input_len = 0;
+        }
+    }
+
+    // Fin de la entrada estándar: el bucle de eventos deja de vigilar la consola
+    close(request_pipe[1]);
+    return NULL;
+}
+
+int console_start() {
+    if (pipe2(request_pipe, O_CLOEXEC) == -1 || pipe2(reply_pipe, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    fcntl(request_pipe[0], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&console_thread, NULL, console_loop, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(console_thread); // al cerrar el servidor puede seguir bloqueado leyendo la entrada
+    return request_pipe[0];
+}
+
+int console_read_request(ConsoleRequest *request) {
+    ssize_t bytesRead = read(request_pipe[0], request, sizeof(*request));
+    if (bytesRead == sizeof(*request)) {
+        return 1;
+    }
+    return bytesRead == 0 ? -1 : 0;
+}
+
+View *view_create(int kind, int count, size_t strings_len) {
+    size_t item_size = kind == VIEW_USERS ? sizeof(ViewUser) : kind == VIEW_TOPICS ? sizeof(ViewTopic) : sizeof(ViewMessage);
+    View *view = malloc(sizeof(View) + count * item_size + strings_len);
+    if (!view) {
+        return NULL;
+    }
+    view->kind = kind;
+    view->count = 0;
+    view->found = 0;
+    view->topic = "";
+    view->users = (void *)(view + 1);
+    view->strings = (char *)(view + 1) + count * item_size;
+    view->strings_used = 0;
+    return view;
+}
+
+const char *view_string(View *view, const char *text) {
+    char *copy = view->strings + view->strings_used;
+    size_t len = strlen(text) + 1;
+    memcpy(copy, text, len);
+    view->strings_used += len;
+    return copy;
+}
+
+void console_reply(View *view) {
+    write(reply_pipe[1], &view, sizeof(view));
+}
@@ -0,0 +1,72 @@
+#ifndef CONSOLA_H
+#define CONSOLA_H
+
+#include <stddef.h>
+
+// Consola del manager en un hilo propio.
+//
+// El hilo lee la entrada estándar y reenvía al bucle de eventos los comandos que modifican
+// el estado (remove, lock, unlock, export, close). Las consultas (users, topics, show) se
+// responden con una vista inmutable que el bucle de eventos copia al recibir la petición y
+// entrega al hilo de la consola; el formateo y la escritura por pantalla, que pueden ser
+// lentos, se hacen fuera del bucle de eventos y sin compartir nada con él. El comando stats
+// lee directamente las métricas, que se actualizan de forma atómica.
+
+#define CONSOLE_LINE_LEN 256 // longitud máxima de una línea de la consola
+
+// Tipos de vista
+enum { VIEW_USERS, VIEW_TOPICS, VIEW_MESSAGES };
+
+typedef struct {
+    const char *name; // Nombre de usuario
+    const char *client_pipe; // Pipe del cliente
+} ViewUser;
+
+typedef struct {
+    const char *name; // Nombre del tópico
+    int subscribers; // Número de suscriptores
+} ViewTopic;
+
+typedef struct {
+    const char *user; // Usuario que envió el mensaje
+    const char *message; // Contenido del mensaje
+} ViewMessage;
+
+// Vista inmutable del estado: un único bloque con los elementos y sus cadenas
+typedef struct {
+    int kind; // VIEW_USERS, VIEW_TOPICS o VIEW_MESSAGES
+    int count; // Número de elementos
+    int found; // VIEW_MESSAGES: indicador de si el tópico existe
+    const char *topic; // VIEW_MESSAGES: tópico consultado
+    union {
+        ViewUser *users;
+        ViewTopic *topics;
+        ViewMessage *messages;
+    };
+    char *strings; // Zona de las cadenas copiadas
+    size_t strings_used;
+} View;
+
+// Petición de la consola al bucle de eventos
+typedef struct {
+    int is_view; // 1 = consulta, 0 = comando que modifica el estado
+    int kind; // Tipo de vista de la consulta
+    char text[CONSOLE_LINE_LEN]; // Línea del comando o tópico consultado
+} ConsoleRequest;
+
+// Arranca el hilo de la consola; devuelve el descriptor de peticiones que vigila el bucle de eventos
+int console_start();
+
+// Lee una petición de la consola (1 si hay una, 0 si no hay más por ahora, -1 si la consola terminó)
+int console_read_request(ConsoleRequest *request);
+
+// Reserva una vista de count elementos con strings_len bytes para sus cadenas
+View *view_create(int kind, int count, size_t strings_len);
+
+// Copia una cadena en la zona de cadenas de la vista
+const char *view_string(View *view, const char *text);
+
+// Entrega una vista al hilo de la consola, que la imprime y la libera
+void console_reply(View *view);
+
+#endif
@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "entrega.h"
+#include "protocolo.h"
+#include "metricas.h"
+
+#define DEFAULT_DELIVERY_WORKERS 4 // máximo de hilos de entrega por defecto
+#define WORKER_EVENTS 64 // eventos atendidos en cada epoll_wait de un hilo de entrega
+#define RING_RETRY_MS 1 // espera antes de reintentar las colas cuyo anillo estaba lleno
+#define WRITE_IOVECS 64 // tramas escritas como máximo en cada writev
+
+// Hilo de entrega: atiende las colas listas para escribir y las pipes que vuelven a admitir datos
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock; // protege ready_head, ready_tail y stopping
+    Outbox *ready_head, *ready_tail; // colas con datos nuevos o cerradas
+    int stopping;
+    int wake_fd; // eventfd para despertar al hilo cuando hay colas listas
+    int epoll_fd; // pipes con escritura pendiente
+    Outbox *retry_head; // colas con el anillo lleno (solo las usa el hilo de entrega)
+} DeliveryWorker;
+
+struct Outbox {
+    pthread_mutex_t lock; // protege los campos siguientes salvo los del hilo de entrega
+    char *client_pipe; // ruta de la pipe del cliente
+    SharedFrame **frames; // tramas pendientes de escribir (cola circular)
+    size_t head; // posición de la primera trama pendiente
+    size_t count; // tramas pendientes
+    size_t cap; // capacidad de frames (potencia de 2)
+    size_t pending; // bytes pendientes
+    OutboxLimits limits; // marcas alta y baja y política de desbordamiento
+    int congested; // se descartan las notificaciones nuevas hasta bajar de la marca baja
+    int status; // OUTBOX_*
+    int scheduled; // la cola está en la lista de listas de su hilo
+    int closing; // el cliente se ha desconectado
+    int drain_watch; // avisar por drain_fd cuando pending baje a drain_low o menos
+    size_t drain_low;
+    Outbox *ready_next;
+    DeliveryWorker *worker;
+    RingRegion *ring; // anillo de memoria compartida de la sesión (NULL si se usa la pipe)
+    // Campos que solo usa el hilo de entrega
+    int fd; // descriptor de escritura no bloqueante (-1 si aún no se pudo abrir)
+    int registered; // el descriptor está en el epoll del hilo
+    size_t written; // bytes ya escritos en la pipe de la primera trama pendiente
+    int retrying; // la cola está en la lista de reintentos del hilo
+    Outbox *retry_next;
+    uint64_t pending_since; // instante en que la cola pasó de vacía a tener datos
+};
+
+static DeliveryWorker workers[MAX_DELIVERY_WORKERS];
+static int worker_count = 0;
+static int next_worker = 0; // reparto de las colas entre los hilos
+static int drain_fd = -1; // aviso de que se ha vaciado una cola vigilada
+static int evict_fd = -1; // aviso de que alguna cola ha dejado de admitir tramas
+
+// Función para añadir una cola a la lista de listas de su hilo y despertarlo
+static void schedule(Outbox *outbox) {
+    DeliveryWorker *worker = outbox->worker;
+    metrics_lock(&worker->lock);
+    outbox->ready_next = NULL;
+    if (worker->ready_tail) {
+        worker->ready_tail->ready_next = outbox;
+    } else {
+        worker->ready_head = outbox;
+    }
+    worker->ready_tail = outbox;
+    pthread_mutex_unlock(&worker->lock);
+
+    uint64_t one = 1;
+    write(worker->wake_fd, &one, sizeof(one));
+}
+
+// Función para quitar una cola de la lista de reintentos de su hilo
+static void remove_retry(DeliveryWorker *worker, Outbox *outbox) {
+    Outbox **link = &worker->retry_head;
+    while (*link != outbox) {
+        link = &(*link)->retry_next;
+    }
+    *link = outbox->retry_next;
+    outbox->retrying = 0;
+}
+
+// Función para obtener la trama pendiente número i de una cola
+static SharedFrame *pending_frame(const Outbox *outbox, size_t i) {
+    return outbox->frames[(outbox->head + i) & (outbox->cap - 1)];
+}
+
+// Función para soltar las primeras tramas pendientes de una cola
+static void drop_frames(Outbox *outbox, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        SharedFrame *frame = pending_frame(outbox, i);
+        outbox->pending -= frame->len;
+        shared_frame_release(frame);
+    }
+    outbox->head = (outbox->head + count) & (outbox->cap ? outbox->cap - 1 : 0);
+    outbox->count -= count;
+}
+
+// Función para descartar las notificaciones pendientes más antiguas hasta que queden como mucho target
+// bytes pendientes; las respuestas y la trama a medio escribir en la pipe se conservan en su orden
+static void drop_oldest(Outbox *outbox, size_t target) {
+    size_t kept = 0, dropped = 0;
+    for (size_t i = 0; i < outbox->count; i++) {
+        SharedFrame *frame = pending_frame(outbox, i);
+        if (outbox->pending > target && frame->droppable && !(i == 0 && outbox->written > 0)) {
+            outbox->pending -= frame->len;
+            shared_frame_release(frame);
+            dropped++;
+        } else {
+            outbox->frames[(outbox->head + kept) & (outbox->cap - 1)] = frame;
+            kept++;
+        }
+    }
+    outbox->count = kept;
+    if (dropped > 0) {
+        metrics_add(MET_OUTBOX_DROPPED, dropped);
+    }
+}
+
+// Función para dejar de admitir tramas en una cola cuyo cliente se da por perdido, soltar lo
+// pendiente y avisar por evict_fd para que se cierre su sesión
+static void fail_outbox(Outbox *outbox, int status) {
+    if (outbox->status != OUTBOX_OK) {
+        return;
+    }
+    outbox->status = status;
+    drop_frames(outbox, outbox->count);
+    outbox->written = 0;
+    uint64_t one = 1;
+    write(evict_fd, &one, sizeof(one));
+}
+
+// Función para pasar las tramas pendientes de una cola a su anillo
+// (devuelve las tramas consumidas; solo toca el timbre si el cliente dormía)
+static size_t deliver_ring(Outbox *outbox) {
+    Ring *ring = &outbox->ring->down;
+    size_t consumed = 0;
+    while (consumed < outbox->count) {
+        SharedFrame *frame = pending_frame(outbox, consumed);
+        if (!ring_push(ring, frame->data, frame->len)) {
+            break; // el anillo está lleno
+        }
+        consumed++;
+    }
+    if (consumed > 0 && ring_needs_doorbell(ring) && outbox->fd != -1) {
+        // Escritura atómica: si la pipe está llena ya hay timbres pendientes y basta con descartar este
+        char doorbell[FRAME_HEADER_LEN];
+        FrameWriter writer;
+        frame_begin(&writer, doorbell, sizeof(doorbell), REPLY_DOORBELL, 0);
+        write(outbox->fd, doorbell, frame_end(&writer));
+    }
+    return consumed;
+}
+
+// Función para escribir en la pipe las tramas pendientes de una cola con writev
+// (devuelve las tramas escritas enteras; la escritura parcial de la siguiente queda en written)
+static size_t deliver_pipe(Outbox *outbox) {
+    size_t consumed = 0;
+    while (consumed < outbox->count) {
+        // Juntar las tramas siguientes, la primera a partir de lo que ya se escribió
+        struct iovec iov[WRITE_IOVECS];
+        int iovcnt = 0;
+        size_t total = 0;
+        while (iovcnt < WRITE_IOVECS && consumed + iovcnt < outbox->count) {
+            SharedFrame *frame = pending_frame(outbox, consumed + iovcnt);
+            size_t skip = iovcnt == 0 ? outbox->written : 0;
+            iov[iovcnt].iov_base = frame->data + skip;
+            iov[iovcnt].iov_len = frame->len - skip;
+            total += iov[iovcnt].iov_len;
+            iovcnt++;
+        }
+
+        ssize_t written = writev(outbox->fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                metrics_add(MET_PIPE_WRITE_FAILED, 1);
+                perror("Error al escribir en la pipe del cliente");
+                fail_outbox(outbox, OUTBOX_PEER_GONE); // el cliente ya no lee, se descarta lo pendiente
+                return 0;
+            }
+            break; // la pipe está llena, se termina de escribir cuando admita más datos
+        }
+
+        // Avanzar por las tramas escritas enteras y anotar lo escrito de la última
+        size_t left = written;
+        for (int i = 0; i < iovcnt && left > 0; i++) {
+            if (left >= iov[i].iov_len) {
+                left -= iov[i].iov_len;
+                outbox->written = 0;
+                consumed++;
+            } else {
+                outbox->written += left;
+                left = 0;
+            }
+        }
+        if ((size_t)written < total) {
+            break; // escritura parcial: la pipe está llena
+        }
+    }
+    return consumed;
+}
+
+// Función para escribir lo pendiente de una cola (from_ready indica que se sacó de la lista de listas)
+static void deliver(DeliveryWorker *worker, Outbox *outbox, int from_ready) {
+    metrics_lock(&outbox->lock);
+    if (from_ready) {
+        outbox->scheduled = 0;
+    }
+
+    // Abrir la pipe si todavía no se pudo (el cliente no la tenía abierta para lectura)
+    if (outbox->fd == -1 && outbox->count > 0) {
+        outbox->fd = open(outbox->client_pipe, O_WRONLY | O_NONBLOCK);
+        if (outbox->fd == -1) {
+            int error = errno;
+            metrics_add(MET_PIPE_WRITE_FAILED, 1);
+            perror("Error al abrir la pipe del cliente");
+            if (error == ENXIO || error == ENOENT) {
+                fail_outbox(outbox, OUTBOX_PEER_GONE); // la pipe ya no tiene lector o ya no existe
+            } else {
+                drop_frames(outbox, outbox->count);
+            }
+        }
+    }
+
+    // Con una trama a medio escribir en la pipe, se termina por la pipe antes de usar el anillo
+    int use_ring = outbox->ring && outbox->written == 0;
+    size_t before = outbox->pending;
+    drop_frames(outbox, use_ring ? deliver_ring(outbox) : deliver_pipe(outbox));
+    if (outbox->pending < before && outbox->pending_since) {
+        // Se mide la espera de los datos más antiguos de la cola; el resto cuenta desde ahora
+        uint64_t now = metrics_now();
+        metrics_observe(HIST_DELIVERY_LATENCY, now - outbox->pending_since);
+        outbox->pending_since = outbox->count > 0 ? now : 0;
+    }
+    if (outbox->drain_watch && outbox->pending <= outbox->drain_low) {
+        outbox->drain_watch = 0;
+        uint64_t one = 1;
+        write(drain_fd, &one, sizeof(one));
+    }
+
+    // Una cola cerrada se libera al sacarla de la lista de listas (no puede volver a entrar)
+    if (outbox->closing && from_ready) {
+        if (outbox->retrying) {
+            remove_retry(worker, outbox);
+        }
+        if (outbox->ring) {
+            ring_region_detach(outbox->ring);
+        }
+        if (outbox->registered) {
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, outbox->fd, NULL);
+        }
+        if (outbox->fd != -1) {
+            close(outbox->fd);
+        }
+        drop_frames(outbox, outbox->count);
+        pthread_mutex_unlock(&outbox->lock);
+        pthread_mutex_destroy(&outbox->lock);
+        free(outbox->client_pipe);
+        free(outbox->frames);
+        free(outbox);
+        return;
+    }
+
+    // Con el anillo lleno, reintentar cuando el cliente lo haya vaciado
+    if (use_ring && outbox->count > 0 && !outbox->closing && !outbox->retrying) {
+        outbox->retrying = 1;
+        outbox->retry_next = worker->retry_head;
+        worker->retry_head = outbox;
+    }
+
+    // Con bytes pendientes, esperar a que la pipe admita más datos
+    if (!use_ring && outbox->count > 0 && !outbox->closing) {
+        struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = outbox };
+        epoll_ctl(worker->epoll_fd, outbox->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, outbox->fd, &ev);
+        outbox->registered = 1;
+    }
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+// Función principal de un hilo de entrega
+static void *delivery_loop(void *arg) {
+    DeliveryWorker *worker = arg;
+    struct epoll_event events[WORKER_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(worker->epoll_fd, events, WORKER_EVENTS, worker->retry_head ? RING_RETRY_MS : -1);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t value;
+                read(worker->wake_fd, &value, sizeof(value));
+            } else {
+                deliver(worker, events[i].data.ptr, 0);
+            }
+        }
+
+        // Reintentar las colas cuyo anillo estaba lleno (deliver las vuelve a añadir si sigue lleno)
+        Outbox *retry = worker->retry_head;
+        worker->retry_head = NULL;
+        while (retry) {
+            Outbox *next = retry->retry_next;
+            retry->retrying = 0;
+            deliver(worker, retry, 0);
+            retry = next;
+        }
+
+        // Tomar la lista de listas completa y atenderla sin el lock del hilo
+        metrics_lock(&worker->lock);
+        Outbox *ready = worker->ready_head;
+        worker->ready_head = worker->ready_tail = NULL;
+        int stopping = worker->stopping;
+        pthread_mutex_unlock(&worker->lock);
+
+        while (ready) {
+            Outbox *next = ready->ready_next;
+            deliver(worker, ready, 1);
+            ready = next;
+        }
+        if (stopping) {
+            return NULL;
+        }
+    }
+}
+
+SharedFrame *shared_frame_alloc(size_t cap) {
+    SharedFrame *frame = malloc(sizeof(SharedFrame) + cap);
+    if (frame) {
+        atomic_init(&frame->refs, 1);
+        frame->droppable = 0;
+        frame->len = 0;
+        frame->cap = cap;
+    }
+    return frame;
+}
+
+void shared_frame_retain(SharedFrame *frame) {
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+}
+
+void shared_frame_release(SharedFrame *frame) {
+    if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1) {
+        free(frame);
+    }
+}
+
+void delivery_start(int count) {
+    if (count <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cores < 1 ? 1 : cores > DEFAULT_DELIVERY_WORKERS ? DEFAULT_DELIVERY_WORKERS : cores;
+    }
+    if (count > MAX_DELIVERY_WORKERS) {
+        count = MAX_DELIVERY_WORKERS;
+    }
+
+    drain_fd = eventfd(0, EFD_NONBLOCK);
+    evict_fd = eventfd(0, EFD_NONBLOCK);
+    for (int i = 0; i < count; i++) {
+        DeliveryWorker *worker = &workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+        worker->epoll_fd = epoll_create1(0);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (worker->wake_fd == -1 || worker->epoll_fd == -1 ||
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) == -1 ||
+            pthread_create(&worker->thread, NULL, delivery_loop, worker) != 0) {
+            perror("Error al crear el hilo de entrega");
+            exit(EXIT_FAILURE);
+        }
+        worker_count++;
+    }
+}
+
+Outbox *outbox_open(const char *client_pipe, const OutboxLimits *limits) {
+    Outbox *outbox = calloc(1, sizeof(Outbox));
+    if (!outbox || !(outbox->client_pipe = strdup(client_pipe))) {
+        free(outbox);
+        return NULL;
+    }
+    pthread_mutex_init(&outbox->lock, NULL);
+    outbox->limits = *limits;
+    outbox->worker = &workers[next_worker];
+    next_worker = (next_worker + 1) % worker_count;
+    // Abrir una sola vez la pipe del cliente; se mantiene abierta durante toda la sesión
+    outbox->fd = open(client_pipe, O_WRONLY | O_NONBLOCK);
+    if (outbox->fd == -1) {
+        perror("Error al abrir la pipe del cliente");
+    }
+    return outbox;
+}
+
+int outbox_push(Outbox *outbox, const char *data, size_t len) {
+    SharedFrame *frame = shared_frame_alloc(len);
+    if (!frame) {
+        return 0;
+    }
+    memcpy(frame->data, data, len);
+    frame->len = len;
+    int pushed = outbox_push_frame(outbox, frame);
+    shared_frame_release(frame);
+    return pushed;
+}
+
+int outbox_push_frame(Outbox *outbox, SharedFrame *frame) {
+    metrics_lock(&outbox->lock);
+    const OutboxLimits *limits = &outbox->limits;
+    if (outbox->status != OUTBOX_OK) {
+        pthread_mutex_unlock(&outbox->lock);
+        return -1;
+    }
+    if (outbox->congested && outbox->pending <= limits->low_water) {
+        outbox->congested = 0; // el cliente ya ha leído hasta la marca baja
+    }
+    if (frame->droppable && (outbox->congested || outbox->pending + frame->len > limits->high_water)) {
+        // Notificación por encima de la marca alta: aplicar la política de la cola
+        if (limits->policy == OVERFLOW_DISCONNECT) {
+            fail_outbox(outbox, OUTBOX_OVERFLOW);
+            pthread_mutex_unlock(&outbox->lock);
+            return -1;
+        }
+        if (limits->policy == OVERFLOW_DROP_OLDEST) {
+            // Hacer sitio de una vez hasta la marca baja
+            drop_oldest(outbox, limits->low_water > frame->len ? limits->low_water - frame->len : 0);
+        }
+        if (limits->policy == OVERFLOW_DROP_NEWEST || outbox->pending + frame->len > limits->high_water) {
+            outbox->congested = 1; // con drop-oldest solo si lo pendiente son respuestas
+            pthread_mutex_unlock(&outbox->lock);
+            return 0;
+        }
+    } else if (!frame->droppable && outbox->pending + frame->len > MAX_CONTROL_PENDING) {
+        // El cliente ni siquiera lee las respuestas a sus solicitudes
+        fail_outbox(outbox, OUTBOX_OVERFLOW);
+        pthread_mutex_unlock(&outbox->lock);
+        return -1;
+    }
+    if (outbox->count == outbox->cap) {
+        // Duplicar la cola circular dejando las tramas pendientes al principio
+        size_t new_cap = outbox->cap ? outbox->cap * 2 : 16;
+        SharedFrame **new_frames = malloc(new_cap * sizeof(SharedFrame *));
+        if (!new_frames) {
+            pthread_mutex_unlock(&outbox->lock);
+            return 0;
+        }
+        for (size_t i = 0; i < outbox->count; i++) {
+            new_frames[i] = pending_frame(outbox, i);
+        }
+        free(outbox->frames);
+        outbox->frames = new_frames;
+        outbox->head = 0;
+        outbox->cap = new_cap;
+    }
+    if (outbox->count == 0) {
+        outbox->pending_since = metrics_now();
+    }
+    shared_frame_retain(frame);
+    outbox->frames[(outbox->head + outbox->count) & (outbox->cap - 1)] = frame;
+    outbox->count++;
+    outbox->pending += frame->len;
+
+    // Solo se avisa al hilo si la cola no estaba ya en su lista de listas
+    int wake = !outbox->scheduled;
+    outbox->scheduled = 1;
+    pthread_mutex_unlock(&outbox->lock);
+
+    if (wake) {
+        schedule(outbox);
+    }
+    return 1;
+}
+
+int outbox_status(Outbox *outbox) {
+    metrics_lock(&outbox->lock);
+    int status = outbox->status;
+    pthread_mutex_unlock(&outbox->lock);
+    return status;
+}
+
+size_t outbox_pending(Outbox *outbox) {
+    metrics_lock(&outbox->lock);
+    size_t pending = outbox->pending;
+    pthread_mutex_unlock(&outbox->lock);
+    return pending;
+}
+
+void outbox_watch_drain(Outbox *outbox, size_t low_water) {
+    metrics_lock(&outbox->lock);
+    // Si ya está por debajo (el hilo de entrega se adelantó) se avisa en el momento
+    int drained = outbox->pending <= low_water;
+    outbox->drain_watch = !drained;
+    outbox->drain_low = low_water;
+    pthread_mutex_unlock(&outbox->lock);
+    if (drained) {
+        uint64_t one = 1;
+        write(drain_fd, &one, sizeof(one));
+    }
+}
+
+int delivery_drain_fd() {
+    return drain_fd;
+}
+
+int delivery_evict_fd() {
+    return evict_fd;
+}
+
+void outbox_attach_ring(Outbox *outbox, RingRegion *ring) {
+    metrics_lock(&outbox->lock);
+    outbox->ring = ring;
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+void outbox_close(Outbox *outbox) {
+    metrics_lock(&outbox->lock);
+    outbox->closing = 1;
+    int wake = !outbox->scheduled;
+    outbox->scheduled = 1;
+    pthread_mutex_unlock(&outbox->lock);
+
+    if (wake) {
+        schedule(outbox);
+    }
+}
+
+void delivery_stop() {
+    for (int i = 0; i < worker_count; i++) {
+        metrics_lock(&workers[i].lock);
+        workers[i].stopping = 1;
+        pthread_mutex_unlock(&workers[i].lock);
+        uint64_t one = 1;
+        write(workers[i].wake_fd, &one, sizeof(one));
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].wake_fd);
+        close(workers[i].epoll_fd);
+    }
+    worker_count = 0;
+    close(drain_fd);
+    drain_fd = -1;
+    close(evict_fd);
+    evict_fd = -1;
+}
@@ -0,0 +1,113 @@
+#ifndef ENTREGA_H
+#define ENTREGA_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "anillo.h"
+
+// Entrega asíncrona a los clientes.
+//
+// Cada cliente tiene una cola de salida (Outbox) asignada a uno de los hilos de entrega.
+// El bucle de eventos solo añade las tramas a la cola; el hilo de entrega escribe en la
+// pipe del cliente de forma no bloqueante y espera con su propio epoll a que vuelva a
+// admitir datos. Un cliente lento solo retrasa su propia cola. Si la sesión negoció un
+// anillo de memoria compartida, el hilo deja ahí cada cadena y la pipe solo lleva timbres.
+//
+// Las colas no copian los bytes: guardan referencias a tramas inmutables (SharedFrame) que
+// pueden compartir muchas colas, de modo que una publicación se codifica una sola vez para
+// todos sus suscriptores. El hilo de entrega escribe varias tramas seguidas con un único writev.
+//
+// Quien quiera encolar mucho sin llenar la cola (p. ej. el reenvío de mensajes retenidos) puede
+// pedir un aviso por delivery_drain_fd cuando la cola baje de un umbral y seguir entonces.
+//
+// Cada cola tiene una marca alta y una baja. Las notificaciones (tramas marcadas droppable) que no
+// caben bajo la marca alta siguen la política de desbordamiento de la cola: descartar la nueva
+// (hasta que la cola baje de la marca baja), descartar las más antiguas hasta la marca baja o
+// desconectar al cliente. Las respuestas y confirmaciones nunca se descartan; si un cliente deja
+// que la cola llegue a MAX_CONTROL_PENDING bytes, se le da por perdido. Una cola cuyo cliente
+// se da por perdido o cuya pipe ya no tiene lector deja de admitir tramas y activa delivery_evict_fd.
+
+#define MAX_DELIVERY_WORKERS 16 // número máximo de hilos de entrega
+#define MAX_CONTROL_PENDING (1024 * 1024) // bytes pendientes a partir de los que una respuesta da al cliente por perdido
+
+// Políticas de desbordamiento de una cola de salida
+enum {
+    OVERFLOW_DROP_NEWEST, // descartar la notificación nueva
+    OVERFLOW_DROP_OLDEST, // descartar las notificaciones pendientes más antiguas
+    OVERFLOW_DISCONNECT // desconectar al cliente lento
+};
+
+// Estado de una cola de salida
+enum {
+    OUTBOX_OK, // admite tramas
+    OUTBOX_OVERFLOW, // el cliente no lee y su cola se desbordó (política de desconexión o respuestas)
+    OUTBOX_PEER_GONE // la pipe del cliente ya no tiene lector
+};
+
+// Límites de una cola de salida
+typedef struct {
+    size_t high_water; // bytes pendientes a partir de los que se aplica la política
+    size_t low_water; // bytes pendientes por debajo de los que se vuelven a admitir notificaciones
+    int policy; // OVERFLOW_*
+} OutboxLimits;
+
+// Cola de salida de un cliente
+typedef struct Outbox Outbox;
+
+// Trama codificada e inmutable; se libera al soltar la última referencia
+typedef struct {
+    _Atomic int refs; // referencias (la de quien la creó y la de cada cola que la contiene)
+    int droppable; // la trama es una notificación que la política de desbordamiento puede descartar
+    size_t len; // bytes de la trama
+    size_t cap; // bytes reservados en data
+    char data[];
+} SharedFrame;
+
+// Reserva una trama vacía de cap bytes con una referencia (la de quien la crea) y no descartable; NULL si falla
+SharedFrame *shared_frame_alloc(size_t cap);
+
+// Toma una referencia más de una trama
+void shared_frame_retain(SharedFrame *frame);
+
+// Suelta una referencia de una trama
+void shared_frame_release(SharedFrame *frame);
+
+// Arranca los hilos de entrega (workers <= 0: uno por núcleo, hasta 4)
+void delivery_start(int workers);
+
+// Crea la cola de salida de la pipe de un cliente con sus límites y la asigna a un hilo de entrega
+Outbox *outbox_open(const char *client_pipe, const OutboxLimits *limits);
+
+// Añade una copia de una respuesta a la cola de salida (1 si se encola, 0 si no queda memoria,
+// -1 si la cola ya no admite tramas)
+int outbox_push(Outbox *outbox, const char *data, size_t len);
+
+// Añade una trama compartida a la cola de salida tomando una referencia (1 si se encola, 0 si se
+// descarta, -1 si la cola ya no admite tramas)
+int outbox_push_frame(Outbox *outbox, SharedFrame *frame);
+
+// Estado de la cola (OUTBOX_*)
+int outbox_status(Outbox *outbox);
+
+// Bytes pendientes de escribir de la cola
+size_t outbox_pending(Outbox *outbox);
+
+// Pide un aviso por delivery_drain_fd cuando los bytes pendientes de la cola bajen a low_water o menos
+void outbox_watch_drain(Outbox *outbox, size_t low_water);
+
+// Descriptor (eventfd) que se activa cuando alguna cola vigilada con outbox_watch_drain se ha vaciado
+int delivery_drain_fd();
+
+// Descriptor (eventfd) que se activa cuando alguna cola deja de admitir tramas (ver outbox_status)
+int delivery_evict_fd();
+
+// Hace que la cola entregue en el anillo de una sesión; la cola pasa a ser dueña de la proyección
+void outbox_attach_ring(Outbox *outbox, RingRegion *ring);
+
+// Entrega la cola a su hilo para que escriba lo pendiente que pueda, cierre la pipe y la libere
+void outbox_close(Outbox *outbox);
+
+// Termina las colas cerradas pendientes y espera a los hilos de entrega
+void delivery_stop();
+
+#endif
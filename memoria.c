@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "memoria.h"
+
+#define SLAB_CLASSES 5 // clases de 32, 64, 128, 256 y 512 bytes
+
+// Objeto libre dentro de una página: se enlaza con el siguiente libre de su clase
+typedef struct FreeObject {
+    struct FreeObject *next;
+} FreeObject;
+
+static _Thread_local FreeObject *free_lists[SLAB_CLASSES]; // objetos libres de cada clase (propios de cada hilo)
+static _Atomic size_t used_bytes = 0; // páginas de la slab + bloques grandes
+static size_t budget_bytes = 0; // presupuesto máximo (0 = sin límite)
+
+_Static_assert(((size_t)32 << (SLAB_CLASSES - 1)) == SLAB_MAX_OBJECT, "la última clase de la slab debe ser SLAB_MAX_OBJECT");
+
+// Función para obtener la clase de la slab de un tamaño (-1 si es mayor que SLAB_MAX_OBJECT y va a malloc)
+static int slab_class(size_t size) {
+    if (size > SLAB_MAX_OBJECT) {
+        return -1;
+    }
+    int class = 0;
+    for (size_t class_size = 32; class_size < size; class_size <<= 1) {
+        class++;
+    }
+    return class;
+}
+
+// Función para contabilizar otros bytes si caben en el presupuesto (0 si no caben)
+static int charge_budget(size_t bytes) {
+    size_t used = atomic_fetch_add(&used_bytes, bytes);
+    if (budget_bytes != 0 && used + bytes > budget_bytes) {
+        atomic_fetch_sub(&used_bytes, bytes);
+        return 0;
+    }
+    return 1;
+}
+
+// Función para recortar una página nueva en objetos libres de una clase
+static int slab_grow(int class) {
+    if (!charge_budget(SLAB_PAGE_SIZE)) {
+        return 0;
+    }
+    char *page = malloc(SLAB_PAGE_SIZE);
+    if (!page) {
+        atomic_fetch_sub(&used_bytes, SLAB_PAGE_SIZE);
+        return 0;
+    }
+
+    size_t object_size = (size_t)32 << class;
+    for (size_t offset = 0; offset + object_size <= SLAB_PAGE_SIZE; offset += object_size) {
+        FreeObject *object = (FreeObject *)(page + offset);
+        object->next = free_lists[class];
+        free_lists[class] = object;
+    }
+    return 1;
+}
+
+void mem_init(size_t budget) {
+    budget_bytes = budget;
+}
+
+void *mem_alloc(size_t size) {
+    int class = slab_class(size);
+    if (class == -1) {
+        // Bloque grande: malloc contabilizado
+        if (!charge_budget(size)) {
+            return NULL;
+        }
+        void *ptr = malloc(size);
+        if (!ptr) {
+            atomic_fetch_sub(&used_bytes, size);
+        }
+        return ptr;
+    }
+
+    if (!free_lists[class] && !slab_grow(class)) {
+        return NULL;
+    }
+    FreeObject *object = free_lists[class];
+    free_lists[class] = object->next;
+    return object;
+}
+
+void mem_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    int class = slab_class(size);
+    if (class == -1) {
+        free(ptr);
+        atomic_fetch_sub(&used_bytes, size);
+        return;
+    }
+
+    // Los objetos vuelven a la lista de su clase; las páginas se conservan para reutilizarlas
+    FreeObject *object = ptr;
+    object->next = free_lists[class];
+    free_lists[class] = object;
+}
+
+void *mem_realloc(void *ptr, size_t old_size, size_t new_size) {
+    if (new_size > old_size && !charge_budget(new_size - old_size)) {
+        return NULL;
+    }
+    void *new_ptr = realloc(ptr, new_size);
+    if (!new_ptr && new_size > old_size) {
+        atomic_fetch_sub(&used_bytes, new_size - old_size);
+    } else if (new_ptr && new_size < old_size) {
+        atomic_fetch_sub(&used_bytes, old_size - new_size);
+    }
+    return new_ptr;
+}
+
+void mem_free_table(void *ptr, size_t size) {
+    if (ptr) {
+        free(ptr);
+        atomic_fetch_sub(&used_bytes, size);
+    }
+}
+
+size_t mem_used() {
+    return atomic_load(&used_bytes);
+}
+
+size_t mem_budget() {
+    return budget_bytes;
+}
@@ -0,0 +1,31 @@
+#ifndef MEMORIA_H
+#define MEMORIA_H
+
+#include <stddef.h>
+
+#define SLAB_PAGE_SIZE (64 * 1024) // tamaño de cada página de la que se recortan objetos pequeños
+#define SLAB_MAX_OBJECT 512 // tamaño máximo servido por las clases de la slab; lo mayor va a malloc
+
+// Se puede usar desde varios hilos: cada hilo recorta sus propias páginas de la slab (un bloque de
+// mem_alloc se libera en el hilo que lo reservó) y el presupuesto se contabiliza de forma atómica.
+
+// Inicializa el asignador con un presupuesto máximo de memoria en bytes
+void mem_init(size_t budget);
+
+// Reserva size bytes contabilizados en el presupuesto (NULL si se supera)
+void *mem_alloc(size_t size);
+
+// Libera un bloque reservado con mem_alloc indicando el mismo tamaño
+void mem_free(void *ptr, size_t size);
+
+// Redimensiona una tabla que crece (empezando por ptr = NULL); NULL si se supera el presupuesto
+void *mem_realloc(void *ptr, size_t old_size, size_t new_size);
+
+// Libera una tabla creada con mem_realloc
+void mem_free_table(void *ptr, size_t size);
+
+// Bytes reservados actualmente y presupuesto total
+size_t mem_used();
+size_t mem_budget();
+
+#endif
@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "metricas.h"
+
+#define METRIC_SHARDS 32 // copias de las métricas (los hilos que pasen de aquí comparten copia)
+#define HIST_SUB_BITS 2 // 4 intervalos por potencia de 2
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+// Copia de las métricas que actualiza un hilo (en sus propias líneas de caché)
+typedef struct {
+    _Atomic uint64_t commands[METRIC_COMMAND_TYPES];
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    struct {
+        _Atomic uint64_t buckets[HIST_BUCKETS];
+        _Atomic uint64_t sum;
+    } histograms[METRIC_HISTOGRAMS];
+} __attribute__((aligned(64))) MetricShard;
+
+// Suma de todas las copias en un instante
+typedef struct {
+    uint64_t commands[METRIC_COMMAND_TYPES];
+    uint64_t counters[METRIC_COUNTERS];
+    struct {
+        uint64_t buckets[HIST_BUCKETS];
+        uint64_t sum;
+        uint64_t count;
+    } histograms[METRIC_HISTOGRAMS];
+} MetricTotals;
+
+// Nombre, ayuda y escala (para pasar a las unidades de Prometheus) de cada métrica
+static const char *command_names[] = {
+    "login", "subscribe", "topics", "exit", "unsubscribe", "msg", "ctrlc", "attach_ring", "doorbell", "msg_batch"
+};
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTERS] = {
+    { "plataforma_messages_published_total", "Mensajes publicados en un tópico." },
+    { "plataforma_messages_rejected_total", "Mensajes rechazados por el servidor." },
+    { "plataforma_outbox_dropped_total", "Notificaciones descartadas por la política de desbordamiento de la cola de salida." },
+    { "plataforma_response_failed_total", "Respuestas a procesos sin sesión que no se pudieron escribir." },
+    { "plataforma_pipe_write_failed_total", "Errores al abrir o escribir la pipe de un cliente." },
+    { "plataforma_lock_contended_total", "Adquisiciones de un mutex que tuvieron que esperar." },
+    { "plataforma_queue_full_total", "Tareas que tuvieron que esperar porque la cola de su partición estaba llena." },
+    { "plataforma_clients_evicted_total", "Clientes expulsados por proceso terminado, pipe sin lector o cola de salida desbordada." },
+    { "plataforma_frames_invalid_total", "Cabeceras no válidas descartadas en la pipe del servidor." },
+};
+static const struct {
+    const char *name;
+    const char *help;
+    double scale; // factor de las unidades internas a las exportadas
+} histogram_info[METRIC_HISTOGRAMS] = {
+    { "plataforma_delivery_latency_seconds", "Tiempo desde que una cola de salida recibe datos hasta que se escriben.", 1e-9 },
+    { "plataforma_fanout_subscribers", "Suscriptores a los que se entrega cada mensaje publicado.", 1 },
+    { "plataforma_expiry_sweep_seconds", "Duración de cada pasada de vencimiento de mensajes.", 1e-9 },
+    { "plataforma_wal_commit_seconds", "Duración de cada escritura y sincronización del registro.", 1e-9 },
+    { "plataforma_lock_wait_seconds", "Espera de las adquisiciones de un mutex que tuvieron que esperar.", 1e-9 },
+};
+
+static MetricShard shards[METRIC_SHARDS];
+static _Atomic int next_shard = 0;
+static _Thread_local MetricShard *thread_shard = NULL;
+static char *dump_path = NULL;
+static int dump_interval = 0;
+
+// Función para obtener la copia de las métricas del hilo actual (se asigna en su primer uso)
+static MetricShard *shard() {
+    if (!thread_shard) {
+        thread_shard = &shards[atomic_fetch_add(&next_shard, 1) % METRIC_SHARDS];
+    }
+    return thread_shard;
+}
+
+// Función para sumar atómicamente sin orden (solo importa el total)
+static void add(_Atomic uint64_t *value, uint64_t n) {
+    atomic_fetch_add_explicit(value, n, memory_order_relaxed);
+}
+
+// Función para obtener la posición del histograma de un valor
+static int bucket_index(uint64_t value) {
+    if (value < (1u << HIST_SUB_BITS)) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    return ((exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((value >> (exponent - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// Función para obtener el menor valor de una posición del histograma
+static uint64_t bucket_lower(int index) {
+    if (index < (1 << HIST_SUB_BITS)) {
+        return index;
+    }
+    int exponent = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    return (uint64_t)((1u << HIST_SUB_BITS) | (index & ((1u << HIST_SUB_BITS) - 1))) << (exponent - HIST_SUB_BITS);
+}
+
+// Función para sumar todas las copias
+static void collect(MetricTotals *totals) {
+    memset(totals, 0, sizeof(*totals));
+    for (int s = 0; s < METRIC_SHARDS; s++) {
+        MetricShard *copy = &shards[s];
+        for (int i = 0; i < METRIC_COMMAND_TYPES; i++) {
+            totals->commands[i] += atomic_load_explicit(&copy->commands[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < METRIC_COUNTERS; i++) {
+            totals->counters[i] += atomic_load_explicit(&copy->counters[i], memory_order_relaxed);
+        }
+        for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                uint64_t n = atomic_load_explicit(&copy->histograms[h].buckets[b], memory_order_relaxed);
+                totals->histograms[h].buckets[b] += n;
+                totals->histograms[h].count += n;
+            }
+            totals->histograms[h].sum += atomic_load_explicit(&copy->histograms[h].sum, memory_order_relaxed);
+        }
+    }
+}
+
+// Función para obtener un percentil (0..1) de un histograma sumado (el centro de su intervalo)
+static double percentile(const MetricTotals *totals, int histogram, double p) {
+    uint64_t target = (uint64_t)(p * totals->histograms[histogram].count);
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += totals->histograms[histogram].buckets[b];
+        if (seen > target) {
+            return (bucket_lower(b) + (b + 1 < HIST_BUCKETS ? bucket_lower(b + 1) - 1 : bucket_lower(b))) / 2.0;
+        }
+    }
+    return 0;
+}
+
+// Función principal del hilo de volcado
+static void *dump_loop(void *arg) {
+    while (1) {
+        sleep(dump_interval);
+        if (metrics_write(dump_path) == -1) {
+            perror("Error al escribir las métricas");
+        }
+    }
+    return NULL;
+}
+
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metrics_command(int type) {
+    add(&shard()->commands[type >= 0 && type < METRIC_COMMAND_TYPES ? type : METRIC_COMMAND_TYPES - 1], 1);
+}
+
+void metrics_add(int counter, uint64_t n) {
+    add(&shard()->counters[counter], n);
+}
+
+void metrics_observe(int histogram, uint64_t value) {
+    MetricShard *copy = shard();
+    add(&copy->histograms[histogram].buckets[bucket_index(value)], 1);
+    add(&copy->histograms[histogram].sum, value);
+}
+
+void metrics_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_trylock(lock) == 0) {
+        return; // libre: sin coste de medida
+    }
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(lock);
+    metrics_add(MET_LOCK_CONTENDED, 1);
+    metrics_observe(HIST_LOCK_WAIT, metrics_now() - start);
+}
+
+void metrics_print(FILE *out) {
+    static MetricTotals totals; // solo lo usa el hilo de la consola
+    collect(&totals);
+
+    fprintf(out, "Solicitudes por comando:\n");
+    for (int i = 0; i < METRIC_COMMAND_TYPES; i++) {
+        if (totals.commands[i] > 0) {
+            fprintf(out, " - %s: %lu\n", i < (int)(sizeof(command_names) / sizeof(command_names[0])) ? command_names[i] : "otros",
+                    (unsigned long)totals.commands[i]);
+        }
+    }
+    fprintf(out, "Mensajes publicados: %lu, rechazados: %lu\n",
+            (unsigned long)totals.counters[MET_MESSAGES_PUBLISHED], (unsigned long)totals.counters[MET_MESSAGES_REJECTED]);
+    fprintf(out, "Notificaciones descartadas por cola llena: %lu, fallidas sin sesión: %lu, errores de pipe: %lu\n",
+            (unsigned long)totals.counters[MET_OUTBOX_DROPPED], (unsigned long)totals.counters[MET_RESPONSE_FAILED],
+            (unsigned long)totals.counters[MET_PIPE_WRITE_FAILED]);
+    fprintf(out, "Esperas de mutex: %lu, esperas por cola de partición llena: %lu, clientes expulsados: %lu\n",
+            (unsigned long)totals.counters[MET_LOCK_CONTENDED], (unsigned long)totals.counters[MET_QUEUE_FULL],
+            (unsigned long)totals.counters[MET_CLIENTS_EVICTED]);
+    fprintf(out, "Tramas no válidas en la pipe del servidor: %lu\n", (unsigned long)totals.counters[MET_FRAMES_INVALID]);
+
+    static const char *labels[METRIC_HISTOGRAMS] = {
+        "Latencia de entrega (us)", "Suscriptores por mensaje", "Pasada de vencimiento (us)",
+        "Commit del registro (us)", "Espera de mutex (us)"
+    };
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+        uint64_t count = totals.histograms[h].count;
+        if (count == 0) {
+            fprintf(out, "%s: sin datos\n", labels[h]);
+            continue;
+        }
+        double unit = histogram_info[h].scale < 1 ? 1e3 : 1; // los tiempos se muestran en microsegundos
+        fprintf(out, "%s: %lu muestras, media %.1f, p50 %.1f, p99 %.1f, p999 %.1f\n", labels[h], (unsigned long)count,
+                (double)totals.histograms[h].sum / count / unit, percentile(&totals, h, 0.5) / unit,
+                percentile(&totals, h, 0.99) / unit, percentile(&totals, h, 0.999) / unit);
+    }
+}
+
+int metrics_write(const char *path) {
+    static MetricTotals totals; // solo lo usa el hilo de volcado o el cierre del servidor
+    collect(&totals);
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        return -1;
+    }
+
+    fprintf(out, "# HELP plataforma_commands_total Solicitudes recibidas por tipo de comando.\n");
+    fprintf(out, "# TYPE plataforma_commands_total counter\n");
+    for (int i = 0; i < (int)(sizeof(command_names) / sizeof(command_names[0])); i++) {
+        fprintf(out, "plataforma_commands_total{command=\"%s\"} %lu\n", command_names[i], (unsigned long)totals.commands[i]);
+    }
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counter_info[i].name, counter_info[i].help,
+                counter_info[i].name, counter_info[i].name, (unsigned long)totals.counters[i]);
+    }
+
+    // Los límites exportados son los valores pequeños uno a uno y después las potencias de 2
+    // (el final de cada grupo de intervalos); le es inclusivo, de ahí el - 1
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+        const char *name = histogram_info[h].name;
+        double scale = histogram_info[h].scale;
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[h].help, name);
+        int last = -1;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            if (totals.histograms[h].buckets[b] > 0) {
+                last = b;
+            }
+        }
+        uint64_t cumulative = 0;
+        for (int b = 0; last >= 0 && b <= (last | ((1 << HIST_SUB_BITS) - 1)); b++) {
+            cumulative += totals.histograms[h].buckets[b];
+            if (b < (1 << HIST_SUB_BITS) || (b + 1) % (1 << HIST_SUB_BITS) == 0) {
+                fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, (bucket_lower(b + 1) - 1) * scale, (unsigned long)cumulative);
+            }
+        }
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)totals.histograms[h].count);
+        fprintf(out, "%s_sum %g\n", name, totals.histograms[h].sum * scale);
+        fprintf(out, "%s_count %lu\n", name, (unsigned long)totals.histograms[h].count);
+    }
+
+    if (fclose(out) != 0 || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int metrics_start_dump(const char *path, int interval_s) {
+    pthread_t thread;
+    dump_path = strdup(path);
+    dump_interval = interval_s > 0 ? interval_s : 1;
+    if (!dump_path || pthread_create(&thread, NULL, dump_loop, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread); // como el hilo de la consola, termina con el proceso
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef METRICAS_H
+#define METRICAS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Métricas de ejecución del servidor.
+//
+// Contadores e histogramas que cualquier hilo puede actualizar sin bloquear: cada hilo escribe
+// en su propia copia (con operaciones atómicas relajadas) y solo quien lee las suma. Los
+// histogramas dividen cada potencia de 2 en 4 intervalos, de modo que los percentiles tienen
+// un error menor del 20% sin reservar memoria al observar. El comando stats de la consola
+// las imprime y, si se define METRICS_FILE, un hilo las vuelca periódicamente en formato de
+// texto de Prometheus.
+
+#define METRIC_COMMAND_TYPES 16 // tipos de comando contados (los demás se cuentan en el último)
+
+// Contadores
+enum {
+    MET_MESSAGES_PUBLISHED, // mensajes publicados en un tópico
+    MET_MESSAGES_REJECTED, // mensajes rechazados (tópico bloqueado, límites)
+    MET_OUTBOX_DROPPED, // notificaciones descartadas por la política de desbordamiento de la cola de salida
+    MET_RESPONSE_FAILED, // respuestas a procesos sin sesión que no se pudieron escribir
+    MET_PIPE_WRITE_FAILED, // errores al abrir o escribir la pipe de un cliente en la entrega
+    MET_LOCK_CONTENDED, // adquisiciones de un mutex que tuvieron que esperar
+    MET_QUEUE_FULL, // tareas que tuvieron que esperar porque la cola de su partición estaba llena
+    MET_CLIENTS_EVICTED, // clientes expulsados (proceso terminado, pipe sin lector o cola de salida desbordada)
+    MET_FRAMES_INVALID, // cabeceras no válidas en la pipe del servidor (se salta hasta la siguiente trama)
+    METRIC_COUNTERS
+};
+
+// Histogramas
+enum {
+    HIST_DELIVERY_LATENCY, // ns desde que una cola de salida recibe datos hasta que se escriben
+    HIST_FANOUT, // suscriptores a los que se entrega cada mensaje publicado
+    HIST_EXPIRY_SWEEP, // ns de cada pasada de vencimiento de mensajes
+    HIST_WAL_COMMIT, // ns de cada escritura y sincronización del registro
+    HIST_LOCK_WAIT, // ns de espera de las adquisiciones de un mutex que tuvieron que esperar
+    METRIC_HISTOGRAMS
+};
+
+// Instante actual en nanosegundos (CLOCK_MONOTONIC)
+uint64_t metrics_now();
+
+// Cuenta una solicitud de un tipo de comando
+void metrics_command(int type);
+
+// Suma n a un contador
+void metrics_add(int counter, uint64_t n);
+
+// Añade un valor a un histograma
+void metrics_observe(int histogram, uint64_t value);
+
+// Adquiere un mutex midiendo la espera solo si está ocupado
+void metrics_lock(pthread_mutex_t *lock);
+
+// Imprime un resumen legible de las métricas
+void metrics_print(FILE *out);
+
+// Escribe las métricas en formato de texto de Prometheus en path (mediante un fichero temporal
+// y rename, de modo que quien lo lea nunca ve un volcado a medias); -1 si falla
+int metrics_write(const char *path);
+
+// Arranca el hilo que vuelca las métricas en path cada interval_s segundos
+int metrics_start_dump(const char *path, int interval_s);
+
+#endif
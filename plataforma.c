@@ -0,0 +1,546 @@
+#include "util.h"
+#include "anillo.h"
+#include "plataforma.h"
+
+// Solicitud enviada que espera su resultado
+typedef struct {
+    uint32_t seq; // Número de secuencia de la solicitud
+    int type; // Tipo de comando
+    session_done_fn done;
+    void *arg;
+    char topic[MAX_TOPIC_FIELD + 1]; // Suscripción: tópico (se olvida si el servidor la rechaza)
+} PendingRequest;
+
+// Suscripción de la sesión
+typedef struct {
+    char topic[MAX_TOPIC_FIELD + 1]; // Tópico o patrón
+    session_message_fn on_message;
+    void *arg;
+} Subscription;
+
+struct Session {
+    char username[MAX_NAME_FIELD + 1];
+    char client_pipe[256];
+    char ring_name[RING_NAME_LEN];
+    pid_t pid;
+    uint32_t seq; // último número de secuencia enviado
+    int server_fd; // extremo de escritura de la pipe del servidor
+    int client_fd; // extremo de lectura de la pipe de la sesión
+    RingRegion *ring; // anillos de memoria compartida (NULL si solo se usan las pipes)
+    SessionHandlers handlers;
+    PendingRequest *pending; // solicitudes sin resultado
+    int pending_count;
+    int pending_cap;
+    Subscription *subscriptions;
+    int subscription_count;
+    int subscription_cap;
+    char batch_frame[MAX_REQUEST_LEN]; // lote en construcción
+    FrameWriter batch_writer;
+    int batch_count; // mensajes del lote en construcción
+    session_done_fn batch_done;
+    void *batch_arg;
+    FrameStream replies; // tramas recibidas por la pipe pendientes de completar
+    char *backlog; // solicitudes que no cupieron en el anillo (longitud de 32 bits y trama), en orden
+    size_t backlog_len;
+    size_t backlog_cap;
+    char frame[MAX_FRAME_LEN]; // trama sacada del anillo que se está atendiendo
+    char text[MAX_FRAME_PAYLOAD + 1]; // texto de la respuesta o del mensaje que se está atendiendo
+    int answered; // ya llegó alguna trama (antes, leer 0 bytes solo indica que el servidor aún no abrió la pipe)
+};
+
+static _Atomic int sessions_opened = 0; // sesiones abiertas por el proceso (nombre de las pipes)
+
+// Función para duplicar la capacidad de una tabla de la sesión (0 si no queda memoria)
+static int grow(void **table, int *cap, size_t elem_size) {
+    int new_cap = *cap ? *cap * 2 : 8;
+    void *grown = realloc(*table, new_cap * elem_size);
+    if (!grown) {
+        return 0;
+    }
+    *table = grown;
+    *cap = new_cap;
+    return 1;
+}
+
+// Función para comprobar si un tópico publicado lo cubre un tópico o patrón de suscripción
+// ('+' = un nivel cualquiera, '#' = el resto de niveles, incluido el nivel del padre)
+static int topic_matches(const char *pattern, const char *topic) {
+    while (1) {
+        const char *pattern_end = strchr(pattern, '/');
+        size_t pattern_len = pattern_end ? (size_t)(pattern_end - pattern) : strlen(pattern);
+        if (pattern_len == 1 && pattern[0] == '#') {
+            return 1;
+        }
+        if (!topic) {
+            return 0;
+        }
+        const char *topic_end = strchr(topic, '/');
+        size_t topic_len = topic_end ? (size_t)(topic_end - topic) : strlen(topic);
+        if (!(pattern_len == 1 && pattern[0] == '+') &&
+            (pattern_len != topic_len || memcmp(pattern, topic, topic_len) != 0)) {
+            return 0;
+        }
+        if (!pattern_end) {
+            return !topic_end;
+        }
+        pattern = pattern_end + 1;
+        // "a/#" también cubre "a": al acabarse el tópico solo puede seguir '#'
+        topic = topic_end ? topic_end + 1 : NULL;
+    }
+}
+
+// Función para escribir una trama en la pipe del servidor (-1 si falla)
+static int write_to_server_pipe(Session *session, const char *frame, size_t len) {
+    // Las solicitudes caben en PIPE_BUF, por lo que cada escritura llega entera y sin mezclarse con otros clientes
+    ssize_t written;
+    do {
+        written = write(session->server_fd, frame, len);
+    } while (written == -1 && errno == EINTR);
+    return written == (ssize_t)len ? 0 : -1;
+}
+
+// Función para empezar una solicitud: cabecera con la siguiente secuencia, PID y nombre de usuario
+static void begin_command(Session *session, FrameWriter *writer, char *buf, size_t cap, int type) {
+    frame_begin(writer, buf, cap, type, ++session->seq);
+    frame_put_int(writer, session->pid);
+    frame_put_string(writer, session->username, MAX_NAME_FIELD);
+}
+
+// Función para avisar al servidor por la pipe si había terminado de vaciar el anillo de comandos
+static int ring_doorbell(Session *session) {
+    if (!ring_needs_doorbell(&session->ring->up)) {
+        return 0;
+    }
+    char doorbell[MAX_REQUEST_LEN];
+    FrameWriter bell;
+    frame_begin(&bell, doorbell, sizeof(doorbell), CMD_DOORBELL, 0);
+    frame_put_int(&bell, session->pid);
+    frame_put_string(&bell, session->username, MAX_NAME_FIELD);
+    return write_to_server_pipe(session, doorbell, frame_end(&bell));
+}
+
+// Función para guardar una solicitud que no cabe en el anillo hasta que el servidor lo vacíe (-1 si no queda memoria)
+static int backlog_push(Session *session, const char *frame, uint32_t len) {
+    if (session->backlog_len + sizeof(len) + len > session->backlog_cap) {
+        size_t new_cap = session->backlog_cap ? session->backlog_cap * 2 : 2 * MAX_REQUEST_LEN;
+        while (new_cap < session->backlog_len + sizeof(len) + len) {
+            new_cap *= 2;
+        }
+        char *grown = realloc(session->backlog, new_cap);
+        if (!grown) {
+            return -1;
+        }
+        session->backlog = grown;
+        session->backlog_cap = new_cap;
+    }
+    memcpy(session->backlog + session->backlog_len, &len, sizeof(len));
+    memcpy(session->backlog + session->backlog_len + sizeof(len), frame, len);
+    session->backlog_len += sizeof(len) + len;
+    return 0;
+}
+
+// Función para pasar al anillo las solicitudes guardadas que ya caben, en orden
+static int backlog_flush(Session *session) {
+    size_t offset = 0;
+    while (offset < session->backlog_len) {
+        uint32_t len;
+        memcpy(&len, session->backlog + offset, sizeof(len));
+        if (!ring_push(&session->ring->up, session->backlog + offset + sizeof(len), len)) {
+            break;
+        }
+        offset += sizeof(len) + len;
+    }
+    if (offset == 0) {
+        return 0;
+    }
+    session->backlog_len -= offset;
+    memmove(session->backlog, session->backlog + offset, session->backlog_len);
+    return ring_doorbell(session);
+}
+
+// Función para enviar una solicitud al servidor (por el anillo si el servidor ya lo atiende)
+static int send_command(Session *session, FrameWriter *writer) {
+    size_t len = frame_end(writer);
+    if (len == 0) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (!session->ring || !atomic_load(&session->ring->attached)) {
+        return write_to_server_pipe(session, writer->buf, len);
+    }
+    // Con el anillo lleno la solicitud espera en la sesión sin bloquear: el servidor ya tiene el
+    // timbre y, al vaciarlo, responde a las solicitudes pendientes, de modo que session_process
+    // la pasa al anillo. Las que siguen esperan detrás para no adelantarla
+    if (session->backlog_len > 0 || !ring_push(&session->ring->up, writer->buf, len)) {
+        return backlog_push(session, writer->buf, len);
+    }
+    return ring_doorbell(session);
+}
+
+// Función para anotar una solicitud como pendiente de resultado (-1 si no queda memoria)
+static int add_pending(Session *session, uint32_t seq, int type, session_done_fn done, void *arg, const char *topic) {
+    if (session->pending_count == session->pending_cap &&
+        !grow((void **)&session->pending, &session->pending_cap, sizeof(PendingRequest))) {
+        return -1;
+    }
+    PendingRequest *pending = &session->pending[session->pending_count++];
+    pending->seq = seq;
+    pending->type = type;
+    pending->done = done;
+    pending->arg = arg;
+    snprintf(pending->topic, sizeof(pending->topic), "%s", topic ? topic : "");
+    return 0;
+}
+
+// Función para enviar una solicitud y anotarla como pendiente (se anota antes: la respuesta
+// no puede llegar hasta que se atienda la pipe). La secuencia se toma de la trama: un lote que se
+// reintenta conserva la suya aunque se hayan enviado otras solicitudes después
+static int send_request(Session *session, FrameWriter *writer, int type, session_done_fn done, void *arg, const char *topic) {
+    FrameHeader header;
+    memcpy(&header, writer->buf, sizeof(header));
+    if (add_pending(session, header.seq, type, done, arg, topic) == -1) {
+        return -1;
+    }
+    if (send_command(session, writer) == -1) {
+        session->pending_count--;
+        return -1;
+    }
+    return 0;
+}
+
+// Función para buscar la suscripción local a un tópico o patrón (-1 si no hay)
+static int find_subscription(const Session *session, const char *topic) {
+    for (int i = 0; i < session->subscription_count; i++) {
+        if (strcmp(session->subscriptions[i].topic, topic) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Función para olvidar la suscripción local a un tópico o patrón
+static void forget_subscription(Session *session, const char *topic) {
+    int i = find_subscription(session, topic);
+    if (i != -1) {
+        session->subscriptions[i] = session->subscriptions[--session->subscription_count];
+    }
+}
+
+// Función para entregar un mensaje publicado a las suscripciones que lo cubren
+static void dispatch_message(Session *session, FrameReader *reader) {
+    char *text = session->text;
+    char topic[MAX_TOPIC_FIELD + 1], user[MAX_NAME_FIELD + 1];
+    SessionMessage message;
+    message.id = frame_get_u64(reader);
+    frame_get_string(reader, topic, sizeof(topic));
+    frame_get_string(reader, user, sizeof(user));
+    frame_get_string(reader, text, sizeof(session->text));
+    message.topic = topic;
+    message.user = user;
+    message.text = text;
+
+    int delivered = 0;
+    for (int i = 0; i < session->subscription_count; i++) {
+        Subscription *subscription = &session->subscriptions[i];
+        if (subscription->on_message && topic_matches(subscription->topic, topic)) {
+            subscription->on_message(session, &message, subscription->arg);
+            delivered = 1;
+        }
+    }
+    if (!delivered && session->handlers.on_message) {
+        session->handlers.on_message(session, &message, session->handlers.arg);
+    }
+}
+
+// Función para completar la solicitud pendiente con una secuencia dada (0 si no había ninguna)
+static int complete(Session *session, uint32_t seq, int is_ack, SessionResult *result) {
+    for (int i = 0; i < session->pending_count; i++) {
+        if (session->pending[i].seq != seq) {
+            continue;
+        }
+        // Los errores de mensajes sueltos de un lote llegan con su secuencia antes de la confirmación
+        if ((session->pending[i].type == CMD_MSG_BATCH) != is_ack) {
+            return 0;
+        }
+        // Se saca de la tabla antes de llamar: la función de retorno puede enviar más solicitudes
+        PendingRequest pending = session->pending[i];
+        session->pending[i] = session->pending[--session->pending_count];
+        if (pending.type == CMD_SUBSCRIBE && !result->ok) {
+            forget_subscription(session, pending.topic);
+        }
+        if (pending.done) {
+            pending.done(session, result, pending.arg);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Función para atender una trama del servidor y devolver su tipo
+static int handle_reply(Session *session, const char *frame) {
+    char *text = session->text;
+    FrameHeader header;
+    FrameReader reader;
+    frame_open(&reader, &header, frame);
+    SessionResult result = { .seq = header.seq, .ok = 1, .text = "" };
+
+    switch (header.type) {
+        case REPLY_MESSAGE:
+            dispatch_message(session, &reader);
+            break;
+        case REPLY_TEXT:
+        case REPLY_ERROR:
+            frame_get_string(&reader, text, sizeof(session->text));
+            result.ok = header.type == REPLY_TEXT;
+            result.text = text;
+            if ((header.seq == 0 || !complete(session, header.seq, 0, &result)) && session->handlers.on_notice) {
+                session->handlers.on_notice(session, text, session->handlers.arg);
+            }
+            break;
+        case REPLY_ACK:
+            result.accepted = frame_get_int(&reader);
+            result.rejected = frame_get_int(&reader);
+            result.ok = frame_get_int(&reader) == 0;
+            complete(session, header.seq, 1, &result);
+            break;
+    }
+    return header.type;
+}
+
+// Función para atender las tramas que el servidor dejó en el anillo
+static void read_ring(Session *session) {
+    char *frame = session->frame;
+    uint32_t len;
+    do {
+        while ((len = ring_pop(&session->ring->down, frame, sizeof(session->frame))) != 0) {
+            if (len <= sizeof(session->frame) && frame_check(frame, len, sizeof(session->frame)) == len) {
+                handle_reply(session, frame);
+            }
+        }
+    } while (!ring_sleep(&session->ring->down));
+}
+
+Session *session_open(const char *username, const SessionHandlers *handlers) {
+    Session *session = calloc(1, sizeof(Session));
+    if (!session) {
+        return NULL;
+    }
+    snprintf(session->username, sizeof(session->username), "%s", username);
+    session->pid = getpid();
+    if (handlers) {
+        session->handlers = *handlers;
+    }
+    frame_stream_init(&session->replies);
+
+    // La primera sesión del proceso usa la pipe de siempre; las demás, una con su número
+    int number = atomic_fetch_add(&sessions_opened, 1);
+    if (number == 0) {
+        snprintf(session->client_pipe, sizeof(session->client_pipe), CLIENT_PIPE_FORMAT, session->pid);
+    } else {
+        snprintf(session->client_pipe, sizeof(session->client_pipe), CLIENT_PIPE_FORMAT "_%d", session->pid, number);
+    }
+    mkfifo(session->client_pipe, 0600);
+
+    // Abrir la pipe de la sesión antes de iniciar sesión para que el servidor pueda
+    // abrir su extremo de escritura en modo no bloqueante
+    session->client_fd = open(session->client_pipe, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    session->server_fd = session->client_fd == -1 ? -1 : open(SERVER_PIPE, O_WRONLY | O_CLOEXEC);
+    if (session->server_fd == -1) {
+        int error = errno;
+        if (session->client_fd != -1) {
+            close(session->client_fd);
+        }
+        unlink(session->client_pipe);
+        free(session);
+        errno = error;
+        return NULL;
+    }
+
+    // Inicio de sesión: indica la pipe por la que el servidor debe responder
+    char frame[MAX_REQUEST_LEN];
+    FrameWriter writer;
+    begin_command(session, &writer, frame, sizeof(frame), CMD_LOGIN);
+    frame_put_string(&writer, session->client_pipe, sizeof(session->client_pipe) - 1);
+    frame_put_int(&writer, session->handlers.owns_process ? 0 : LOGIN_SHARED_PROCESS);
+    if (send_request(session, &writer, CMD_LOGIN, session->handlers.on_login, session->handlers.arg, NULL) == -1) {
+        session_close(session, SESSION_DROP);
+        return NULL;
+    }
+    return session;
+}
+
+int session_use_ring(Session *session, session_done_fn done, void *arg) {
+    if (session->ring) {
+        return 0;
+    }
+    ring_region_name(session->ring_name, session->client_pipe);
+    session->ring = ring_region_create(session->ring_name);
+    if (!session->ring) {
+        return -1;
+    }
+    // El anillo aún no está activo: la solicitud va por la pipe
+    char frame[MAX_REQUEST_LEN];
+    FrameWriter writer;
+    begin_command(session, &writer, frame, sizeof(frame), CMD_ATTACH_RING);
+    return send_request(session, &writer, CMD_ATTACH_RING, done, arg, NULL);
+}
+
+int session_fd(const Session *session) {
+    return session->client_fd;
+}
+
+int session_process(Session *session) {
+    ssize_t bytes_read;
+    while ((bytes_read = frame_stream_fill(&session->replies, session->client_fd)) > 0) {
+        const char *reply;
+        size_t reply_len;
+        int status;
+        session->answered = 1;
+        while ((status = frame_stream_next(&session->replies, MAX_FRAME_LEN, &reply, &reply_len)) != 0) {
+            if (status == -1) {
+                if (session->handlers.on_notice) {
+                    session->handlers.on_notice(session, "Respuesta no válida del servidor, se descarta.", session->handlers.arg);
+                }
+            } else if (handle_reply(session, reply) == REPLY_DOORBELL && session->ring) {
+                // Lo que llegó por la pipe antes del timbre va antes que lo del anillo
+                read_ring(session);
+            }
+        }
+    }
+    if (session->backlog_len > 0) {
+        backlog_flush(session);
+    }
+    // Sin datos por ahora, o el servidor cerró su extremo de la pipe
+    return bytes_read == 0 && session->answered ? -1 : 0;
+}
+
+int session_subscribe(Session *session, const char *topic, uint64_t cursor,
+                      session_message_fn on_message, session_done_fn done, void *arg) {
+    if (strlen(topic) > MAX_TOPIC_FIELD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    // La suscripción se anota ya: los mensajes retenidos llegan antes que su resultado
+    int i = find_subscription(session, topic);
+    if (i == -1) {
+        if (session->subscription_count == session->subscription_cap &&
+            !grow((void **)&session->subscriptions, &session->subscription_cap, sizeof(Subscription))) {
+            return -1;
+        }
+        i = session->subscription_count++;
+        snprintf(session->subscriptions[i].topic, sizeof(session->subscriptions[i].topic), "%s", topic);
+    }
+    session->subscriptions[i].on_message = on_message;
+    session->subscriptions[i].arg = arg;
+
+    char frame[MAX_REQUEST_LEN];
+    FrameWriter writer;
+    begin_command(session, &writer, frame, sizeof(frame), CMD_SUBSCRIBE);
+    frame_put_string(&writer, topic, MAX_TOPIC_FIELD);
+    if (cursor != CURSOR_ALL) {
+        frame_put_u64(&writer, cursor); // sin cursor, una suscripción que ya existía no reenvía nada
+    }
+    return send_request(session, &writer, CMD_SUBSCRIBE, done, arg, topic);
+}
+
+int session_unsubscribe(Session *session, const char *topic, session_done_fn done, void *arg) {
+    forget_subscription(session, topic);
+    char frame[MAX_REQUEST_LEN];
+    FrameWriter writer;
+    begin_command(session, &writer, frame, sizeof(frame), CMD_UNSUBSCRIBE);
+    frame_put_string(&writer, topic, MAX_TOPIC_FIELD);
+    return send_request(session, &writer, CMD_UNSUBSCRIBE, done, arg, NULL);
+}
+
+int session_publish(Session *session, const char *topic, int lifetime, const char *text,
+                    session_done_fn done, void *arg) {
+    if (strlen(topic) > MAX_TOPIC_FIELD || strlen(text) > TAM_MSG - 1) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    char frame[MAX_REQUEST_LEN];
+    FrameWriter writer;
+    begin_command(session, &writer, frame, sizeof(frame), CMD_MSG);
+    frame_put_string(&writer, topic, MAX_TOPIC_FIELD);
+    frame_put_int(&writer, lifetime);
+    frame_put_string(&writer, text, TAM_MSG - 1);
+    return send_request(session, &writer, CMD_MSG, done, arg, NULL);
+}
+
+int session_list_topics(Session *session, session_done_fn done, void *arg) {
+    char frame[MAX_REQUEST_LEN];
+    FrameWriter writer;
+    begin_command(session, &writer, frame, sizeof(frame), CMD_TOPICS);
+    return send_request(session, &writer, CMD_TOPICS, done, arg, NULL);
+}
+
+void session_batch_begin(Session *session, session_done_fn done, void *arg) {
+    session->batch_done = done;
+    session->batch_arg = arg;
+}
+
+int session_batch_flush(Session *session) {
+    if (session->batch_count == 0) {
+        return 0;
+    }
+    // Si no se puede enviar, el lote se conserva para volver a intentarlo
+    if (send_request(session, &session->batch_writer, CMD_MSG_BATCH, session->batch_done, session->batch_arg, NULL) == -1) {
+        return -1;
+    }
+    session->batch_count = 0;
+    return 0;
+}
+
+int session_batch_add(Session *session, const char *topic, int lifetime, const char *text) {
+    if (strlen(topic) > MAX_TOPIC_FIELD || strlen(text) > TAM_MSG - 1) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (session->batch_count == 0) {
+            begin_command(session, &session->batch_writer, session->batch_frame, sizeof(session->batch_frame), CMD_MSG_BATCH);
+        }
+        size_t mark = session->batch_writer.len;
+        frame_put_string(&session->batch_writer, topic, MAX_TOPIC_FIELD);
+        frame_put_int(&session->batch_writer, lifetime);
+        frame_put_string(&session->batch_writer, text, TAM_MSG - 1);
+        if (!session->batch_writer.overflow) {
+            session->batch_count++;
+            return 0;
+        }
+        // No cabe: deshacer, enviar el lote y empezar otro con este mensaje
+        session->batch_writer.len = mark;
+        session->batch_writer.overflow = 0;
+        if (session_batch_flush(session) == -1) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+int session_pending(const Session *session) {
+    return session->pending_count;
+}
+
+void session_close(Session *session, int how) {
+    if (how != SESSION_DROP && session->server_fd != -1) {
+        // El aviso va por la pipe: el servidor lo atiende aunque haya comandos en el anillo
+        char frame[MAX_REQUEST_LEN];
+        FrameWriter writer;
+        begin_command(session, &writer, frame, sizeof(frame), how == SESSION_INTERRUPT ? CMD_CTRLC : CMD_EXIT);
+        write_to_server_pipe(session, frame, frame_end(&writer));
+    }
+    if (session->ring) {
+        shm_unlink(session->ring_name); // por si el servidor no llegó a proyectarla
+        ring_region_detach(session->ring);
+    }
+    if (session->server_fd != -1) {
+        close(session->server_fd);
+    }
+    close(session->client_fd);
+    unlink(session->client_pipe);
+    free(session->pending);
+    free(session->subscriptions);
+    free(session->backlog);
+    free(session);
+}
@@ -0,0 +1,108 @@
+#ifndef PLATAFORMA_H
+#define PLATAFORMA_H
+
+#include <stdint.h>
+#include "protocolo.h"
+
+// Biblioteca de cliente de la plataforma (libplataforma).
+//
+// Una sesión con el servidor que no bloquea a la espera de respuestas: cada operación envía
+// su solicitud y vuelve en el momento, de modo que se pueden encadenar muchas sin esperar.
+// Las respuestas llegan a funciones de retorno cuando la aplicación llama a session_process
+// porque el descriptor de session_fd está listo para leer; ese descriptor se puede añadir a
+// cualquier bucle de eventos (epoll, poll, select...).
+//
+// Un proceso puede abrir varias sesiones, cada una con su usuario y su pipe de respuestas. Las
+// respuestas no se multiplexan por una única pipe del proceso: el servidor escribe a cada sesión
+// desde su propia cola de salida con escrituras de varias tramas que no son atómicas entre sí, y
+// sus tramas no llevan la sesión a la que van. Varias sesiones ahorran el proceso, no la pipe.
+// Cada sesión se usa desde un único hilo, y una función de retorno no debe cerrar su sesión.
+// Las solicitudes caben en PIPE_BUF: su escritura solo espera si la pipe del servidor está llena.
+// Con el anillo de memoria compartida lleno no se espera: las solicitudes se guardan en la sesión
+// y session_process las pasa al anillo a medida que el servidor lo vacía.
+
+// Formas de cerrar una sesión
+enum {
+    SESSION_EXIT, // avisar al servidor de que el usuario sale
+    SESSION_INTERRUPT, // avisar al servidor de un CTRL+C
+    SESSION_DROP // solo liberar los recursos locales (el servidor ya cerró la sesión)
+};
+
+// Sesión con el servidor
+typedef struct Session Session;
+
+// Resultado de una solicitud
+typedef struct {
+    uint32_t seq; // número de secuencia de la solicitud
+    int ok; // 1 si el servidor la aceptó, 0 si la rechazó
+    const char *text; // texto de la respuesta (vacío en la confirmación de un lote)
+    int accepted, rejected; // lote: mensajes aceptados y rechazados
+} SessionResult;
+
+// Mensaje publicado en un tópico suscrito
+typedef struct {
+    uint64_t id; // número del mensaje (sirve de cursor para volver a suscribirse)
+    const char *topic;
+    const char *user;
+    const char *text;
+} SessionMessage;
+
+// Funciones de retorno: fin de una solicitud, mensaje recibido y aviso del servidor
+typedef void (*session_done_fn)(Session *session, const SessionResult *result, void *arg);
+typedef void (*session_message_fn)(Session *session, const SessionMessage *message, void *arg);
+typedef void (*session_notice_fn)(Session *session, const char *text, void *arg);
+
+// Funciones de retorno generales de una sesión (cualquiera puede ser NULL)
+typedef struct {
+    session_done_fn on_login; // resultado del inicio de sesión
+    session_message_fn on_message; // mensaje que no cubre ninguna suscripción de esta sesión
+                                   // (p. ej. de una suscripción hecha en una sesión anterior)
+    session_notice_fn on_notice; // texto que no responde a ninguna solicitud (bloqueos, bajas,
+                                 // errores de mensajes sueltos de un lote...)
+    void *arg; // argumento de las tres
+    int owns_process; // 1 si el proceso solo aloja esta sesión: el servidor lo termina al rechazar el
+                      // inicio de sesión o con remove (con 0 solo cierra la pipe de la sesión)
+} SessionHandlers;
+
+// Abre una sesión del usuario dado: crea su pipe y envía el inicio de sesión (NULL si falla)
+Session *session_open(const char *username, const SessionHandlers *handlers);
+
+// Negocia con el servidor el transporte de memoria compartida (las pipes siguen como alternativa)
+int session_use_ring(Session *session, session_done_fn done, void *arg);
+
+// Descriptor que hay que vigilar para leer (llamar entonces a session_process)
+int session_fd(const Session *session);
+
+// Atiende lo que haya llegado y llama a las funciones de retorno; -1 si el servidor cerró la sesión
+int session_process(Session *session);
+
+// Suscribe la sesión a un tópico o patrón: los mensajes que cubre llegan a on_message. Se reenvían
+// los mensajes retenidos a partir del número cursor (CURSOR_ALL, CURSOR_LATEST o un número); si
+// el usuario ya estaba suscrito, solo se reenvían con un cursor distinto de CURSOR_ALL
+int session_subscribe(Session *session, const char *topic, uint64_t cursor,
+                      session_message_fn on_message, session_done_fn done, void *arg);
+
+// Da de baja la suscripción a un tópico o patrón
+int session_unsubscribe(Session *session, const char *topic, session_done_fn done, void *arg);
+
+// Publica un mensaje (lifetime en segundos; 0 = no se retiene)
+int session_publish(Session *session, const char *topic, int lifetime, const char *text,
+                    session_done_fn done, void *arg);
+
+// Pide la lista de tópicos (llega como texto del resultado)
+int session_list_topics(Session *session, session_done_fn done, void *arg);
+
+// Lotes: los mensajes añadidos se envían agrupados (cada lote, cuando se llena o con
+// session_batch_flush) y cada lote se confirma con una sola llamada a done. Si el envío falla, el
+// lote se conserva y el siguiente session_batch_flush lo vuelve a intentar
+void session_batch_begin(Session *session, session_done_fn done, void *arg);
+int session_batch_add(Session *session, const char *topic, int lifetime, const char *text);
+int session_batch_flush(Session *session);
+
+// Solicitudes enviadas que aún no tienen resultado
+int session_pending(const Session *session);
+
+// Cierra la sesión (how: SESSION_EXIT, SESSION_INTERRUPT o SESSION_DROP) y libera sus recursos
+void session_close(Session *session, int how);
+
+#endif
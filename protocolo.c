@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "protocolo.h"
+
+// La cabecera se copia tal cual: ambos extremos están en la misma máquina
+_Static_assert(sizeof(FrameHeader) == FRAME_HEADER_LEN, "cabecera de trama con relleno");
+
+// Función para añadir bytes a la trama en construcción
+static void frame_put(FrameWriter *writer, const void *data, size_t len) {
+    if (writer->overflow || writer->len + len > writer->cap || writer->len + len > MAX_FRAME_LEN) {
+        writer->overflow = 1;
+        return;
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+}
+
+// Función para sacar bytes de la carga de una trama
+static void frame_get(FrameReader *reader, void *out, size_t len) {
+    if (reader->error || len > reader->left) {
+        reader->error = 1;
+        memset(out, 0, len);
+        return;
+    }
+    memcpy(out, reader->data, len);
+    reader->data += len;
+    reader->left -= len;
+}
+
+void frame_begin(FrameWriter *writer, char *buf, size_t cap, int type, uint32_t seq) {
+    FrameHeader header = { .version = PROTO_VERSION, .type = type, .length = 0, .seq = seq };
+    writer->buf = buf;
+    writer->cap = cap;
+    writer->len = 0;
+    writer->overflow = 0;
+    frame_put(writer, &header, sizeof(header));
+}
+
+void frame_put_int(FrameWriter *writer, int32_t value) {
+    frame_put(writer, &value, sizeof(value));
+}
+
+void frame_put_string(FrameWriter *writer, const char *text, size_t max) {
+    uint16_t len = strnlen(text, max < MAX_FRAME_PAYLOAD ? max : MAX_FRAME_PAYLOAD);
+    frame_put(writer, &len, sizeof(len));
+    frame_put(writer, text, len);
+}
+
+void frame_put_u64(FrameWriter *writer, uint64_t value) {
+    frame_put(writer, &value, sizeof(value));
+}
+
+size_t frame_end(FrameWriter *writer) {
+    if (writer->overflow) {
+        return 0;
+    }
+    uint16_t length = writer->len - FRAME_HEADER_LEN;
+    memcpy(writer->buf + offsetof(FrameHeader, length), &length, sizeof(length));
+    return writer->len;
+}
+
+ssize_t frame_check(const char *buf, size_t len, size_t max_len) {
+    if (len < FRAME_HEADER_LEN) {
+        return 0;
+    }
+    FrameHeader header;
+    memcpy(&header, buf, sizeof(header));
+    size_t total = FRAME_HEADER_LEN + header.length;
+    if (header.version != PROTO_VERSION || total > max_len) {
+        return -1;
+    }
+    return len < total ? 0 : (ssize_t)total;
+}
+
+void frame_open(FrameReader *reader, FrameHeader *header, const char *frame) {
+    memcpy(header, frame, sizeof(*header));
+    reader->data = frame + FRAME_HEADER_LEN;
+    reader->left = header->length;
+    reader->error = 0;
+}
+
+int32_t frame_get_int(FrameReader *reader) {
+    int32_t value;
+    frame_get(reader, &value, sizeof(value));
+    return value;
+}
+
+uint64_t frame_get_u64(FrameReader *reader) {
+    uint64_t value;
+    frame_get(reader, &value, sizeof(value));
+    return value;
+}
+
+size_t frame_get_string(FrameReader *reader, char *out, size_t cap) {
+    uint16_t len;
+    frame_get(reader, &len, sizeof(len));
+    if (reader->error || len > reader->left) {
+        reader->error = 1;
+        out[0] = '\0';
+        return 0;
+    }
+    size_t copied = len < cap - 1 ? len : cap - 1;
+    memcpy(out, reader->data, copied);
+    out[copied] = '\0';
+    reader->data += len;
+    reader->left -= len;
+    return copied;
+}
+
+void frame_stream_init(FrameStream *stream) {
+    stream->start = 0;
+    stream->len = 0;
+    stream->accept = NULL;
+}
+
+ssize_t frame_stream_fill(FrameStream *stream, int fd) {
+    // Mover al principio el resto de una trama incompleta para dejar sitio a la siguiente lectura
+    if (stream->start > 0) {
+        memmove(stream->buf, stream->buf + stream->start, stream->len - stream->start);
+        stream->len -= stream->start;
+        stream->start = 0;
+    }
+    ssize_t bytesRead;
+    do {
+        bytesRead = read(fd, stream->buf + stream->len, sizeof(stream->buf) - stream->len);
+    } while (bytesRead < 0 && errno == EINTR);
+    if (bytesRead > 0) {
+        stream->len += bytesRead;
+    }
+    return bytesRead;
+}
+
+int frame_stream_next(FrameStream *stream, size_t max_len, const char **frame, size_t *len) {
+    ssize_t total = frame_check(stream->buf + stream->start, stream->len - stream->start, max_len);
+    if (total < 0) {
+        // Una cabecera que solo lo parece (p. ej. dentro del texto de la trama dañada) no basta para
+        // retomar el flujo: hace falta una trama completa que acepte la validación del llamante
+        for (size_t pos = stream->start + 1; pos + FRAME_HEADER_LEN <= stream->len; pos++) {
+            ssize_t candidate = frame_check(stream->buf + pos, stream->len - pos, max_len);
+            if (candidate > 0 && stream->accept && stream->accept(stream->buf + pos, candidate)) {
+                stream->start = pos;
+                return -1;
+            }
+        }
+        stream->start = stream->len = 0;
+        return -1;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    *frame = stream->buf + stream->start;
+    *len = total;
+    stream->start += total;
+    return 1;
+}
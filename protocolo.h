@@ -0,0 +1,135 @@
+#ifndef PROTOCOLO_H
+#define PROTOCOLO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+
+// Protocolo binario entre los clientes y el servidor.
+//
+// Cada trama lleva una cabecera fija (versión, tipo, longitud de la carga y número de
+// secuencia) seguida de campos de longitud variable: enteros de 32 bits y cadenas con su
+// longitud delante (sin el carácter nulo). Las solicitudes empiezan siempre con el PID y el
+// nombre de usuario del remitente. Las respuestas a una solicitud repiten su número de
+// secuencia; las notificaciones que nadie pidió llevan la secuencia 0. Los mensajes publicados
+// llevan además su número de mensaje: crece con cada publicación y sirve de cursor para que
+// una suscripción pida solo los mensajes retenidos a partir de uno dado.
+//
+// Las solicitudes caben en PIPE_BUF, así que cada una llega entera a la pipe del servidor
+// aunque escriban varios clientes a la vez. FrameStream reúne las tramas que un read trae
+// partidas o juntas.
+
+#define PROTO_VERSION 1
+#define FRAME_HEADER_LEN 8 // bytes de la cabecera
+#define MAX_FRAME_PAYLOAD 65535 // bytes máximos de la carga de una trama
+#define MAX_FRAME_LEN (FRAME_HEADER_LEN + MAX_FRAME_PAYLOAD)
+#define MAX_REQUEST_LEN PIPE_BUF // bytes máximos de una solicitud (la escritura en la pipe es atómica)
+#define MAX_NAME_FIELD 49 // bytes máximos de un nombre de usuario en una solicitud
+#define MAX_TOPIC_FIELD 128 // bytes máximos de un nombre de tópico (o patrón) en una solicitud
+#define CURSOR_ALL 0 // cursor de suscripción: todos los mensajes retenidos
+#define CURSOR_LATEST UINT64_MAX // cursor de suscripción: solo los mensajes que se publiquen a partir de ahora
+#define LOGIN_SHARED_PROCESS 1 // indicador de CMD_LOGIN: el proceso aloja varias sesiones y no se le envían señales
+
+// Tipos de trama: comandos de los clientes
+enum {
+    CMD_LOGIN, // pid, usuario, pipe del cliente y, opcionalmente, indicadores LOGIN_*
+    CMD_SUBSCRIBE, // pid, usuario, tópico y, opcionalmente, cursor de 64 bits (primer número de mensaje a reenviar)
+    CMD_TOPICS, // pid, usuario
+    CMD_EXIT, // pid, usuario
+    CMD_UNSUBSCRIBE, // pid, usuario, tópico
+    CMD_MSG, // pid, usuario, tópico, lifetime, mensaje
+    CMD_CTRLC, // pid, usuario
+    CMD_ATTACH_RING, // pid, usuario
+    CMD_DOORBELL, // pid, usuario
+    CMD_MSG_BATCH // pid, usuario y, hasta el final de la carga, tópico, lifetime y mensaje de cada mensaje
+};
+
+// Tipos de trama: respuestas del servidor
+enum {
+    REPLY_TEXT = 64, // texto
+    REPLY_DOORBELL, // sin carga: hay tramas nuevas en el anillo de la sesión
+    REPLY_ACK, // confirmación de un lote: aceptados, rechazados, estado (0 = guardado, -1 = error al guardar)
+    REPLY_MESSAGE, // mensaje publicado: número de mensaje (64 bits), tópico, usuario y mensaje
+    REPLY_ERROR // texto de una solicitud rechazada
+};
+
+// Cabecera de una trama
+typedef struct {
+    uint8_t version; // PROTO_VERSION
+    uint8_t type; // CMD_* o REPLY_*
+    uint16_t length; // bytes de la carga
+    uint32_t seq; // número de secuencia
+} FrameHeader;
+
+// Construcción de una trama en un buffer del llamante
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+    int overflow; // algún campo no cabía
+} FrameWriter;
+
+// Lectura de los campos de la carga de una trama
+typedef struct {
+    const char *data;
+    size_t left;
+    int error; // algún campo estaba incompleto
+} FrameReader;
+
+// Función que decide si una trama completa es válida para retomar el flujo tras una cabecera no válida
+typedef int (*frame_accept_fn)(const char *frame, size_t len);
+
+// Reensamblado de las tramas de un descriptor (lecturas partidas o con varias tramas)
+typedef struct {
+    char buf[2 * MAX_FRAME_LEN];
+    size_t start; // inicio de la siguiente trama sin procesar
+    size_t len; // fin de los bytes leídos
+    frame_accept_fn accept; // validación para retomar el flujo (NULL = se descarta todo lo leído)
+} FrameStream;
+
+// Empieza una trama del tipo y secuencia dados
+void frame_begin(FrameWriter *writer, char *buf, size_t cap, int type, uint32_t seq);
+
+// Añade un entero de 32 bits
+void frame_put_int(FrameWriter *writer, int32_t value);
+
+// Añade una cadena (se trunca si supera max bytes)
+void frame_put_string(FrameWriter *writer, const char *text, size_t max);
+
+// Añade un entero de 64 bits
+void frame_put_u64(FrameWriter *writer, uint64_t value);
+
+// Cierra la trama escribiendo la longitud de la carga; devuelve su tamaño total (0 si no cabía)
+size_t frame_end(FrameWriter *writer);
+
+// Comprueba si buf empieza con una trama completa: devuelve su tamaño total, 0 si faltan
+// bytes o -1 si la cabecera no es válida
+ssize_t frame_check(const char *buf, size_t len, size_t max_len);
+
+// Prepara la lectura de la carga de una trama completa y copia su cabecera
+void frame_open(FrameReader *reader, FrameHeader *header, const char *frame);
+
+// Lee un entero de 32 bits
+int32_t frame_get_int(FrameReader *reader);
+
+// Lee un entero de 64 bits
+uint64_t frame_get_u64(FrameReader *reader);
+
+// Lee una cadena en out (truncada a cap - 1 bytes y terminada en nulo); devuelve su longitud
+size_t frame_get_string(FrameReader *reader, char *out, size_t cap);
+
+// Inicializa un reensamblador vacío (sin validación para retomar el flujo)
+void frame_stream_init(FrameStream *stream);
+
+// Lee del descriptor lo que quepa en el reensamblador (devuelve lo mismo que read)
+ssize_t frame_stream_fill(FrameStream *stream, int fd);
+
+// Saca la siguiente trama completa: 1 si hay una (frame apunta a ella y len es su tamaño),
+// 0 si faltan bytes, -1 si había una cabecera no válida. Tras ella el flujo solo se retoma en una
+// trama completa que acepta stream->accept; si no hay ninguna se descarta todo lo leído (cada
+// escritura de menos de PIPE_BUF llega entera, así que no se parte ninguna trama de otro escritor).
+// Después de -1 se puede seguir llamando
+int frame_stream_next(FrameStream *stream, size_t max_len, const char **frame, size_t *len);
+
+#endif
@@ -0,0 +1,213 @@
+#!/bin/bash
+# Pruebas de extremo a extremo: arrancan el servidor en un directorio temporal, le envían
+# solicitudes con el cliente y comprueban lo que queda tras reiniciarlo.
+# Uso: ./pruebas.sh (o make test), con servidor y cliente ya compilados.
+
+set -u
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+WORK_DIR=$(mktemp -d)
+SERVER_PID=
+FAILED=0
+
+# Función para terminar el servidor que quede en marcha y borrar el directorio temporal
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+    fi
+    exec 3>&- 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# Función para arrancar el servidor con la consola del manager en la pipe "consola"
+# (los argumentos son variables de entorno, p. ej. TOPIC_SHARDS=4)
+start_server() {
+    [ -p consola ] || mkfifo consola
+    env "$@" ./servidor < consola >> servidor.log 2>&1 &
+    SERVER_PID=$!
+    exec 3> consola
+    for _ in $(seq 50); do
+        [ -p server_pipe ] && return
+        sleep 0.1
+    done
+    echo "El servidor no ha arrancado"
+    exit 1
+}
+
+# Función para enviar un comando a la consola del manager
+console() {
+    echo "$1" >&3
+}
+
+# Función para cerrar el servidor desde la consola y esperar a que termine
+stop_server() {
+    console close
+    exec 3>&-
+    wait "$SERVER_PID"
+    SERVER_PID=
+}
+
+# Función para publicar en modo por lotes un mensaje persistente en cada tópico t<n>, de first a last
+publish_range() {
+    for i in $(seq "$1" "$2"); do
+        echo "msg t$i 600 n$i"
+    done > lote.txt
+    ./cliente productor --batch lote.txt > /dev/null
+}
+
+# Función para exportar los mensajes retenidos a mensajes.txt y esperar a que se escriban
+export_messages() {
+    rm -f mensajes.txt
+    console export
+    for _ in $(seq 50); do
+        grep -q "Se exportaron" servidor.log 2>/dev/null && return
+        sleep 0.1
+    done
+}
+
+# Función para ejecutar un cliente interactivo con los comandos dados (uno por argumento, con una
+# pausa entre ellos para que lleguen las respuestas) y guardar su salida en <usuario>.log
+run_client() {
+    local user=$1
+    shift
+    for command in "$@"; do
+        sleep 0.3
+        echo "$command"
+    done | timeout 10 ./cliente "$user" > "$user.log" 2>&1
+}
+
+# Funciones para escribir los campos de una trama del protocolo (enteros en little-endian y cadenas
+# con su longitud de 16 bits) como secuencias de escape de printf %b
+u16() {
+    printf '\\0%03o\\0%03o' $(($1 & 255)) $((($1 >> 8) & 255))
+}
+u32() {
+    u16 $(($1 & 65535))
+    u16 $((($1 >> 16) & 65535))
+}
+str() {
+    u16 ${#1}
+    printf '%s' "$1"
+}
+
+# Función para construir una solicitud topics (tipo 2) con versión, pid y usuario dados
+topics_frame() {
+    printf '\\0%03o\\0002' "$1"
+    u16 $((4 + 2 + ${#3}))
+    u32 1
+    u32 "$2"
+    str "$3"
+}
+
+# Función para construir una solicitud msg (tipo 5) con la versión dañada y, en el texto, bytes
+# que parecen la cabecera de otra trama (versión 1, tipo 5, 96 bytes de carga)
+corrupt_msg_frame() {
+    local text='\0001\0005\0140\0000xxxx\0001\0000\0010\0000'
+    printf '\\0007\\0005'
+    u16 $((4 + 2 + 4 + 2 + 1 + 4 + 2 + 12))
+    u32 1
+    u32 "$1"
+    str malo
+    str t
+    u32 0
+    u16 12
+    printf '%s' "$text"
+}
+
+# Función para comprobar una condición e informar del resultado
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: se esperaba '$3' y se obtuvo '$2'"
+        FAILED=1
+    fi
+}
+
+cp "$SRC_DIR/servidor" "$SRC_DIR/cliente" "$SRC_DIR/bench" "$WORK_DIR" || exit 1
+cd "$WORK_DIR" || exit 1
+
+# Los ids reservados por bloques (MESSAGE_ID_BLOCK) se asignan después a mensajes persistentes:
+# publicar, reiniciar, publicar más allá del bloque y reiniciar no debe perder ninguno
+start_server
+publish_range 0 4499
+stop_server
+start_server
+publish_range 4500 8699
+stop_server
+: > servidor.log
+start_server
+export_messages
+stop_server
+check "reinicios que cruzan un bloque de ids" "$(wc -l < mensajes.txt)" 8700
+check "mensaje en el límite del bloque" "$(grep -c ' n4095$' mensajes.txt)" 1
+
+# Las suscripciones y los bloqueos se reproducen del registro al reiniciar, también con otro número
+# de particiones: ana sigue suscrita a s1 y s2 (no a s3, del que se dio de baja) sin volver a
+# suscribirse, y el tópico bloqueado sigue bloqueado hasta que se desbloquea
+rm -f mensajes.db* mensajes.txt
+start_server TOPIC_SHARDS=1
+printf 'msg cerrado 600 x\nmsg abierto 600 y\n' > lote.txt
+./cliente bob --batch lote.txt > /dev/null
+run_client ana "subscribe s1" "subscribe s2" "subscribe s3" "unsubscribe s3" exit
+console "lock cerrado"
+console "lock abierto"
+console "unlock abierto"
+stop_server
+start_server TOPIC_SHARDS=4
+(sleep 1.5; echo exit) | timeout 10 ./cliente ana > ana.log 2>&1 &
+READER=$!
+sleep 0.5
+printf 'msg s1 0 uno\nmsg s2 0 dos\nmsg s3 0 tres\n' > lote.txt
+./cliente bob --batch lote.txt > /dev/null
+printf 'msg cerrado 0 x\nmsg abierto 0 y\n' > lote.txt
+./cliente bob --batch lote.txt > bob.log
+wait $READER
+stop_server
+check "suscripción reproducida en s1" "$(grep -c '\] s1 bob uno$' ana.log)" 1
+check "suscripción reproducida en s2" "$(grep -c '\] s2 bob dos$' ana.log)" 1
+check "baja reproducida en s3" "$(grep -c ' s3 bob ' ana.log)" 0
+check "bloqueo y desbloqueo reproducidos" "$(grep -o '1 aceptados, 1 rechazados' bob.log)" "1 aceptados, 1 rechazados"
+
+# Con varias particiones, topics reúne los tópicos de todas ellas
+start_server TOPIC_SHARDS=4
+run_client carla topics exit
+stop_server
+check "topics reúne todas las particiones" "$(grep -cE '^- (s1|s2|cerrado|abierto) ' carla.log)" 4
+
+# Un segundo inicio de sesión con el mismo usuario se rechaza sin esperar y termina el proceso
+start_server
+(sleep 2; echo exit) | timeout 10 ./cliente dani > dani.log 2>&1 &
+FIRST=$!
+sleep 0.5
+(sleep 5; echo exit) | timeout 10 ./cliente dani > dani2.log 2>&1
+REJECTED=$?
+wait $FIRST
+stop_server
+check "inicio de sesión duplicado rechazado" "$(grep -c "Username 'dani' is already in use" dani2.log)" 1
+check "proceso rechazado terminado antes de su exit" "$([ $REJECTED -ne 124 ] && echo si)" si
+check "la primera sesión sigue activa" "$(grep -c 'Bienvenido, dani' dani.log)" 1
+
+# Una trama dañada en la pipe del servidor entre tramas válidas de dos escritores solo descarta
+# la dañada: una cabecera falsa dentro de su texto no retiene las tramas que la siguen
+start_server
+printf '%b' "$(topics_frame 1 $$ w1a)$(topics_frame 1 $$ w2a)$(corrupt_msg_frame $$)$(topics_frame 1 $$ w1b)$(topics_frame 1 $$ w2b)" > server_pipe
+sleep 0.5
+: > servidor.log
+console stats
+sleep 0.5
+stop_server
+check "solicitudes válidas alrededor de la trama dañada" "$(grep -c '^ - topics: 4$' servidor.log)" 1
+check "trama dañada descartada" "$(grep -c '^ - msg: ' servidor.log)" 0
+check "trama dañada contada" "$(grep -c 'Tramas no válidas en la pipe del servidor: 1$' servidor.log)" 1
+
+# bench cuenta los rechazos (tópico con el máximo de mensajes persistentes) como confirmaciones
+start_server
+./bench -p 1 -s 1 -t 1 -f 1 -n 20 -P 100 -l 600 -b 1 -w 4 > bench.log 2>&1
+BENCH_STATUS=$?
+stop_server
+check "bench termina con rechazos" "$BENCH_STATUS" 0
+check "bench cuenta los rechazos" "$(grep -o 'aceptados 5, rechazados 15' bench.log)" "aceptados 5, rechazados 15"
+
+exit $FAILED
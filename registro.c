@@ -0,0 +1,1000 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "registro.h"
+#include "metricas.h"
+
+#define DEFAULT_COMPACT_RATIO 50 // porcentaje de registros muertos a partir del cual se compacta
+#define STORE_MAGIC "PMSTORE" // firma del almacén (8 bytes con el nulo)
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7) // los registros empiezan en múltiplos de 8
+#define STORE_TOPIC_LOCKED 1 // indicador de StoreTopic.flags: el tópico está bloqueado
+#define LOG_RESERVE 'R' // tipo del registro que reserva ids (sin tópico, usuario ni mensaje)
+
+// Cabecera del almacén
+typedef struct {
+    char magic[8]; // STORE_MAGIC
+    uint32_t version; // STORE_VERSION
+    uint32_t topic_count; // entradas del directorio de tópicos
+    uint64_t record_count; // mensajes guardados en el almacén
+    uint64_t max_id; // mayor id asignado al escribirlo (los ids no se reutilizan)
+    uint64_t sealed_seq; // los segmentos hasta este número están incluidos en el almacén
+    uint64_t directory_length; // bytes del directorio, que sigue a la cabecera
+    uint64_t file_size; // tamaño total del fichero
+    uint32_t directory_checksum; // CRC32 del directorio
+    uint32_t header_checksum; // CRC32 de los campos anteriores
+} StoreHeader;
+
+// Entrada del directorio de tópicos
+typedef struct {
+    uint64_t offset; // desplazamiento de los registros del tópico desde el inicio del fichero
+    uint64_t length; // bytes de los registros del tópico
+    uint32_t count; // número de registros del tópico
+    uint32_t checksum; // CRC32 de los registros del tópico
+    uint16_t name_len; // longitud del nombre sin el nulo
+    uint16_t flags; // STORE_TOPIC_LOCKED (versión 2; reservado en la 1)
+    uint32_t subscriber_count; // usuarios suscritos, cuyos nombres terminados en nulo siguen a los
+                               // registros y cuentan en length y checksum (versión 2; reservado en la 1)
+    char name[]; // nombre terminado en nulo
+} StoreTopic;
+
+// Mensaje guardado en el almacén (el tópico lo da la entrada del directorio)
+typedef struct {
+    uint32_t length; // longitud total del registro, múltiplo de 8
+    uint16_t user_len; // longitud del usuario sin el nulo
+    uint16_t message_len; // longitud del mensaje sin el nulo
+    uint64_t id;
+    int64_t expiry;
+    char data[]; // usuario y mensaje, terminados en nulo
+} StoreRecord;
+
+// Registro de un segmento
+typedef struct {
+    uint32_t length; // longitud total del registro, múltiplo de 8
+    uint32_t checksum; // CRC32 de los bytes que siguen a este campo
+    uint8_t type; // '+' mensaje retenido, '-' tombstone, LOG_RESERVE o WAL_* (cambio de estado, sin id ni mensaje)
+    uint8_t reserved;
+    uint16_t topic_len;
+    uint16_t user_len;
+    uint16_t message_len;
+    uint64_t id;
+    int64_t expiry;
+    char data[]; // tópico, usuario y mensaje, terminados en nulo
+} LogRecord;
+
+// Conjunto de ids (direccionamiento abierto, 0 = posición libre)
+typedef struct {
+    uint64_t *slots;
+    size_t cap;
+    size_t count;
+} IdSet;
+
+// Buffer de bytes que crece bajo demanda
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+// Registros y estado de un tópico en la instantánea
+typedef struct {
+    char *name;
+    Buffer records;
+    uint32_t count;
+    uint16_t flags; // STORE_TOPIC_LOCKED
+    Buffer subscribers; // nombres de los usuarios suscritos, terminados en nulo
+    uint32_t subscriber_count;
+} SnapshotTopic;
+
+static char base_path[512]; // ruta del almacén
+static char dir_path[512]; // directorio del almacén
+static const char *base_name; // nombre del almacén dentro de dir_path
+static uint32_t crc_table[8][256];
+static int segment_fd = -1; // segmento activo
+static unsigned long segment_seq = 0; // número del segmento activo
+static size_t segment_records = 0; // registros escritos en el segmento activo
+static Buffer pending; // registros pendientes de escribir en el segmento activo
+static Buffer writing; // registros que se están escribiendo (intercambiado con pending en cada commit)
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER; // protege pending y el estado del registro
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // serializa las escrituras del segmento activo
+                                                                // (se toma antes que wal_lock)
+static size_t store_records = 0; // registros en el almacén
+static size_t log_records = 0; // registros en los segmentos
+static uint64_t last_id = 0; // mayor id registrado
+static int compact_ratio = DEFAULT_COMPACT_RATIO;
+static int checkpoint_interval = WAL_CHECKPOINT_INTERVAL; // segundos entre compactados periódicos (0 = ninguno)
+static time_t last_checkpoint = 0; // instante del último compactado (o de la apertura)
+static int imported = 0; // se importó el fichero de texto
+
+// Estado de la compactación
+static SnapshotTopic *snapshot_topics = NULL; // registros de la instantánea agrupados por tópico
+static size_t snapshot_topic_count = 0;
+static size_t snapshot_topic_cap = 0;
+static size_t *snapshot_slots = NULL; // índice hash nombre -> posición + 1 en snapshot_topics
+static size_t snapshot_slot_cap = 0;
+static size_t snapshot_records = 0; // mensajes vivos en la instantánea
+static uint64_t snapshot_max_id = 0;
+static size_t records_since_rotation = 0; // registros añadidos desde que empezó la compactación
+static unsigned long sealed_seq = 0; // los segmentos hasta este número quedan cubiertos por la instantánea
+static int compacting = 0; // hay una instantánea en curso (desde wal_snapshot_begin hasta que se escribe)
+static int compact_running = 0; // la escribe un hilo en segundo plano
+static pthread_t compact_thread;
+static int event_fd = -1;
+
+// Función para preparar las tablas del CRC32 (slice-by-8: ocho bytes por iteración)
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+        crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+// Función para calcular el CRC32 de un bloque
+static uint32_t checksum(const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    uint32_t crc = 0xFFFFFFFFu;
+    while (len >= 8) {
+        uint32_t low, high;
+        memcpy(&low, bytes, 4);
+        memcpy(&high, bytes + 4, 4);
+        low ^= crc;
+        crc = crc_table[7][low & 0xFF] ^ crc_table[6][(low >> 8) & 0xFF] ^
+              crc_table[5][(low >> 16) & 0xFF] ^ crc_table[4][low >> 24] ^
+              crc_table[3][high & 0xFF] ^ crc_table[2][(high >> 8) & 0xFF] ^
+              crc_table[1][(high >> 16) & 0xFF] ^ crc_table[0][high >> 24];
+        bytes += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = crc_table[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Función hash para los ids
+static size_t hash_id(uint64_t id) {
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return (size_t)id;
+}
+
+// Función para comprobar si un id está en el conjunto
+static int id_set_contains(const IdSet *set, uint64_t id) {
+    if (set->cap == 0) {
+        return 0;
+    }
+    for (size_t pos = hash_id(id) & (set->cap - 1); set->slots[pos] != 0; pos = (pos + 1) & (set->cap - 1)) {
+        if (set->slots[pos] == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Función para añadir un id al conjunto (duplicando la tabla al llenarse)
+static void id_set_add(IdSet *set, uint64_t id) {
+    if ((set->count + 1) * 2 > set->cap) {
+        IdSet bigger = { calloc(set->cap ? set->cap * 2 : 256, sizeof(uint64_t)), set->cap ? set->cap * 2 : 256, 0 };
+        if (!bigger.slots) {
+            perror("Error al reservar memoria para el registro");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < set->cap; i++) {
+            if (set->slots[i] != 0) {
+                id_set_add(&bigger, set->slots[i]);
+            }
+        }
+        free(set->slots);
+        *set = bigger;
+    }
+    size_t pos = hash_id(id) & (set->cap - 1);
+    while (set->slots[pos] != 0) {
+        if (set->slots[pos] == id) {
+            return;
+        }
+        pos = (pos + 1) & (set->cap - 1);
+    }
+    set->slots[pos] = id;
+    set->count++;
+}
+
+// Función para reservar n bytes a cero al final de un buffer
+static char *buffer_reserve(Buffer *buffer, size_t n) {
+    if (buffer->len + n > buffer->cap) {
+        size_t new_cap = buffer->cap ? buffer->cap : 4096;
+        while (new_cap < buffer->len + n) {
+            new_cap *= 2;
+        }
+        char *new_data = realloc(buffer->data, new_cap);
+        if (!new_data) {
+            perror("Error al reservar memoria para el registro");
+            exit(EXIT_FAILURE);
+        }
+        buffer->data = new_data;
+        buffer->cap = new_cap;
+    }
+    char *ptr = buffer->data + buffer->len;
+    memset(ptr, 0, n);
+    buffer->len += n;
+    return ptr;
+}
+
+// Función para escribir un bloque completo en un descriptor
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Función para sincronizar el directorio del registro (altas, bajas y renombrados de ficheros)
+static void sync_dir() {
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Función para construir la ruta de un segmento
+static void segment_path(char *out, size_t size, unsigned long seq) {
+    snprintf(out, size, "%s.%lu", base_path, seq);
+}
+
+// Función de comparación para ordenar los números de segmento
+static int compare_seq(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+// Función para obtener los números de los segmentos existentes ordenados (devuelve cuántos hay)
+static size_t list_segments(unsigned long **seqs) {
+    *seqs = NULL;
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return 0;
+    }
+    size_t count = 0, cap = 0;
+    size_t prefix = strlen(base_name);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strncmp(name, base_name, prefix) != 0 || name[prefix] != '.' || name[prefix + 1] < '0' || name[prefix + 1] > '9') {
+            continue;
+        }
+        char *end;
+        unsigned long seq = strtoul(name + prefix + 1, &end, 10);
+        if (*end != '\0') {
+            continue; // p. ej. el fichero temporal de una compactación interrumpida
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            *seqs = realloc(*seqs, cap * sizeof(unsigned long));
+        }
+        (*seqs)[count++] = seq;
+    }
+    closedir(dir);
+    qsort(*seqs, count, sizeof(unsigned long), compare_seq);
+    return count;
+}
+
+// Función para proyectar un fichero completo en memoria de solo lectura (NULL si no existe o está vacío)
+static const char *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    *size = st.st_size;
+    return data;
+}
+
+// Función para comprobar que un bloque de longitud len contiene count cadenas terminadas en nulo
+// con las longitudes indicadas
+static int strings_valid(const char *data, size_t len, const uint16_t *lengths, int count) {
+    size_t offset = 0;
+    for (int i = 0; i < count; i++) {
+        offset += lengths[i];
+        if (offset >= len || data[offset] != '\0') {
+            return 0;
+        }
+        offset++;
+    }
+    return 1;
+}
+
+// Función para recorrer los registros de un segmento.
+// En la primera pasada se cuentan y se recogen los tombstones; en la segunda se entregan los mensajes
+// vivos y los cambios de estado.
+static void scan_segment(const char *path, int pass, IdSet *dead, wal_load_fn on_load, wal_state_fn on_state) {
+    size_t size;
+    const char *data = map_file(path, &size);
+    if (!data) {
+        return;
+    }
+    time_t now = time(NULL);
+    size_t offset = 0;
+
+    while (offset + sizeof(LogRecord) <= size) {
+        const LogRecord *record = (const LogRecord *)(data + offset);
+        uint16_t lengths[3] = { record->topic_len, record->user_len, record->message_len };
+        if (record->length < sizeof(LogRecord) || record->length > size - offset || (record->length & 7) ||
+            checksum(data + offset + 8, record->length - 8) != record->checksum ||
+            (record->type != '-' && record->type != LOG_RESERVE &&
+             !strings_valid(record->data, record->length - sizeof(LogRecord), lengths, 3))) {
+            break; // registro cortado por una caída: lo que sigue no es fiable
+        }
+        offset += record->length;
+
+        if (pass == 1) {
+            log_records++;
+            if (record->id > last_id) {
+                last_id = record->id;
+            }
+            if (record->type == '-') {
+                id_set_add(dead, record->id); // las reservas solo cuentan para el mayor id
+            }
+        } else if (record->type == '+' && record->expiry > now && !id_set_contains(dead, record->id)) {
+            const char *user = record->data + record->topic_len + 1;
+            WalRecord loaded = { record->id, record->expiry, record->data, user, user + record->user_len + 1 };
+            on_load(&loaded);
+        } else if (record->type != '+' && record->type != '-' && record->type != LOG_RESERVE) {
+            WalState state = { record->type, record->data, record->data + record->topic_len + 1 };
+            on_state(&state);
+        }
+    }
+    munmap((void *)data, size);
+}
+
+// Función para validar la cabecera y el directorio del almacén
+static const StoreHeader *check_store(const char *data, size_t size) {
+    const StoreHeader *header = (const StoreHeader *)data;
+    if (size < sizeof(StoreHeader) || memcmp(header->magic, STORE_MAGIC, sizeof(header->magic)) != 0) {
+        printf("El almacén de mensajes no tiene un formato válido.\n");
+        return NULL;
+    }
+    if (header->version < 1 || header->version > STORE_VERSION) {
+        printf("Versión del almacén de mensajes no soportada (%u).\n", header->version);
+        return NULL;
+    }
+    if (checksum(header, offsetof(StoreHeader, header_checksum)) != header->header_checksum ||
+        header->file_size != size || header->directory_length > size - sizeof(StoreHeader) ||
+        checksum(data + sizeof(StoreHeader), header->directory_length) != header->directory_checksum) {
+        printf("El almacén de mensajes está dañado.\n");
+        return NULL;
+    }
+    return header;
+}
+
+// Función para entregar los mensajes vivos y el estado de los tópicos del almacén recorriendo su
+// directorio de tópicos
+static void load_store(const char *data, size_t size, const StoreHeader *header, const IdSet *dead,
+                       wal_load_fn on_load, wal_state_fn on_state) {
+    time_t now = time(NULL);
+    const char *directory = data + sizeof(StoreHeader);
+    size_t entry_offset = 0;
+
+    for (uint32_t t = 0; t < header->topic_count; t++) {
+        const StoreTopic *topic = (const StoreTopic *)(directory + entry_offset);
+        if (entry_offset + sizeof(StoreTopic) > header->directory_length ||
+            entry_offset + ALIGN8(sizeof(StoreTopic) + topic->name_len + 1) > header->directory_length ||
+            topic->name[topic->name_len] != '\0') {
+            printf("El directorio del almacén de mensajes está dañado.\n");
+            return;
+        }
+        entry_offset += ALIGN8(sizeof(StoreTopic) + topic->name_len + 1);
+
+        if (topic->offset > size || topic->length > size - topic->offset ||
+            checksum(data + topic->offset, topic->length) != topic->checksum) {
+            printf("Almacén de mensajes dañado: se descartan los mensajes del tópico '%s'.\n", topic->name);
+            continue;
+        }
+
+        // Los registros del tópico son contiguos: se recorren directamente sobre la proyección
+        size_t offset = 0;
+        uint32_t i;
+        for (i = 0; i < topic->count && offset + sizeof(StoreRecord) <= topic->length; i++) {
+            const StoreRecord *record = (const StoreRecord *)(data + topic->offset + offset);
+            uint16_t lengths[2] = { record->user_len, record->message_len };
+            if (record->length < sizeof(StoreRecord) || record->length > topic->length - offset ||
+                !strings_valid(record->data, record->length - sizeof(StoreRecord), lengths, 2)) {
+                break;
+            }
+            offset += record->length;
+            if (record->expiry > now && !id_set_contains(dead, record->id)) {
+                WalRecord loaded = { record->id, record->expiry, topic->name, record->data,
+                                     record->data + record->user_len + 1 };
+                on_load(&loaded);
+            }
+        }
+        if (header->version < 2 || i < topic->count) {
+            continue; // sin estado (versión 1) o con los registros dañados: no se sabe dónde empieza
+        }
+
+        // Estado del tópico: el bloqueo y, tras los registros, los nombres de los suscriptores
+        if (topic->flags & STORE_TOPIC_LOCKED) {
+            WalState state = { WAL_LOCK, topic->name, "" };
+            on_state(&state);
+        }
+        const char *names = data + topic->offset + offset;
+        size_t left = topic->length - offset;
+        for (uint32_t s = 0; s < topic->subscriber_count; s++) {
+            size_t len = strnlen(names, left);
+            if (len == left) {
+                break;
+            }
+            WalState state = { WAL_SUBSCRIBE, topic->name, names };
+            on_state(&state);
+            names += len + 1;
+            left -= len + 1;
+        }
+    }
+}
+
+// Función para importar el fichero de texto.
+// En la primera pasada se recogen los tombstones; en la segunda se entregan los mensajes vivos.
+static void import_text(const char *path, int pass, IdSet *dead, wal_load_fn on_load) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return;
+    }
+    imported = 1;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    time_t now = time(NULL);
+
+    while ((line_len = getline(&line, &line_cap, file)) != -1) {
+        if (line_len > 0 && line[line_len - 1] == '\n') {
+            line[--line_len] = '\0';
+        }
+
+        unsigned long long id;
+        long long expiry;
+        int lifetime;
+        char topic[256], user[257];
+        int offset = 0;
+
+        if (line[0] == '-' && line[1] == ' ') {
+            // Tombstone: el mensaje venció
+            if (pass == 1 && sscanf(line + 2, "%llu", &id) == 1) {
+                id_set_add(dead, id);
+            }
+        } else if (line[0] == '+' && line[1] == ' ') {
+            // Mensaje con id y vencimiento absoluto
+            if (sscanf(line + 2, "%llu %lld %255s %256s %n", &id, &expiry, topic, user, &offset) < 4 || offset == 0) {
+                continue;
+            }
+            if (id > last_id) {
+                last_id = id;
+            }
+            if (pass == 2 && !id_set_contains(dead, id) && expiry > now) {
+                WalRecord record = { id, (time_t)expiry, topic, user, line + 2 + offset };
+                on_load(&record);
+            }
+        } else if (pass == 2 && sscanf(line, "%255s %256s %d %n", topic, user, &lifetime, &offset) == 3 &&
+                   offset > 0 && lifetime > 0) {
+            // Formato original: <tópico> <usuario> <lifetime> <mensaje>
+            WalRecord record = { 0, now + lifetime, topic, user, line + offset };
+            on_load(&record);
+        }
+    }
+    free(line);
+    fclose(file);
+}
+
+// Función para abrir un segmento nuevo como segmento activo
+static int open_segment(unsigned long seq) {
+    char path[600];
+    segment_path(path, sizeof(path), seq);
+    segment_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0600);
+    if (segment_fd == -1) {
+        perror("Error al abrir el segmento del registro");
+        return -1;
+    }
+    sync_dir();
+    segment_seq = seq;
+    segment_records = 0;
+    return 0;
+}
+
+uint64_t wal_open(const char *store_path, const char *import_path, wal_load_fn on_load, wal_state_fn on_state) {
+    snprintf(base_path, sizeof(base_path), "%s", store_path);
+    const char *slash = strrchr(base_path, '/');
+    if (slash) {
+        snprintf(dir_path, sizeof(dir_path), "%.*s", (int)(slash - base_path), base_path);
+        base_name = slash + 1;
+    } else {
+        snprintf(dir_path, sizeof(dir_path), ".");
+        base_name = base_path;
+    }
+    crc_init();
+
+    const char *ratio_env = getenv("MSG_COMPACT_RATIO");
+    if (ratio_env) {
+        compact_ratio = atoi(ratio_env);
+    }
+    const char *checkpoint_env = getenv("MSG_CHECKPOINT_INTERVAL");
+    if (checkpoint_env) {
+        checkpoint_interval = atoi(checkpoint_env);
+    }
+    last_checkpoint = time(NULL);
+
+    event_fd = eventfd(0, EFD_NONBLOCK);
+
+    // Una compactación interrumpida puede dejar el temporal: se descarta
+    char tmp_path[600];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", base_path);
+    unlink(tmp_path);
+
+    // Proyectar y validar el almacén
+    size_t store_size = 0;
+    const char *store_data = map_file(base_path, &store_size);
+    const StoreHeader *header = store_data ? check_store(store_data, store_size) : NULL;
+    if (store_data && !header) {
+        // Se aparta para no sobrescribirlo en la siguiente compactación
+        char corrupt_path[600];
+        snprintf(corrupt_path, sizeof(corrupt_path), "%s.corrupt", base_path);
+        rename(base_path, corrupt_path);
+        printf("Se ha movido el almacén dañado a '%s'.\n", corrupt_path);
+        munmap((void *)store_data, store_size);
+        store_data = NULL;
+    }
+    unsigned long covered_seq = header ? header->sealed_seq : 0;
+    if (header) {
+        last_id = header->max_id;
+        store_records = header->record_count;
+    }
+
+    // Los segmentos que ya recoge el almacén quedaron de una compactación interrumpida
+    unsigned long *seqs;
+    size_t seg_count = list_segments(&seqs);
+    size_t first = 0;
+    while (first < seg_count && seqs[first] <= covered_seq) {
+        char seg[600];
+        segment_path(seg, sizeof(seg), seqs[first++]);
+        unlink(seg);
+    }
+
+    // Primero los tombstones de los segmentos, después los mensajes vivos del almacén y de los segmentos
+    IdSet dead = { 0 };
+    for (size_t i = first; i < seg_count; i++) {
+        char seg[600];
+        segment_path(seg, sizeof(seg), seqs[i]);
+        scan_segment(seg, 1, &dead, on_load, on_state);
+    }
+    if (header) {
+        load_store(store_data, store_size, header, &dead, on_load, on_state);
+        munmap((void *)store_data, store_size);
+    } else if (import_path) {
+        // Sin almacén: importar el fichero de texto
+        for (int pass = 1; pass <= 2; pass++) {
+            import_text(import_path, pass, &dead, on_load);
+        }
+    }
+    for (size_t i = first; i < seg_count; i++) {
+        char seg[600];
+        segment_path(seg, sizeof(seg), seqs[i]);
+        scan_segment(seg, 2, &dead, on_load, on_state);
+    }
+    free(dead.slots);
+
+    // Los registros de esta ejecución van a un segmento nuevo
+    unsigned long last_seq = seg_count > 0 && seqs[seg_count - 1] > covered_seq ? seqs[seg_count - 1] : covered_seq;
+    open_segment(last_seq + 1);
+    free(seqs);
+    return last_id;
+}
+
+// Función para añadir al buffer un registro con tópico, usuario y mensaje (con wal_lock tomado)
+static void append_record(uint8_t type, uint64_t id, int64_t expiry, const char *topic, const char *user, const char *message) {
+    uint16_t topic_len = strlen(topic), user_len = strlen(user), message_len = strlen(message);
+    size_t length = ALIGN8(sizeof(LogRecord) + topic_len + user_len + message_len + 3);
+    LogRecord *log = (LogRecord *)buffer_reserve(&pending, length);
+    log->length = length;
+    log->type = type;
+    log->topic_len = topic_len;
+    log->user_len = user_len;
+    log->message_len = message_len;
+    log->id = id;
+    log->expiry = expiry;
+    memcpy(log->data, topic, topic_len);
+    memcpy(log->data + topic_len + 1, user, user_len);
+    memcpy(log->data + topic_len + user_len + 2, message, message_len);
+    log->checksum = checksum((char *)log + 8, length - 8);
+    log_records++;
+    records_since_rotation++;
+}
+
+unsigned long wal_append_message(const WalRecord *record) {
+    metrics_lock(&wal_lock);
+    append_record('+', record->id, record->expiry, record->topic, record->user, record->message);
+    if (record->id > last_id) {
+        last_id = record->id;
+    }
+    unsigned long seq = segment_seq;
+    pthread_mutex_unlock(&wal_lock);
+    return seq;
+}
+
+// Función para añadir al buffer un registro sin tópico, usuario ni mensaje (con wal_lock tomado)
+static void append_marker(uint8_t type, uint64_t id) {
+    LogRecord *log = (LogRecord *)buffer_reserve(&pending, sizeof(LogRecord));
+    log->length = sizeof(LogRecord);
+    log->type = type;
+    log->id = id;
+    log->checksum = checksum((char *)log + 8, sizeof(LogRecord) - 8);
+    log_records++;
+    records_since_rotation++;
+}
+
+void wal_append_tombstone(uint64_t id) {
+    metrics_lock(&wal_lock);
+    append_marker('-', id);
+    pthread_mutex_unlock(&wal_lock);
+}
+
+void wal_append_state(const WalState *state) {
+    metrics_lock(&wal_lock);
+    append_record(state->type, 0, 0, state->topic, state->user, "");
+    pthread_mutex_unlock(&wal_lock);
+}
+
+void wal_reserve_ids(uint64_t max_id) {
+    // No puede ser un tombstone: el id reservado se asignará después a un mensaje que se persiste
+    metrics_lock(&wal_lock);
+    append_marker(LOG_RESERVE, max_id);
+    if (max_id > last_id) {
+        last_id = max_id;
+    }
+    pthread_mutex_unlock(&wal_lock);
+}
+
+size_t wal_pending() {
+    metrics_lock(&wal_lock);
+    size_t len = pending.len;
+    pthread_mutex_unlock(&wal_lock);
+    return len;
+}
+
+// Función para escribir y sincronizar los registros pendientes en el segmento activo (con commit_lock
+// tomado). Los registros se sacan de pending con wal_lock y se escriben sin él, de modo que los que
+// llegan mientras tanto esperan al siguiente commit sin bloquear a quien los añade
+static int commit_pending() {
+    metrics_lock(&wal_lock);
+    Buffer swap = writing;
+    writing = pending;
+    pending = swap;
+    pending.len = 0;
+    pthread_mutex_unlock(&wal_lock);
+    if (writing.len == 0) {
+        return 0;
+    }
+    uint64_t start = metrics_now();
+    int failed = segment_fd == -1 || write_all(segment_fd, writing.data, writing.len) == -1 || fdatasync(segment_fd) == -1;
+    writing.len = 0;
+    if (failed) {
+        perror("Error al escribir el registro de mensajes");
+        return -1;
+    }
+    metrics_observe(HIST_WAL_COMMIT, metrics_now() - start);
+    segment_records++;
+    return 0;
+}
+
+int wal_commit() {
+    metrics_lock(&commit_lock);
+    int status = commit_pending();
+    pthread_mutex_unlock(&commit_lock);
+    return status;
+}
+
+int wal_should_compact(size_t live_records) {
+    metrics_lock(&wal_lock);
+    size_t total_records = store_records + log_records;
+    // Se compacta cuando sobran muchos registros muertos o cuando los segmentos superan
+    // al almacén, para que el arranque recorra sobre todo el almacén. Además, cada checkpoint_interval
+    // segundos se vuelca al almacén lo que tengan los segmentos, de modo que tras reiniciar quede
+    // poco que reproducir
+    int should = !compacting &&
+                 ((total_records >= WAL_COMPACT_MIN_RECORDS &&
+                   ((total_records - live_records) * 100 >= total_records * (size_t)compact_ratio ||
+                    (log_records >= WAL_COMPACT_MIN_RECORDS && log_records >= store_records))) ||
+                  (checkpoint_interval > 0 && log_records > 0 && time(NULL) - last_checkpoint >= checkpoint_interval));
+    pthread_mutex_unlock(&wal_lock);
+    return should;
+}
+
+int wal_needs_rewrite() {
+    return imported;
+}
+
+int wal_snapshot_begin() {
+    metrics_lock(&commit_lock);
+    metrics_lock(&wal_lock);
+    if (compacting) {
+        pthread_mutex_unlock(&wal_lock);
+        pthread_mutex_unlock(&commit_lock);
+        return 0;
+    }
+    compacting = 1;
+    for (size_t i = 0; i < snapshot_topic_count; i++) {
+        free(snapshot_topics[i].name);
+        free(snapshot_topics[i].records.data);
+        free(snapshot_topics[i].subscribers.data);
+    }
+    snapshot_topic_count = 0;
+    if (snapshot_slots) {
+        memset(snapshot_slots, 0, snapshot_slot_cap * sizeof(size_t));
+    }
+    snapshot_records = 0;
+    pthread_mutex_unlock(&wal_lock);
+
+    // Cerrar el segmento activo: la instantánea cubre todo lo registrado hasta aquí, y lo que se
+    // registre a partir de ahora va al segmento nuevo, que se conserva
+    commit_pending();
+    metrics_lock(&wal_lock);
+    close(segment_fd);
+    sealed_seq = segment_seq;
+    snapshot_max_id = last_id;
+    open_segment(segment_seq + 1);
+    records_since_rotation = 0;
+    last_checkpoint = time(NULL);
+    pthread_mutex_unlock(&wal_lock);
+    pthread_mutex_unlock(&commit_lock);
+    return 1;
+}
+
+// Función hash (FNV-1a) de los nombres de tópico de la instantánea
+static size_t hash_topic(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+// Función para obtener el grupo de la instantánea de un tópico, creándolo si no existe
+static SnapshotTopic *snapshot_topic(const char *name) {
+    if ((snapshot_topic_count + 1) * 2 > snapshot_slot_cap) {
+        free(snapshot_slots);
+        snapshot_slot_cap = snapshot_slot_cap ? snapshot_slot_cap * 2 : 64;
+        snapshot_slots = calloc(snapshot_slot_cap, sizeof(size_t));
+        for (size_t i = 0; i < snapshot_topic_count; i++) {
+            size_t pos = hash_topic(snapshot_topics[i].name) & (snapshot_slot_cap - 1);
+            while (snapshot_slots[pos] != 0) {
+                pos = (pos + 1) & (snapshot_slot_cap - 1);
+            }
+            snapshot_slots[pos] = i + 1;
+        }
+    }
+
+    size_t pos = hash_topic(name) & (snapshot_slot_cap - 1);
+    while (snapshot_slots[pos] != 0) {
+        SnapshotTopic *topic = &snapshot_topics[snapshot_slots[pos] - 1];
+        if (strcmp(topic->name, name) == 0) {
+            return topic;
+        }
+        pos = (pos + 1) & (snapshot_slot_cap - 1);
+    }
+
+    if (snapshot_topic_count == snapshot_topic_cap) {
+        snapshot_topic_cap = snapshot_topic_cap ? snapshot_topic_cap * 2 : 16;
+        snapshot_topics = realloc(snapshot_topics, snapshot_topic_cap * sizeof(SnapshotTopic));
+    }
+    SnapshotTopic *topic = &snapshot_topics[snapshot_topic_count++];
+    topic->name = strdup(name);
+    topic->records = (Buffer){ 0 };
+    topic->count = 0;
+    topic->flags = 0;
+    topic->subscribers = (Buffer){ 0 };
+    topic->subscriber_count = 0;
+    snapshot_slots[pos] = snapshot_topic_count;
+    return topic;
+}
+
+void wal_snapshot_add(const WalRecord *record) {
+    metrics_lock(&wal_lock);
+    if (record->segment > sealed_seq) {
+        pthread_mutex_unlock(&wal_lock);
+        return; // se registró después de cerrar el segmento: ya está en uno que se conserva
+    }
+    SnapshotTopic *topic = snapshot_topic(record->topic);
+    uint16_t user_len = strlen(record->user), message_len = strlen(record->message);
+    size_t length = ALIGN8(sizeof(StoreRecord) + user_len + message_len + 2);
+    StoreRecord *stored = (StoreRecord *)buffer_reserve(&topic->records, length);
+    stored->length = length;
+    stored->user_len = user_len;
+    stored->message_len = message_len;
+    stored->id = record->id;
+    stored->expiry = record->expiry;
+    memcpy(stored->data, record->user, user_len);
+    memcpy(stored->data + user_len + 1, record->message, message_len);
+    topic->count++;
+    snapshot_records++;
+    pthread_mutex_unlock(&wal_lock);
+}
+
+void wal_snapshot_add_state(const WalState *state) {
+    // El estado no depende del segmento: uno posterior que repita el cambio lo aplica de nuevo sin efecto
+    metrics_lock(&wal_lock);
+    SnapshotTopic *topic = snapshot_topic(state->topic);
+    if (state->type == WAL_LOCK) {
+        topic->flags |= STORE_TOPIC_LOCKED;
+    } else if (state->type == WAL_SUBSCRIBE) {
+        size_t len = strlen(state->user);
+        memcpy(buffer_reserve(&topic->subscribers, len + 1), state->user, len);
+        topic->subscriber_count++;
+    }
+    pthread_mutex_unlock(&wal_lock);
+}
+
+// Función para escribir la instantánea como nuevo almacén y borrar los segmentos que cubre
+static void *write_snapshot(void *arg) {
+    // Los nombres de los suscriptores siguen a los registros de su tópico (rellenos hasta múltiplo
+    // de 8 para que los registros del tópico siguiente sigan alineados)
+    for (size_t i = 0; i < snapshot_topic_count; i++) {
+        SnapshotTopic *snap = &snapshot_topics[i];
+        if (snap->subscribers.len > 0) {
+            memcpy(buffer_reserve(&snap->records, ALIGN8(snap->subscribers.len)), snap->subscribers.data, snap->subscribers.len);
+        }
+    }
+
+    // Directorio de tópicos: cada entrada apunta a los registros contiguos de su tópico
+    Buffer directory = { 0 };
+    size_t directory_length = 0;
+    for (size_t i = 0; i < snapshot_topic_count; i++) {
+        directory_length += ALIGN8(sizeof(StoreTopic) + strlen(snapshot_topics[i].name) + 1);
+    }
+    uint64_t offset = sizeof(StoreHeader) + directory_length;
+    for (size_t i = 0; i < snapshot_topic_count; i++) {
+        SnapshotTopic *snap = &snapshot_topics[i];
+        size_t name_len = strlen(snap->name);
+        StoreTopic *entry = (StoreTopic *)buffer_reserve(&directory, ALIGN8(sizeof(StoreTopic) + name_len + 1));
+        entry->offset = offset;
+        entry->length = snap->records.len;
+        entry->count = snap->count;
+        entry->checksum = checksum(snap->records.data ? snap->records.data : "", snap->records.len);
+        entry->name_len = name_len;
+        entry->flags = snap->flags;
+        entry->subscriber_count = snap->subscriber_count;
+        memcpy(entry->name, snap->name, name_len);
+        offset += snap->records.len;
+    }
+
+    StoreHeader header = { 0 };
+    memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+    header.version = STORE_VERSION;
+    header.topic_count = snapshot_topic_count;
+    header.record_count = snapshot_records;
+    header.max_id = snapshot_max_id;
+    header.sealed_seq = sealed_seq;
+    header.directory_length = directory_length;
+    header.file_size = offset;
+    header.directory_checksum = checksum(directory.data ? directory.data : "", directory.len);
+    header.header_checksum = checksum(&header, offsetof(StoreHeader, header_checksum));
+
+    char tmp_path[600];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", base_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int failed = fd == -1 || write_all(fd, (const char *)&header, sizeof(header)) == -1 ||
+                 write_all(fd, directory.data ? directory.data : "", directory.len) == -1;
+    for (size_t i = 0; i < snapshot_topic_count && !failed; i++) {
+        failed = write_all(fd, snapshot_topics[i].records.data ? snapshot_topics[i].records.data : "",
+                           snapshot_topics[i].records.len) == -1;
+    }
+    free(directory.data);
+
+    if (failed || fsync(fd) == -1) {
+        perror("Error al escribir la compactación del registro");
+        if (fd != -1) {
+            close(fd);
+        }
+        unlink(tmp_path);
+    } else {
+        close(fd);
+        // El renombrado es atómico: tras una caída queda el almacén antiguo o el nuevo, nunca medio
+        rename(tmp_path, base_path);
+        sync_dir();
+
+        unsigned long *seqs;
+        size_t seg_count = list_segments(&seqs);
+        for (size_t i = 0; i < seg_count; i++) {
+            if (seqs[i] <= sealed_seq) {
+                char seg[600];
+                segment_path(seg, sizeof(seg), seqs[i]);
+                unlink(seg);
+            }
+        }
+        free(seqs);
+        sync_dir();
+    }
+
+    if (arg) {
+        uint64_t one = 1;
+        write(event_fd, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+void wal_snapshot_end(int background) {
+    if (background && pthread_create(&compact_thread, NULL, write_snapshot, (void *)1) == 0) {
+        compact_running = 1;
+        return;
+    }
+    write_snapshot(NULL);
+    metrics_lock(&wal_lock);
+    store_records = snapshot_records;
+    log_records = records_since_rotation;
+    imported = 0;
+    compacting = 0;
+    pthread_mutex_unlock(&wal_lock);
+}
+
+int wal_event_fd() {
+    return event_fd;
+}
+
+void wal_compaction_done() {
+    uint64_t value;
+    read(event_fd, &value, sizeof(value));
+    if (!compact_running) {
+        return;
+    }
+    pthread_join(compact_thread, NULL);
+    compact_running = 0;
+    metrics_lock(&wal_lock);
+    store_records = snapshot_records;
+    log_records = records_since_rotation;
+    imported = 0;
+    compacting = 0;
+    pthread_mutex_unlock(&wal_lock);
+}
+
+void wal_close() {
+    wal_commit();
+    if (compact_running) {
+        pthread_join(compact_thread, NULL);
+        compact_running = 0;
+    }
+    if (segment_fd != -1) {
+        close(segment_fd);
+        segment_fd = -1;
+        // Un segmento sin registros no aporta nada
+        if (segment_records == 0) {
+            char path[600];
+            segment_path(path, sizeof(path), segment_seq);
+            unlink(path);
+        }
+    }
+}
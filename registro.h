@@ -0,0 +1,114 @@
+#ifndef REGISTRO_H
+#define REGISTRO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Almacén binario y registro de escritura anticipada de los mensajes persistentes y del estado
+// de los tópicos (suscripciones y bloqueos).
+//
+// El almacén (p. ej. mensajes.db) guarda el último compactado en formato binario versionado:
+// una cabecera con el número de registros, un directorio de tópicos con el desplazamiento,
+// la longitud y el checksum de los registros de cada uno, si está bloqueado y cuántos usuarios
+// tiene suscritos, y los registros agrupados por tópico seguidos de los nombres de esos usuarios.
+// Al arrancar se proyecta con mmap, se valida y se recorre sin analizar texto.
+//
+// Los segmentos <almacén>.<n> contienen los registros añadidos después del compactado:
+//   + mensaje retenido (id, vencimiento absoluto, tópico, usuario y contenido)
+//   - mensaje vencido (tombstone con el id)
+//   R reserva de ids (el último reservado; solo cuenta para el mayor id visto al cargar)
+//   S/U suscripción o baja de un usuario en un tópico o patrón
+//   L/O bloqueo o desbloqueo de un tópico
+// Cada registro lleva su longitud y su checksum, de modo que un registro cortado por una
+// caída se detecta y se descarta.
+//
+// Si no existe el almacén se importa el fichero de texto (formato "<tópico> <usuario>
+// <lifetime> <mensaje>" o "+ <id> <vencimiento> <tópico> <usuario> <mensaje>").
+
+#define STORE_VERSION 2 // versión del formato del almacén (la 1, sin suscripciones ni bloqueos, se sigue leyendo)
+#define WAL_COMPACT_MIN_RECORDS 1024 // no se compacta por debajo de este número de registros
+#define WAL_CHECKPOINT_INTERVAL 300 // segundos entre compactados periódicos si no se define MSG_CHECKPOINT_INTERVAL
+
+// Cambios del estado de los tópicos que se guardan en el registro
+enum {
+    WAL_SUBSCRIBE = 'S', // un usuario se suscribe a un tópico o patrón
+    WAL_UNSUBSCRIBE = 'U', // un usuario se da de baja
+    WAL_LOCK = 'L', // el manager bloquea un tópico
+    WAL_UNLOCK = 'O' // el manager desbloquea un tópico
+};
+
+// Mensaje tal y como se guarda en el registro
+typedef struct {
+    uint64_t id; // Identificador único del mensaje (0 = asignarlo al cargar)
+    time_t expiry; // Instante de vencimiento
+    const char *topic; // Nombre del tópico
+    const char *user; // Nombre del usuario que lo envió
+    const char *message; // Contenido del mensaje
+    unsigned long segment; // Segmento en el que se registró (0 = antes de esta ejecución)
+} WalRecord;
+
+// Cambio del estado de un tópico tal y como se guarda en el registro
+typedef struct {
+    int type; // WAL_SUBSCRIBE, WAL_UNSUBSCRIBE, WAL_LOCK o WAL_UNLOCK
+    const char *topic; // Nombre del tópico o patrón
+    const char *user; // Usuario que se suscribe o se da de baja ("" en los bloqueos)
+} WalState;
+
+// Función que recibe cada mensaje vivo al cargar el registro
+typedef void (*wal_load_fn)(const WalRecord *record);
+
+// Función que recibe cada cambio de estado al cargar el registro. Los del almacén y los de los
+// segmentos pueden repetir el mismo cambio: aplicarlos dos veces no debe tener efecto
+typedef void (*wal_state_fn)(const WalState *state);
+
+// Carga el almacén y los segmentos (o importa import_path si no hay almacén), entregando
+// el estado de los tópicos y los mensajes vivos en el orden en que se registraron, y abre un
+// segmento nuevo para esta ejecución. Devuelve el mayor id visto.
+uint64_t wal_open(const char *store_path, const char *import_path, wal_load_fn on_load, wal_state_fn on_state);
+
+// Añaden registros al buffer del segmento activo (se escriben en el siguiente wal_commit);
+// wal_append_message devuelve el número del segmento, que se indica al añadirlo a una instantánea
+unsigned long wal_append_message(const WalRecord *record);
+void wal_append_tombstone(uint64_t id);
+void wal_append_state(const WalState *state);
+
+// Reserva los ids hasta max_id aunque no se guarden mensajes con ellos (p. ej. los de los mensajes
+// no persistentes), de modo que al volver a abrir el registro no se asignen de nuevo
+void wal_reserve_ids(uint64_t max_id);
+
+// Bytes pendientes de escribir
+size_t wal_pending();
+
+// Escribe los registros pendientes y los sincroniza con un único fdatasync (commit en grupo).
+// Todas las funciones se pueden llamar desde varios hilos; los registros que se añaden durante
+// un commit esperan al siguiente
+int wal_commit();
+
+// Indica si conviene compactar dada la cantidad de mensajes vivos (o porque han pasado
+// MSG_CHECKPOINT_INTERVAL segundos desde el último compactado y los segmentos tienen registros)
+int wal_should_compact(size_t live_records);
+
+// Indica si al cargar se importó el fichero de texto (hay que escribir el almacén)
+int wal_needs_rewrite();
+
+// Compactación: wal_snapshot_begin cierra el segmento activo (0 si ya hay una en curso), se añaden
+// los mensajes vivos a la instantánea (se descartan los registrados en un segmento posterior, que
+// se conserva) y el estado de los tópicos (WAL_LOCK por cada tópico bloqueado y WAL_SUBSCRIBE por
+// cada suscripción) y wal_snapshot_end la escribe como nuevo almacén (en segundo plano si
+// background != 0) y borra los segmentos que cubre
+int wal_snapshot_begin();
+void wal_snapshot_add(const WalRecord *record);
+void wal_snapshot_add_state(const WalState *state);
+void wal_snapshot_end(int background);
+
+// Descriptor que se activa cuando termina una compactación en segundo plano
+int wal_event_fd();
+
+// Recoge el resultado de una compactación en segundo plano terminada
+void wal_compaction_done();
+
+// Escribe lo pendiente, espera a la compactación en curso y cierra el segmento activo
+void wal_close();
+
+#endif
@@ -1,790 +1,2791 @@
 #include "util.h"
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include "memoria.h"
+#include "registro.h"
+#include "entrega.h"
+#include "consola.h"
+#include "protocolo.h"
+#include "metricas.h"
+#include "cola.h"
+
+#define MAX_OUT_BUF (64 * 1024) // marca alta por defecto de la cola de salida de cada cliente si no se define OUTBOX_HIGH_KB
+#define MAX_EVENTS 64 // número máximo de eventos atendidos en cada epoll_wait
+#define DEFAULT_MEM_BUDGET_MB 64 // presupuesto de memoria por defecto si no se define MEM_BUDGET_MB
+#define MAX_PERSISTENT_PER_TOPIC 5 // número máximo de mensajes persistentes en cada tópico
+#define WHEEL_SLOTS 512 // ranuras de la rueda de tiempos (un tick de un segundo por ranura)
+#define DEFAULT_STORE_FILE "mensajes.db" // almacén binario por defecto si no se define MSG_STORE
+#define DEFAULT_SYNC_MS 5 // ventana del commit en grupo por defecto si no se define MSG_SYNC_MS
+#define DEFAULT_METRICS_INTERVAL 10 // segundos entre volcados de métricas si no se define METRICS_INTERVAL
+#define MESSAGE_ID_BLOCK 4096 // números de mensaje que se reservan de una vez en el registro
+#define REPLAY_HIGH_WATER (outbox_limits.high_water / 2) // bytes de la cola de salida que puede ocupar el reenvío de mensajes retenidos
+#define REPLAY_LOW_WATER (outbox_limits.high_water / 4) // bytes de la cola de salida por debajo de los que el reenvío continúa
+#define DEFAULT_TOPIC_SHARDS 1 // particiones de los tópicos por defecto si no se define TOPIC_SHARDS
+#define MAX_TOPIC_SHARDS 64 // número máximo de particiones de los tópicos
+#define SHARD_BATCH 64 // tareas que atiende una partición cada vez que toma el cerrojo de las sesiones
+#define SHARD_QUEUE_LEN 1024 // tareas que caben en la cola de cada partición
+#define SHARD_LOCAL __thread // estado propio de una partición: cada hilo tiene su copia
+#define REJECT_KILL_DELAY_MS 1000 // tiempo que tiene un proceso cuyo inicio de sesión se rechaza para leer la respuesta antes de terminarlo
+#define PROCESS_EVENT_BASE (1ULL << 32) // dato de epoll del fin del proceso de un cliente: PROCESS_EVENT_BASE * (handle + 1) + pidfd
 
 // Struct de almacenamiento de usuarios
 typedef struct {
     char client_pipe[256]; // Descriptor de archivo del pipe para comunicación con el cliente
-    char username[USERNAME_LEN]; // Nombre de usuario del cliente
+    int user; // Id del nombre de usuario del cliente (posición en users)
     pid_t pid; // PID del proceso del cliente
+    int pidfd; // Descriptor que se activa cuando termina el proceso del cliente (-1 si no se pudo obtener)
+    Outbox *outbox; // Cola de salida hacia la pipe del cliente, vaciada por un hilo de entrega
+    RingRegion *ring; // Anillos de memoria compartida de la sesión (NULL si solo usa las pipes)
+    int in_use; // Indicador de si la posición está ocupada por un cliente conectado
+    int leaving; // Indicador de si el cliente está saliendo (sus particiones aún cancelan sus reenvíos)
+    int shared_process; // Su proceso aloja otras sesiones: se cierra por la pipe, sin enviarle señales
+    int next_free; // Siguiente posición libre de la tabla de clientes (si in_use == 0)
 } Client;
 
-// Struct de comunicación con el cliente
+// Struct de nombres de usuario registrados (los ids se mantienen durante toda la ejecución)
+typedef struct {
+    char name[USERNAME_LEN]; // Nombre de usuario
+    int client; // Handle del cliente conectado con este nombre (-1 si no está conectado)
+} User;
+
+// Struct de una solicitud de un cliente ya decodificada
 typedef struct {
     char client_pipe[256]; // Descriptor de archivo del pipe para comunicación con el cliente
     int command_type; // Tipo de comando
-    char topic[50];  // Campo para almacenar el nombre del tópico
+    uint32_t seq; // Número de secuencia de la solicitud (se repite en la respuesta)
+    char topic[MAX_TOPIC_FIELD + 1];  // Campo para almacenar el nombre del tópico
     char username[50]; // Nombre de usuario del cliente
     pid_t pid; // PID del proceso del cliente
     int lifetime; // Lifetime restante
+    uint64_t cursor; // Primer número de mensaje retenido que se pide al suscribirse
+    int has_cursor; // Indicador de si la suscripción trae cursor
+    int login_flags; // Inicio de sesión: indicadores LOGIN_*
     char message[TAM_MSG]; // Mensaje que se envía
+    const char *batch; // Lote: mensajes codificados (apuntan a la trama recibida)
+    size_t batch_len; // Lote: bytes de los mensajes codificados
 } Response;
 
 // Struct para la gestión de topicos
 typedef struct {
-    char name[TOPIC_NAME_LEN]; // Nombre del tópico
-    char subscribers[MAX_SUBSCRIBERS][USERNAME_LEN]; // Matriz para almacenar los nombres de usuarios suscritos a un tópico
+    char name[TOPIC_NAME_LEN]; // Nombre del tópico (o patrón de suscripción con comodines)
+    int is_pattern; // Indicador de si el nombre tiene comodines: solo guarda suscripciones
+    int node; // Nodo del árbol de tópicos en el que termina el nombre
+    int *subscribers; // Ids de los usuarios suscritos al tópico
     int subscriber_count; // Número de suscriptores al tópico.
+    int subscriber_cap; // Capacidad reservada de subscribers
     int is_locked; // Indicador de si el tópico está bloqueado.
-    int has_active_messages;  // Indicador de si el tópico tiene mensajes activos
+    int live_messages;  // Número de mensajes retenidos (persistentes y sin vencer) del tópico
+    struct StoredMessage *first_message, *last_message; // Lista de los mensajes retenidos del tópico en orden de llegada
+    int in_use; // Indicador de si la posición está ocupada por un tópico
+    int next_free; // Siguiente posición libre de la tabla de tópicos (si in_use == 0)
 } Topic;
 
-// Struct para el almacenamiento de mensajes en el archivo
-typedef struct {
-    char topic[TOPIC_NAME_LEN]; // Nombre del tópico al que pertenece el mensaje
-    char username[USERNAME_LEN]; // Nombre del usuario que envió el mensaje
-    char message[TAM_MSG];  // El contenido del mensaje
-    int lifetime; // Lifetime restante
-    Response msg;
+// Struct compacto de un mensaje retenido: cabecera con ids internados y contenido de longitud variable
+typedef struct StoredMessage {
+    struct StoredMessage *prev, *next; // Lista de mensajes retenidos del tópico en orden de llegada
+    struct StoredMessage *wheel_prev, *wheel_next; // Lista de la ranura de la rueda de tiempos
+    uint64_t id; // Número del mensaje (crece con cada publicación; también lo identifica en el registro)
+    uint32_t due_tick; // Tick absoluto en el que vence el mensaje
+    uint32_t segment; // Segmento del registro en el que se guardó (0 = cargado al arrancar)
+    int topic; // Id del tópico al que pertenece el mensaje
+    int user; // Id del usuario que envió el mensaje
+    SharedFrame *frame; // Notificación ya codificada que se reenvía a los nuevos suscriptores (NULL si aún no se creó)
+    unsigned short length; // Longitud del contenido sin el carácter nulo
+    char message[];  // El contenido del mensaje, terminado en carácter nulo
 } StoredMessage;
 
-// Declaración de los hilos
-pthread_t lifetime_thread;
-pthread_t command_thread;
+// Índice hash de nombres: asocia cada nombre con el id estable de su posición en la tabla
+typedef struct {
+    int *slots; // id + 1 de cada posición (0 = libre, -1 = borrada)
+    size_t cap; // número de posiciones (potencia de 2)
+    size_t used; // posiciones ocupadas o borradas
+    const char *(*name_of)(int id); // devuelve el nombre asociado a un id
+} NameIndex;
+
+// Nodo del árbol de tópicos: un nivel de los nombres separados por '/'. Los nombres de los
+// tópicos y los patrones de suscripción ('+' = un nivel cualquiera, '#' = el resto de niveles)
+// terminan en un nodo; una publicación solo recorre las ramas que coinciden con su nombre
+typedef struct {
+    char path[TOPIC_NAME_LEN + 1]; // Niveles desde la raíz, cada uno precedido de '/' (clave del índice de nodos)
+    int parent; // Nodo padre (-1 en la raíz)
+    int first_child; // Primer hijo (-1 si no tiene)
+    int prev_sibling, next_sibling; // Hermanos en la lista de hijos del padre
+    int topic; // Tópico o patrón que termina en este nodo (-1 si ninguno)
+    int in_use; // Indicador de si la posición está ocupada por un nodo
+    int next_free; // Siguiente posición libre de la tabla de nodos (si in_use == 0)
+} TrieNode;
+
+// Reenvío en curso de los mensajes retenidos a un suscriptor: avanza por tramos a medida que
+// su cola de salida se vacía, en orden de número de mensaje
+typedef struct {
+    int client; // Handle del cliente que se suscribió
+    int topic; // Tópico o patrón de la suscripción
+    uint64_t next_id; // Primer número de mensaje que falta por reenviar
+    uint64_t last_id; // Último número publicado al suscribirse (los siguientes se entregan en directo)
+} Replay;
+
+// Operaciones repartidas entre todas las particiones (scatter/gather)
+enum {
+    GATHER_TOPICS, // lista de tópicos pedida por un cliente
+    GATHER_VIEW_TOPICS, // vista de tópicos pedida por la consola
+    GATHER_BATCH, // lote con mensajes de varias particiones
+    GATHER_LEAVE, // salida de un cliente
+    GATHER_EXPORT, // exportación de los mensajes retenidos
+    GATHER_SNAPSHOT, // compactación del registro
+    GATHER_NUMBER // numeración de los mensajes importados al arrancar
+};
+
+// Tópico recogido de una partición para listarlo
+typedef struct {
+    char name[TOPIC_NAME_LEN];
+    int subscribers;
+} GatherTopic;
+
+// Operación repartida: cada partición añade su parte y la última en terminar la entrega al hilo
+// de entrada, que la completa (responde al cliente o a la consola, quita al cliente...)
+typedef struct Gather {
+    int kind; // GATHER_*
+    _Atomic int remaining; // Partes que faltan por terminar
+    pthread_mutex_t lock; // Protege lo que añaden las partes
+    int user; // Usuario que hizo la solicitud (-1 si la hizo la consola)
+    uint32_t seq; // Número de secuencia de la solicitud
+    int client; // GATHER_LEAVE: handle del cliente que sale
+    int notify; // GATHER_LEAVE: indicador de si se avisa a los demás clientes
+    int background; // GATHER_SNAPSHOT: indicador de si el almacén se escribe en segundo plano
+    int accepted, rejected, status; // GATHER_BATCH: resultado de las partes del lote
+    int count; // GATHER_EXPORT: mensajes exportados
+    FILE *file; // GATHER_EXPORT: fichero de destino
+    GatherTopic *topics; // Tópicos recogidos
+    int topic_count;
+    int topic_cap;
+    int waited; // Indicador de si el hilo de entrada espera en el momento a que termine
+    int done; // Indicador de si ya se completó
+    struct Gather *next; // Lista de operaciones terminadas
+} Gather;
+
+// Tareas que el hilo de entrada envía a las particiones
+enum {
+    TASK_REQUEST, // solicitud de un cliente sobre un tópico de la partición
+    TASK_TOPICS, // añadir los tópicos de la partición a una lista
+    TASK_LOAD, // mensaje cargado del registro al arrancar
+    TASK_RESTORE, // suscripción o bloqueo cargado del registro al arrancar
+    TASK_NUMBER, // numerar los mensajes importados
+    TASK_EXPIRE, // ticks del temporizador de vencimientos
+    TASK_RESUME, // alguna cola de salida vigilada se ha vaciado
+    TASK_LEAVE, // un cliente sale: cancelar sus reenvíos
+    TASK_LOCK, // bloquear un tópico
+    TASK_UNLOCK, // desbloquear un tópico
+    TASK_VIEW, // vista de los mensajes de un tópico para la consola
+    TASK_EXPORT, // exportar los mensajes retenidos
+    TASK_SNAPSHOT, // añadir los mensajes retenidos a la instantánea del registro
+    TASK_STOP // sincronizar lo pendiente y terminar
+};
+
+// Tarea de una partición
+typedef struct {
+    int kind; // TASK_*
+    int user; // Id del usuario de la solicitud, del mensaje cargado o de la suscripción cargada
+    int quiet; // Indicador de si no se responde al cliente (patrón replicado: responde su partición)
+    uint64_t value; // TASK_LOAD: número del mensaje; TASK_EXPIRE: ticks; TASK_LEAVE: handle del cliente
+    Gather *gather; // Operación repartida a la que pertenece (NULL si ninguna)
+    Response request; // Solicitud o mensaje (el lote apunta a una copia propia de la tarea)
+} ShardTask;
+
+// Partición de los tópicos: un hilo con su cola de tareas
+typedef struct {
+    pthread_t thread;
+    TaskQueue *queue;
+} Shard;
 
-Topic topics[MAX_TOPICS]; // Almacena los topicos creados
-Client clients[MAX_USERS]; // Almacena los usuarios conectados
-StoredMessage messages[MAX_MESSAGES]; // Almacena los mensajes de los topicos
-int topic_count = 0;
+// Confirmación de un mensaje persistente (o de un lote con alguno) que espera al commit en grupo
+typedef struct {
+    int user; // Id del usuario que envió el mensaje
+    uint32_t seq; // Número de secuencia de su solicitud
+    int is_batch; // Indicador de si se confirma un lote
+    int accepted, rejected; // Mensajes aceptados y rechazados del lote
+    Gather *gather; // Lote repartido al que se suma el resultado (NULL si se confirma aquí)
+} PendingAck;
+
+// Terminación diferida del proceso de un inicio de sesión rechazado
+typedef struct {
+    pid_t pid; // PID del proceso
+    struct timespec due; // Instante (CLOCK_MONOTONIC) a partir del que se termina
+} PendingKill;
+
+// Las tablas crecen bajo demanda; su tamaño solo está limitado por el presupuesto de memoria.
+// Cada partición tiene sus propios tópicos, mensajes, reenvíos y confirmaciones (SHARD_LOCAL) y
+// solo los usa su hilo; clientes y usuarios los modifica el hilo de entrada con session_lock
+// tomado para escribir y las particiones los leen con él tomado para leer
+SHARD_LOCAL Topic *topics = NULL; // Almacena los topicos creados
+Client *clients = NULL; // Almacena los usuarios conectados
+User *users = NULL; // Almacena los nombres de usuario registrados
+SHARD_LOCAL StoredMessage *wheel[WHEEL_SLOTS]; // Rueda de tiempos: mensajes que vencen en cada ranura
+SHARD_LOCAL uint32_t current_tick = 0; // Ticks de un segundo transcurridos desde el arranque
+SHARD_LOCAL int topic_count = 0;
+SHARD_LOCAL int topic_slots = 0; // posiciones de topics usadas alguna vez
+SHARD_LOCAL int topic_cap = 0;
+SHARD_LOCAL int topic_free = -1; // primera posición libre de topics
 int client_count = 0;
-int message_count = 0;
-pthread_mutex_t mutex; // Declaración del mutex
+int client_slots = 0; // posiciones de clients usadas alguna vez
+int client_cap = 0;
+int client_free = -1; // primera posición libre de clients
+int user_count = 0;
+int user_cap = 0;
+_Atomic int message_count = 0; // Mensajes retenidos en todas las particiones
+SHARD_LOCAL TrieNode *trie_nodes = NULL; // Nodos del árbol de tópicos (la raíz es el nodo 0)
+SHARD_LOCAL int trie_slots = 0; // posiciones de trie_nodes usadas alguna vez
+SHARD_LOCAL int trie_cap = 0;
+SHARD_LOCAL int trie_free = -1; // primera posición libre de trie_nodes
+SHARD_LOCAL uint32_t match_generation = 0; // Contador de publicaciones para no entregar dos veces al mismo usuario
+SHARD_LOCAL uint32_t *user_marks = NULL; // Última publicación entregada a cada usuario (evita duplicados entre patrones)
+SHARD_LOCAL int user_mark_cap = 0;
+SHARD_LOCAL int *matched_topics = NULL; // Tópicos y patrones que coinciden con la publicación o suscripción en curso
+SHARD_LOCAL int matched_count = 0;
+SHARD_LOCAL int matched_cap = 0;
+_Atomic uint64_t next_message_id = 0; // Último número asignado a un mensaje publicado
+_Atomic uint64_t reserved_message_id = 0; // Último número reservado en el registro (no se reutiliza al reiniciar)
+pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER; // Serializa la reserva de bloques de números de mensaje
+SHARD_LOCAL Replay *replays = NULL; // Reenvíos de mensajes retenidos en curso
+SHARD_LOCAL int replay_count = 0;
+SHARD_LOCAL int replay_cap = 0;
+SHARD_LOCAL StoredMessage **replay_batch = NULL; // Mensajes que faltan por reenviar en el tramo en curso
+SHARD_LOCAL int replay_batch_cap = 0;
+SHARD_LOCAL PendingAck *pending_acks = NULL; // Usuarios que esperan la confirmación de un mensaje aún no sincronizado
+SHARD_LOCAL int pending_ack_count = 0;
+SHARD_LOCAL int pending_ack_cap = 0;
+SHARD_LOCAL int sync_fd = -1; // Temporizador de la ventana del commit en grupo
+SHARD_LOCAL int sync_armed = 0; // Indicador de si la ventana del commit en grupo está abierta
+long sync_window_ms = DEFAULT_SYNC_MS; // Duración de la ventana del commit en grupo (0 = al final de cada lote)
+OutboxLimits outbox_limits = { MAX_OUT_BUF, MAX_OUT_BUF / 2, OVERFLOW_DROP_NEWEST }; // Límites de las colas de salida de los clientes
+int epoll_fd = -1; // Descriptor del bucle de eventos del servidor
+SHARD_LOCAL int reply_client = -1; // Handle del cliente cuya solicitud se está procesando (-1 si ninguna)
+SHARD_LOCAL uint32_t reply_seq = 0; // Número de secuencia de esa solicitud
+SHARD_LOCAL int quiet_replies = 0; // Indicador de si no se responde a esa solicitud (la responde otra partición)
+Shard shards[MAX_TOPIC_SHARDS]; // Particiones de los tópicos
+int shard_count = 0;
+SHARD_LOCAL int shard_index = -1; // Partición del hilo actual (-1 en el hilo de entrada)
+pthread_rwlock_t session_lock; // Protege clients y users (ver arriba)
+Gather *_Atomic finished_gathers = NULL; // Operaciones repartidas terminadas que completa el hilo de entrada (pila sin cerrojos)
+int gather_fd = -1; // Se activa cuando hay operaciones terminadas
+PendingKill *pending_kills = NULL; // Procesos de inicios de sesión rechazados que esperan a terminarse (en orden de vencimiento)
+int pending_kill_head = 0; // primera terminación pendiente (las anteriores ya se atendieron)
+int pending_kill_count = 0; // posiciones de pending_kills usadas
+int pending_kill_cap = 0;
+int kill_timer_fd = -1; // Temporizador de la primera terminación pendiente
+Response *parked_logins = NULL; // Inicios de sesión que esperan a que termine de salir la sesión anterior de su usuario
+int parked_login_count = 0;
+int parked_login_cap = 0;
+
+// Flag para la terminación del servidor
+int terminate_server = 0;
+
+// Funciones que devuelven el nombre asociado a un id para los índices hash
+const char *topic_name_of(int id) { return topics[id].name; }
+const char *user_name_of(int id) { return users[id].name; }
+const char *trie_path_of(int id) { return trie_nodes[id].path; }
+
+SHARD_LOCAL NameIndex topic_index = { .name_of = topic_name_of }; // nombre de tópico -> id del tópico
+NameIndex user_index = { .name_of = user_name_of }; // nombre de usuario -> id del usuario
+SHARD_LOCAL NameIndex trie_index = { .name_of = trie_path_of }; // ruta de un nodo -> id del nodo
+
+// Función hash FNV-1a para los nombres
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Función para obtener la partición que posee un tópico (o la principal de un patrón, que se replica en todas)
+int shard_of(const char *topic_name) {
+    return hash_name(topic_name) % shard_count;
+}
 
-// Flag para la terminación de hilos
-int terminate_thread = 0;
+// Función para buscar el id asociado a un nombre en un índice (-1 si no está)
+int name_index_find(const NameIndex *index, const char *name) {
+    if (index->cap == 0) {
+        return -1;
+    }
+    size_t mask = index->cap - 1;
+    for (size_t pos = hash_name(name) & mask; index->slots[pos] != 0; pos = (pos + 1) & mask) {
+        int id = index->slots[pos] - 1;
+        if (id >= 0 && strcmp(index->name_of(id), name) == 0) {
+            return id;
+        }
+    }
+    return -1;
+}
 
-// Función para enviar un mensaje a un cliente
-void send_response(const char *client_pipe, const char *message) {
-    int fd = open(client_pipe, O_WRONLY);
-    if (fd != -1) {
-        write(fd, message, strlen(message) + 1); // +1 para incluir el carácter nulo
-        close(fd);
-    } else {
-        perror("Error al abrir la pipe del cliente");
+// Función para añadir un id a un índice sin comprobar capacidad
+static void name_index_place(NameIndex *index, int id) {
+    size_t mask = index->cap - 1;
+    size_t pos = hash_name(index->name_of(id)) & mask;
+    while (index->slots[pos] > 0) {
+        pos = (pos + 1) & mask;
+    }
+    if (index->slots[pos] == 0) {
+        index->used++;
     }
+    index->slots[pos] = id + 1;
 }
 
-// Función para eliminar todos los usuarios conectados y cerrar el manager (close y CTRL+C del manager)
-void close_all_connections() {
-    // Cerrar todas las conexiones de clientes
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].pid > 0) {
-            kill(clients[i].pid, SIGTERM); // Enviar SIGTERM al cliente
-            printf("Se envió SIGTERM a %s (PID: %d)\n", clients[i].username, clients[i].pid);
+// Función para añadir un id a un índice (el nombre se obtiene con name_of), duplicando la tabla si hace falta
+void name_index_insert(NameIndex *index, int id) {
+    if ((index->used + 1) * 4 > index->cap * 3) {
+        // Reconstruir con el doble de capacidad, descartando las posiciones borradas
+        int *old_slots = index->slots;
+        size_t old_cap = index->cap;
+        index->cap = old_cap ? old_cap * 2 : 64;
+        index->slots = calloc(index->cap, sizeof(int));
+        if (!index->slots) {
+            perror("Error al reservar el índice de nombres");
+            exit(EXIT_FAILURE);
+        }
+        index->used = 0;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old_slots[i] > 0) {
+                name_index_place(index, old_slots[i] - 1);
+            }
         }
+        free(old_slots);
     }
+    name_index_place(index, id);
+}
 
-    // Enviar SIGUSR1 a los hilos
-    pthread_kill(lifetime_thread, SIGUSR1);  // Solicitar a lifetime_thread que se cierre
-    pthread_kill(command_thread, SIGUSR1);   // Solicitar a command_thread que se cierre
+// Función para quitar un nombre de un índice
+void name_index_remove(NameIndex *index, const char *name) {
+    if (index->cap == 0) {
+        return;
+    }
+    size_t mask = index->cap - 1;
+    for (size_t pos = hash_name(name) & mask; index->slots[pos] != 0; pos = (pos + 1) & mask) {
+        int id = index->slots[pos] - 1;
+        if (id >= 0 && strcmp(index->name_of(id), name) == 0) {
+            index->slots[pos] = -1; // marca de borrado para no cortar las cadenas de sondeo
+            return;
+        }
+    }
+}
 
-    // Esperar a que los hilos terminen correctamente
-    pthread_join(lifetime_thread, NULL);
-    printf("Lifetime thread finalizado.\n");
+// Función para duplicar la capacidad de una tabla contabilizando la memoria en el presupuesto
+int grow_table(void **table, int *cap, size_t elem_size) {
+    int new_cap = *cap ? *cap * 2 : 16;
+    char *new_table = mem_realloc(*table, *cap * elem_size, new_cap * elem_size);
+    if (!new_table) {
+        return 0;
+    }
+    memset(new_table + *cap * elem_size, 0, (new_cap - *cap) * elem_size);
+    *table = new_table;
+    *cap = new_cap;
+    return 1;
+}
 
-    pthread_join(command_thread, NULL);
-    printf("Command thread finalizado.\n");
+// Función para obtener el id de un nombre de usuario, registrándolo si es la primera vez que aparece
+int intern_user(const char *username) {
+    int user = name_index_find(&user_index, username);
+    if (user != -1) {
+        return user;
+    }
+    if (user_count == user_cap && !grow_table((void **)&users, &user_cap, sizeof(User))) {
+        return -1;
+    }
+    user = user_count++;
+    strncpy(users[user].name, username, USERNAME_LEN - 1);
+    users[user].name[USERNAME_LEN - 1] = '\0';
+    users[user].client = -1;
+    name_index_insert(&user_index, user);
+    return user;
 }
 
+// Función para clasificar un nombre de tópico: 0 si es un tópico, 1 si es un patrón de suscripción
+// ('+' o '#' ocupando un nivel completo) y -1 si no es válido ('#' que no es el último nivel)
+int topic_pattern_kind(const char *name) {
+    int kind = 0;
+    for (const char *level = name; level; ) {
+        const char *slash = strchr(level, '/');
+        size_t len = slash ? (size_t)(slash - level) : strlen(level);
+        if (len == 1 && (level[0] == '+' || level[0] == '#')) {
+            if (level[0] == '#' && slash) {
+                return -1;
+            }
+            kind = 1;
+        }
+        level = slash ? slash + 1 : NULL;
+    }
+    return kind;
+}
 
-// Función para manejar la señal SIGINT (CTRL+C) del programa
-void handle_sigint(int sig) {
-    printf("\nServidor finalizado. Limpiando recursos...\n");
-    close_all_connections();
-    unlink(SERVER_PIPE);
-    exit(0); 
+// Función para escribir la ruta del hijo de un nodo con el nivel dado en path (de TOPIC_NAME_LEN + 1 bytes; 0 si no cabe)
+int child_path(int node, const char *level, size_t len, char *path) {
+    size_t prefix = strlen(trie_nodes[node].path);
+    if (prefix + 1 + len > TOPIC_NAME_LEN) {
+        return 0;
+    }
+    memcpy(path, trie_nodes[node].path, prefix);
+    path[prefix] = '/';
+    memcpy(path + prefix + 1, level, len);
+    path[prefix + 1 + len] = '\0';
+    return 1;
 }
 
+// Función para buscar el hijo de un nodo del árbol con el nivel dado (-1 si no existe)
+int trie_child(int node, const char *level, size_t len) {
+    char path[TOPIC_NAME_LEN + 1];
+    return child_path(node, level, len, path) ? name_index_find(&trie_index, path) : -1;
+}
 
-// Función para añadir un usuario a la lista de usuarios conectados
-void add_client(const char *client_pipe, const char *username, pid_t pid) {
-    // Verificar si el cliente ya está conectado
-    for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, username) == 0) {
-            printf("El cliente %s ya está conectado (PID: %d)\n", username, clients[i].pid);
-            return; // No agregar el cliente nuevamente
+// Función para reservar un nodo del árbol con la ruta dada (-1 si no queda memoria)
+int trie_alloc(const char *path, int parent) {
+    int node;
+    if (trie_free != -1) {
+        node = trie_free;
+        trie_free = trie_nodes[node].next_free;
+    } else {
+        if (trie_slots == trie_cap && !grow_table((void **)&trie_nodes, &trie_cap, sizeof(TrieNode))) {
+            return -1;
         }
+        node = trie_slots++;
     }
-
-    // Si no está, añadir el cliente
-    if (client_count < MAX_USERS) {
-        strncpy(clients[client_count].client_pipe, client_pipe, sizeof(clients[client_count].client_pipe) - 1);
-        strncpy(clients[client_count].username, username, USERNAME_LEN);
-        clients[client_count].pid = pid;
-        client_count++;
-        printf("Cliente agregado: %s (PID: %d)\n", username, pid);
-    } else {
-        printf("No se puede agregar el cliente %s. Límite máximo de usuarios alcanzado.\n", username);
+    TrieNode *n = &trie_nodes[node];
+    snprintf(n->path, sizeof(n->path), "%s", path);
+    n->parent = parent;
+    n->first_child = -1;
+    n->prev_sibling = -1;
+    n->next_sibling = -1;
+    n->topic = -1;
+    n->in_use = 1;
+    if (parent != -1) {
+        // Enlazar como primer hijo del padre
+        n->next_sibling = trie_nodes[parent].first_child;
+        if (n->next_sibling != -1) {
+            trie_nodes[n->next_sibling].prev_sibling = node;
+        }
+        trie_nodes[parent].first_child = node;
     }
+    name_index_insert(&trie_index, node);
+    return node;
 }
 
-// Función para suscribir un usuario a un topico y recibir los mensajes de ese topico
-void subscribe_topic(const char *topic_name, const char *client_pipe, const char *username) {
-    if (strlen(topic_name) >= TOPIC_NAME_LEN) {
-        send_response(client_pipe, "Error: El nombre del tópico excede el máximo de caracteres.");
-        return;
+// Función para quitar del árbol los nodos que ya no llevan a ningún tópico ni patrón (la raíz se conserva)
+void trie_prune(int node) {
+    while (node > 0 && trie_nodes[node].topic == -1 && trie_nodes[node].first_child == -1) {
+        TrieNode *n = &trie_nodes[node];
+        int parent = n->parent;
+        if (n->prev_sibling != -1) {
+            trie_nodes[n->prev_sibling].next_sibling = n->next_sibling;
+        } else {
+            trie_nodes[parent].first_child = n->next_sibling;
+        }
+        if (n->next_sibling != -1) {
+            trie_nodes[n->next_sibling].prev_sibling = n->prev_sibling;
+        }
+        name_index_remove(&trie_index, n->path);
+        n->in_use = 0;
+        n->next_free = trie_free;
+        trie_free = node;
+        node = parent;
     }
+}
 
-    // Comprobar si se ha alcanzado el límite de tópicos
-    if (topic_count >= MAX_TOPICS) {
-        send_response(client_pipe, "Error: máximo de tópicos alcanzado.");
-        return;
+// Función para obtener el nodo en el que termina un nombre, creando los niveles que falten (-1 si no queda memoria)
+int trie_insert(const char *name) {
+    if (trie_slots == 0 && trie_alloc("", -1) == -1) {
+        return -1;
     }
-
-    // Buscar si el tópico ya existe
-    int topic_index = -1;
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            topic_index = i;
-            break;
+    int node = 0;
+    for (const char *level = name; level; ) {
+        const char *slash = strchr(level, '/');
+        size_t len = slash ? (size_t)(slash - level) : strlen(level);
+        char path[TOPIC_NAME_LEN + 1];
+        if (!child_path(node, level, len, path)) {
+            trie_prune(node);
+            return -1;
         }
+        int child = name_index_find(&trie_index, path);
+        if (child == -1) {
+            child = trie_alloc(path, node);
+            if (child == -1) {
+                trie_prune(node);
+                return -1;
+            }
+        }
+        node = child;
+        level = slash ? slash + 1 : NULL;
     }
+    return node;
+}
 
-    // Si no existe el topico, crear uno nuevo y agregar al primer suscriptor
-    if (topic_index == -1) {
-        strncpy(topics[topic_count].name, topic_name, TOPIC_NAME_LEN);
-        topics[topic_count].name[TOPIC_NAME_LEN - 1] = '\0';
-        topics[topic_count].subscriber_count = 0;
-
-        // Agregar el primer suscriptor (el usuario que se suscribe)
-        strncpy(topics[topic_count].subscribers[0], username, USERNAME_LEN);
-        topics[topic_count].subscriber_count++;
-
-        // Imprimir mensaje en el servidor
-        printf("El usuario '%s' ha creado y se ha suscrito al tópico '%s'.\n", username, topic_name);
+// Función para añadir un tópico o patrón a la lista de coincidencias en curso
+void add_match(int topic) {
+    if (matched_count < matched_cap || grow_table((void **)&matched_topics, &matched_cap, sizeof(int))) {
+        matched_topics[matched_count++] = topic;
+    }
+}
 
-        topic_count++;
+// Función para recoger los tópicos y patrones que cubren los niveles restantes (rest) de un nombre
+// publicado a partir de un nodo: el nivel exacto, '+' y '#' (que también cubre el nivel del padre)
+void match_publish(int node, const char *rest) {
+    int multi = trie_child(node, "#", 1);
+    if (multi != -1 && trie_nodes[multi].topic != -1) {
+        add_match(trie_nodes[multi].topic);
+    }
+    if (!rest) {
+        if (trie_nodes[node].topic != -1) {
+            add_match(trie_nodes[node].topic);
+        }
+        return;
+    }
+    const char *slash = strchr(rest, '/');
+    size_t len = slash ? (size_t)(slash - rest) : strlen(rest);
+    const char *next = slash ? slash + 1 : NULL;
+    int child = trie_child(node, rest, len);
+    if (child != -1) {
+        match_publish(child, next);
+    }
+    int single = trie_child(node, "+", 1);
+    if (single != -1) {
+        match_publish(single, next);
+    }
+}
 
-        // Enviar respuesta al cliente
-        send_response(client_pipe, "Tópico creado y suscrito.");
-
-    }
-    else{
-        // Buscar el tópico en la lista de tópicos
-        for (int i = 0; i < topic_count; i++) {
-            if (strcmp(topics[i].name, topic_name) == 0) {
-                // Verificar si el usuario ya está suscrito
-                for (int j = 0; j < topics[i].subscriber_count; j++) {
-                    if (strcmp(topics[i].subscribers[j], username) == 0) {
-                        send_response(client_pipe, "Ya estás suscrito al tópico.");
-                        return;
-                    }
-                }
+// Función para recoger los tópicos (no los patrones) de un subárbol completo
+void match_subtree(int node) {
+    int topic = trie_nodes[node].topic;
+    if (topic != -1 && !topics[topic].is_pattern) {
+        add_match(topic);
+    }
+    for (int child = trie_nodes[node].first_child; child != -1; child = trie_nodes[child].next_sibling) {
+        match_subtree(child);
+    }
+}
 
-                // Si el usuario no está suscrito, agregarlo
-                if (topics[i].subscriber_count < MAX_SUBSCRIBERS) {
-                    strncpy(topics[i].subscribers[topics[i].subscriber_count], username, USERNAME_LEN);
-                    topics[i].subscribers[topics[i].subscriber_count][USERNAME_LEN - 1] = '\0';
-                    topics[i].subscriber_count++;
-
-                    // Imprimir mensaje en el servidor
-                    printf("El usuario '%s' se ha suscrito al tópico '%s'.\n", username, topic_name);
-
-                    // Almacenar los mensajes en una lista (buffer)
-                    char all_messages[1024 * MAX_MESSAGES];  // Suponiendo un límite de mensajes
-                    for (int j = 0; j < message_count; j++) {
-                        if (strcmp(messages[j].topic, topic_name) == 0 && messages[j].lifetime > 0) {
-                            // Concatenar el mensaje al buffer
-                            char message_to_send[1024];
-                            snprintf(message_to_send, sizeof(message_to_send), "%s %s %s\n", messages[j].topic, messages[j].username, messages[j].message);
-                            strncat(all_messages, message_to_send, sizeof(all_messages) - strlen(all_messages) - 1);
-                        }
-                    }
+// Función para recoger los tópicos que cubren los niveles restantes (rest) de un patrón a partir de un nodo
+void match_pattern(int node, const char *rest) {
+    if (!rest) {
+        int topic = trie_nodes[node].topic;
+        if (topic != -1 && !topics[topic].is_pattern) {
+            add_match(topic);
+        }
+        return;
+    }
+    const char *slash = strchr(rest, '/');
+    size_t len = slash ? (size_t)(slash - rest) : strlen(rest);
+    const char *next = slash ? slash + 1 : NULL;
+    if (len == 1 && rest[0] == '#') {
+        match_subtree(node);
+    } else if (len == 1 && rest[0] == '+') {
+        for (int child = trie_nodes[node].first_child; child != -1; child = trie_nodes[child].next_sibling) {
+            match_pattern(child, next);
+        }
+    } else {
+        int child = trie_child(node, rest, len);
+        if (child != -1) {
+            match_pattern(child, next);
+        }
+    }
+}
 
-                    // Enviar todos los mensajes de una vez
-                    if (strlen(all_messages) > 0) {
-                        send_response(client_pipe, all_messages);
-                    }
+// Función para crear un tópico (o patrón) vacío y devolver su id (-1 si no queda memoria)
+int create_topic(const char *topic_name) {
+    int node = trie_insert(topic_name);
+    if (node == -1) {
+        return -1;
+    }
+    int topic;
+    if (topic_free != -1) {
+        // Reutilizar la posición de un tópico eliminado
+        topic = topic_free;
+        topic_free = topics[topic].next_free;
+    } else {
+        if (topic_slots == topic_cap && !grow_table((void **)&topics, &topic_cap, sizeof(Topic))) {
+            trie_prune(node);
+            return -1;
+        }
+        topic = topic_slots++;
+    }
+    strncpy(topics[topic].name, topic_name, TOPIC_NAME_LEN);
+    topics[topic].name[TOPIC_NAME_LEN - 1] = '\0';
+    topics[topic].is_pattern = topic_pattern_kind(topic_name) == 1;
+    topics[topic].node = node;
+    trie_nodes[node].topic = topic;
+    topics[topic].subscribers = NULL;
+    topics[topic].subscriber_count = 0; // Sin suscriptores iniciales
+    topics[topic].subscriber_cap = 0;
+    topics[topic].is_locked = 0;       // No bloqueado por defecto
+    topics[topic].live_messages = 0; // Sin mensajes activos inicialmente
+    topics[topic].first_message = NULL;
+    topics[topic].last_message = NULL;
+    topics[topic].in_use = 1;
+    name_index_insert(&topic_index, topic);
+    topic_count++;
+    return topic;
+}
 
-                    // Informar a los suscriptores actuales del tópico
-                    printf("Usuarios suscritos al tópico '%s':\n", topic_name);
-                    for (int j = 0; j < topics[i].subscriber_count; j++) {
-                        printf(" - %s\n", topics[i].subscribers[j]);
-                    }
+// Función para eliminar un tópico liberando su posición
+void delete_topic(int topic) {
+    name_index_remove(&topic_index, topics[topic].name);
+    trie_nodes[topics[topic].node].topic = -1;
+    trie_prune(topics[topic].node);
+    mem_free_table(topics[topic].subscribers, topics[topic].subscriber_cap * sizeof(int));
+    topics[topic].subscribers = NULL;
+    topics[topic].subscriber_cap = 0;
+    topics[topic].in_use = 0;
+    topics[topic].next_free = topic_free;
+    topic_free = topic;
+    topic_count--;
+}
 
-                    send_response(client_pipe, "Te has suscrito al tópico.");
-                } else {
-                    send_response(client_pipe, "Error: máximo de suscriptores alcanzado.");
-                }
-                return;
-            }
-        } 
+// Función para añadir un usuario a los suscriptores de un tópico (0 si no queda memoria)
+int add_subscriber(int topic, int user) {
+    Topic *t = &topics[topic];
+    if (t->subscriber_count == t->subscriber_cap &&
+        !grow_table((void **)&t->subscribers, &t->subscriber_cap, sizeof(int))) {
+        return 0;
     }
+    t->subscribers[t->subscriber_count++] = user;
+    return 1;
 }
 
-// Función para desuscribir un usuario de un topico
-void unsubscribe_topic(const char *topic_name, const char *client_pipe, const char *username) {
-    // Recorre todos los tópicos para encontrar el tópico al que el usuario desea desuscribirse
-    for (int i = 0; i < topic_count; i++) {
-        // Verifica si el nombre del tópico coincide con el tópico que el usuario quiere desuscribirse
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            
-            // Recorre los suscriptores del tópico
-            for (int j = 0; j < topics[i].subscriber_count; j++) {
-                
-                // Verifica si el usuario está suscrito a este tópico
-                if (strcmp(topics[i].subscribers[j], username) == 0) {
-                    
-                    // Si el usuario está suscrito, lo elimina de la lista de suscriptores del tópico
-                    // Empezamos desde el índice del suscriptor y recorre los suscriptores detrás de él
-                    for (int k = j; k < topics[i].subscriber_count - 1; k++) {
-                        // Desplaza los suscriptores restantes una posición hacia atrás para sobrescribir al usuario eliminado
-                        // Se copia el suscriptor siguiente en la posición donde estaba el suscriptor eliminado y hace lo mismo con los demás
-                        strncpy(topics[i].subscribers[k], topics[i].subscribers[k + 1], USERNAME_LEN);
-                    }
-                    
-                    // Disminuye el contador de suscriptores para reflejar la eliminación
-                    topics[i].subscriber_count--;
-                    
-                    // Envia una respuesta al cliente confirmando que se desuscribió correctamente
-                    send_response(client_pipe, "Te has desuscrito del tópico.");
-                    return;
-                }
-            }
+// Función para eliminar un tópico si ya no tiene mensajes retenidos ni suscriptores y no está bloqueado
+void maybe_delete_topic(int topic) {
+    if (topics[topic].in_use && topics[topic].live_messages == 0 && topics[topic].subscriber_count == 0 &&
+        !topics[topic].is_locked) {
+        delete_topic(topic);
+    }
+}
 
-            // Si el usuario no estaba suscrito al tópico, envía una respuesta al cliente
-            send_response(client_pipe, "No estás suscrito al tópico.");
-            return;
-        }
+// Función para guardar un mensaje retenido en un bloque compacto de la slab (NULL si no queda memoria)
+// y programar su vencimiento en la rueda de tiempos dentro de lifetime segundos
+StoredMessage *store_message(int topic, int user, int lifetime, const char *text) {
+    size_t length = strnlen(text, TAM_MSG - 1);
+    StoredMessage *msg = mem_alloc(sizeof(StoredMessage) + length + 1);
+    if (!msg) {
+        return NULL;
+    }
+    msg->topic = topic;
+    msg->user = user;
+    msg->frame = NULL;
+    msg->segment = 0;
+    msg->due_tick = current_tick + (lifetime > 0 ? lifetime : 1);
+    msg->length = length;
+    memcpy(msg->message, text, length);
+    msg->message[length] = '\0';
+
+    // Añadir al final de la lista de mensajes retenidos del tópico
+    Topic *owner = &topics[topic];
+    msg->next = NULL;
+    msg->prev = owner->last_message;
+    if (owner->last_message) {
+        owner->last_message->next = msg;
+    } else {
+        owner->first_message = msg;
+    }
+    owner->last_message = msg;
+
+    // Añadir a la ranura de la rueda en la que vence
+    StoredMessage **slot = &wheel[msg->due_tick % WHEEL_SLOTS];
+    msg->wheel_prev = NULL;
+    msg->wheel_next = *slot;
+    if (*slot) {
+        (*slot)->wheel_prev = msg;
     }
+    *slot = msg;
 
-    // Si no se encuentra el tópico en la lista, se envía una respuesta indicando que el tópico no existe
-    send_response(client_pipe, "El tópico no existe.");
+    topics[topic].live_messages++;
+    message_count++;
+    return msg;
 }
 
+// Función para quitar un mensaje de la lista y de la rueda y devolver su bloque a la slab
+void free_message(StoredMessage *msg) {
+    Topic *owner = &topics[msg->topic];
+    if (msg->prev) {
+        msg->prev->next = msg->next;
+    } else {
+        owner->first_message = msg->next;
+    }
+    if (msg->next) {
+        msg->next->prev = msg->prev;
+    } else {
+        owner->last_message = msg->prev;
+    }
 
-// Función para listar los topicos
-void list_topics(const char *client_pipe) {
-    char response[1024] = "Tópicos:\n";
-
-    if (topic_count == 0) {
-        // Concatenar "No hay tópicos para listar." a response
-        strcat(response, "No hay tópicos para listar.\n");
-        printf("No hay tópicos para listar.\n");
+    if (msg->wheel_prev) {
+        msg->wheel_prev->wheel_next = msg->wheel_next;
     } else {
-        // Construir la lista de tópicos
-        for (int i = 0; i < topic_count; i++) {
-            char topic_info[100];
-            snprintf(topic_info, sizeof(topic_info), "- %s (Suscriptores: %d)\n", topics[i].name, topics[i].subscriber_count);
-            strcat(response, topic_info);
-        }
-        printf("Se listaron %d tópicos.\n", topic_count);
+        wheel[msg->due_tick % WHEEL_SLOTS] = msg->wheel_next;
+    }
+    if (msg->wheel_next) {
+        msg->wheel_next->wheel_prev = msg->wheel_prev;
     }
 
-    // Enviar la respuesta completa usando response
-    send_response(client_pipe, response);
+    if (msg->frame) {
+        shared_frame_release(msg->frame);
+    }
+    topics[msg->topic].live_messages--;
+    message_count--;
+    mem_free(msg, sizeof(StoredMessage) + msg->length + 1);
 }
 
+// Función para obtener el nombre de usuario de un cliente conectado
+const char *client_name(const Client *client) {
+    return users[client->user].name;
+}
 
-// Función para verificar si un tópico existe
-int topic_exists(const char *topic_name) {  
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            return 1;
+// Función para cancelar los reenvíos en curso a un cliente (de una suscripción o, con topic -1, de todas)
+void cancel_replays(int client, int topic) {
+    for (int i = 0; i < replay_count; ) {
+        if (replays[i].client == client && (topic == -1 || replays[i].topic == topic)) {
+            replays[i] = replays[--replay_count];
+        } else {
+            i++;
         }
     }
-    return 0;
 }
 
-// Función para listar los usuarios conectados
-void list_connected_users() {
-    if (client_count == 0) {
-        printf("No hay usuarios conectados.\n");
-        return;
+// Función para entregar la cola de salida de un cliente a su hilo de entrega para cerrarla y dejar
+// de vigilar su proceso
+void release_client(Client *client) {
+    if (client->outbox) {
+        outbox_close(client->outbox);
+        client->outbox = NULL;
+    }
+    if (client->pidfd != -1) {
+        close(client->pidfd); // también lo quita del bucle de eventos
+        client->pidfd = -1;
     }
+    client->ring = NULL; // la proyección la deshace la cola de salida al liberarse
+}
 
-    for (int i = 0; i < client_count; i++) {
-        printf("- %s (Pipe: %s)\n", clients[i].username, clients[i].client_pipe);
+// Función para codificar un texto (REPLY_TEXT o REPLY_ERROR) en una trama compartida del tamaño justo
+// (NULL si no queda memoria)
+SharedFrame *encode_text(int type, uint32_t seq, const char *message) {
+    size_t len = strnlen(message, MAX_FRAME_PAYLOAD - sizeof(uint16_t));
+    SharedFrame *frame = shared_frame_alloc(FRAME_HEADER_LEN + sizeof(uint16_t) + len);
+    if (frame) {
+        FrameWriter writer;
+        frame_begin(&writer, frame->data, frame->cap, type, seq);
+        frame_put_string(&writer, message, len);
+        frame->len = frame_end(&writer);
     }
+    return frame;
 }
 
-// Función para enviar un mensaje a un topico
-void send_message(Response* request) {
-    // Verificar si el tópico existe
-    int topic_index = -1;
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, request->topic) == 0) {
-            topic_index = i;
-            break;
-        }
+// Función para codificar una sola vez la notificación de una publicación (número, tópico, usuario y
+// mensaje), que comparten las colas de todos sus destinatarios (NULL si no queda memoria)
+SharedFrame *encode_notification(uint64_t id, const char *topic_name, const char *username, const char *text) {
+    size_t topic_len = strlen(topic_name), user_len = strlen(username), text_len = strlen(text);
+    SharedFrame *frame = shared_frame_alloc(FRAME_HEADER_LEN + sizeof(uint64_t) + 3 * sizeof(uint16_t) +
+                                            topic_len + user_len + text_len);
+    if (frame) {
+        frame->droppable = 1; // la política de desbordamiento de cada cola decide si se descarta
+        FrameWriter writer;
+        frame_begin(&writer, frame->data, frame->cap, REPLY_MESSAGE, 0);
+        frame_put_u64(&writer, id);
+        frame_put_string(&writer, topic_name, topic_len);
+        frame_put_string(&writer, username, user_len);
+        frame_put_string(&writer, text, text_len);
+        frame->len = frame_end(&writer);
     }
+    return frame;
+}
 
-    // Si el tópico no existe, crearlo
-    if (topic_index == -1) {
-        if (topic_count < MAX_TOPICS) {
-            // Inicializar el nuevo tópico
-            strncpy(topics[topic_count].name, request->topic, TOPIC_NAME_LEN);
-            topics[topic_count].name[TOPIC_NAME_LEN - 1] = '\0';
-            topics[topic_count].subscriber_count = 0; // Sin suscriptores iniciales
-            topics[topic_count].is_locked = 0;       // No bloqueado por defecto
-            topics[topic_count].has_active_messages = 0; // Sin mensajes activos inicialmente
+// Función para encolar una trama a un cliente conectado; la escribe en su pipe un hilo de entrega
+// (si su cola ya no admite tramas, el cliente está siendo expulsado y se ignora)
+void push_frame(Client *client, SharedFrame *frame) {
+    if (!frame || !client->outbox || outbox_push_frame(client->outbox, frame) == 0) {
+        metrics_add(MET_OUTBOX_DROPPED, 1);
+        printf("Buffer de salida de %s lleno, se descarta un mensaje.\n", client_name(client));
+    }
+}
 
-            topic_index = topic_count;
-            topic_count++;
+// Función para encolar una trama de texto (REPLY_TEXT o REPLY_ERROR) a un cliente conectado
+void send_reply(Client *client, int type, uint32_t seq, const char *message) {
+    SharedFrame *frame = encode_text(type, seq, message);
+    push_frame(client, frame);
+    if (frame) {
+        shared_frame_release(frame);
+    }
+}
 
-            printf("Tópico '%s' creado automáticamente.\n", request->topic);
-        } else {
-            send_response(request->client_pipe, "Error: No se pueden crear más tópicos, límite alcanzado.");
-            return;
-        }
+// Función para enviar un mensaje a un cliente conectado (con la secuencia de su solicitud si es quien la envió)
+void send_to_client(Client *client, const char *message) {
+    if (quiet_replies) {
+        return;
     }
+    send_reply(client, REPLY_TEXT, client - clients == reply_client ? reply_seq : 0, message);
+}
 
-    // Verificar si el tópico está bloqueado
-    if (topics[topic_index].is_locked) {
-        send_response(request->client_pipe, "El tópico está bloqueado. No se puede enviar el mensaje.");
+// Función para responder a un cliente conectado que su solicitud se ha rechazado
+void send_error(Client *client, const char *message) {
+    if (quiet_replies) {
         return;
     }
+    send_reply(client, REPLY_ERROR, client - clients == reply_client ? reply_seq : 0, message);
+}
 
+// Función para confirmar un lote de mensajes a un cliente conectado
+void send_ack(Client *client, uint32_t seq, int accepted, int rejected, int status) {
+    char frame[FRAME_HEADER_LEN + 3 * sizeof(int32_t)];
+    FrameWriter writer;
+    frame_begin(&writer, frame, sizeof(frame), REPLY_ACK, seq);
+    frame_put_int(&writer, accepted);
+    frame_put_int(&writer, rejected);
+    frame_put_int(&writer, status);
+    if (!client->outbox || outbox_push(client->outbox, frame, frame_end(&writer)) == 0) {
+        metrics_add(MET_OUTBOX_DROPPED, 1);
+        printf("Buffer de salida de %s lleno, se descarta un mensaje.\n", client_name(client));
+    }
+}
 
-    // Si el mensaje es persistente, verificar el número de mensajes persistentes en el tópico
-    if (request->lifetime > 0) {
-        int persistent_message_count = 0;
+// Función para enviar una trama compartida a un usuario si está conectado
+void send_to_user(int user, SharedFrame *frame) {
+    if (users[user].client != -1) {
+        push_frame(&clients[users[user].client], frame);
+    }
+}
 
-        // Contar los mensajes persistentes en el tópico
-        for (int i = 0; i < message_count; i++) {
-            if (strcmp(messages[i].topic, request->topic) == 0 && messages[i].lifetime > 0) {
-                persistent_message_count++;
-            }
+// Función para enviar una trama compartida a los suscriptores de un tópico y de los patrones que lo
+// cubren, una sola vez a cada usuario y salvo a skip_user; devuelve a cuántos usuarios se envió
+int notify_matches(const char *topic_name, int skip_user, SharedFrame *frame) {
+    matched_count = 0;
+    if (trie_slots > 0) {
+        match_publish(0, topic_name);
+    }
+    // Las marcas de la partición se amplían a los usuarios registrados desde la última publicación
+    while (user_mark_cap < user_count) {
+        if (!grow_table((void **)&user_marks, &user_mark_cap, sizeof(uint32_t))) {
+            break; // sin memoria: los usuarios sin marca pueden recibir una publicación repetida
         }
-
-        // Verificar si se ha alcanzado el límite de 5 mensajes persistentes
-        if (persistent_message_count >= 5) {
-            send_response(request->client_pipe, "Error: Se ha alcanzado el límite de 5 mensajes persistentes en este tópico.");
-            return;
+    }
+    if (++match_generation == 0) {
+        // Al dar la vuelta el contador, ninguna marca antigua puede coincidir con la nueva
+        for (int u = 0; u < user_mark_cap; u++) {
+            user_marks[u] = 0;
         }
+        match_generation = 1;
     }
-
-    // Almacenar el mensaje
-    if (message_count < MAX_MESSAGES) {
-        // Guardar el mensaje en la estructura de mensajes
-        strncpy(messages[message_count].topic, request->topic, sizeof(messages[message_count].topic) - 1);
-        strncpy(messages[message_count].username, request->username, sizeof(messages[message_count].username) - 1);
-        strncpy(messages[message_count].message, request->message, sizeof(messages[message_count].message) - 1);
-        messages[message_count].lifetime = request->lifetime; // lifetime restante
-        message_count++;
-
-        // Marcar que el tópico ahora tiene mensajes activos
-        topics[topic_index].has_active_messages = 1;
-        // Enviar el mensaje a los suscriptores excepto al remitente
-        char formatted_message[1028]; // espacio para el formato
-        snprintf(formatted_message, sizeof(formatted_message), "%s %s %s",
-         request->topic, request->username, request->message);
-
-        // Enviar el mensaje a los suscriptores excepto al remitente
-        for (int i = 0; i < topics[topic_index].subscriber_count; i++) {
-            const char *subscriber_username = topics[topic_index].subscribers[i];
-            if (strcmp(subscriber_username, request->username) != 0) { // evitar al remitente
-                for (int j = 0; j < client_count; j++) {
-                    if (strcmp(clients[j].username, subscriber_username) == 0) {
-                        send_response(clients[j].client_pipe, formatted_message);
-                    }
-                }
+    int sent = 0;
+    for (int i = 0; i < matched_count; i++) {
+        Topic *topic = &topics[matched_topics[i]];
+        for (int j = 0; j < topic->subscriber_count; j++) {
+            int subscriber = topic->subscribers[j];
+            if (subscriber == skip_user || (subscriber < user_mark_cap && user_marks[subscriber] == match_generation)) {
+                continue;
             }
-        }
-
-        // Guardar el mensaje en el archivo si es persistente
-        if (request->lifetime > 0) {
-            const char* msg_file = getenv("MSG_FICH");
-            if (msg_file) {
-                FILE* file = fopen(msg_file, "a");
-                if (file) {
-                    fprintf(file, "%s %s %d %s\n",
-                            request->topic, request->username, request->lifetime, request->message);
-                    fclose(file);
-                } else {
-                    perror("Error al abrir el archivo de mensajes");
-                }
-            } else {
-                perror("Variable de entorno MSG_FICH no configurada");
+            if (subscriber < user_mark_cap) {
+                user_marks[subscriber] = match_generation;
             }
+            send_to_user(subscriber, frame);
+            sent++;
         }
+    }
+    return sent;
+}
 
-        // Imprimir el mensaje en la consola
-        printf("Mensaje de %s enviado al tópico %s\n", request->username, request->topic);
-
-        // Enviar una respuesta al cliente que envió el mensaje
-        send_response(request->client_pipe, "Mensaje enviado con éxito.");
+// Función para enviar el rechazo de una solicitud a un proceso que no tiene sesión (p. ej. un inicio de sesión rechazado)
+void send_response(const char *client_pipe, uint32_t seq, const char *message) {
+    int fd = open(client_pipe, O_WRONLY | O_NONBLOCK);
+    if (fd != -1) {
+        char frame[MAX_REQUEST_LEN];
+        FrameWriter writer;
+        frame_begin(&writer, frame, sizeof(frame), REPLY_ERROR, seq);
+        frame_put_string(&writer, message, sizeof(frame) - FRAME_HEADER_LEN - sizeof(uint16_t));
+        size_t len = frame_end(&writer);
+        if (write(fd, frame, len) != (ssize_t)len) { // cabe en PIPE_BUF: llega entera o no llega
+            metrics_add(MET_RESPONSE_FAILED, 1);
+        }
+        close(fd);
     } else {
-        send_response(request->client_pipe, "Error: máximo de mensajes alcanzado.");
+        metrics_add(MET_RESPONSE_FAILED, 1);
+        perror("Error al abrir la pipe del cliente");
+    }
+}
+
+// Función para eliminar todos los usuarios conectados y cerrar el manager (close y CTRL+C del manager)
+void close_all_connections() {
+    // Cerrar todas las conexiones de clientes
+    for (int i = 0; i < client_slots; i++) {
+        if (!clients[i].in_use) {
+            continue;
+        }
+        if (clients[i].pid > 0 && !clients[i].shared_process) {
+            kill(clients[i].pid, SIGTERM); // Enviar SIGTERM al cliente
+            printf("Se envió SIGTERM a %s (PID: %d)\n", client_name(&clients[i]), clients[i].pid);
+        }
+        release_client(&clients[i]);
+        users[clients[i].user].client = -1;
+        clients[i].in_use = 0;
+        clients[i].next_free = client_free;
+        client_free = i;
     }
+    client_count = 0;
 }
 
+// Función para quitar a un cliente de la lista de conectados liberando su posición
+void drop_client(int client) {
+    pthread_rwlock_wrlock(&session_lock);
+    release_client(&clients[client]);
+    users[clients[client].user].client = -1;
+    clients[client].in_use = 0;
+    clients[client].next_free = client_free;
+    client_free = client;
+    client_count--; // reducir el contador de clientes
+    pthread_rwlock_unlock(&session_lock);
+}
 
 
-// Función para cargar los mensajes cuyo lifetime sea mayor a 0 desde el archivo
-int load_messages() {
-    const char* msg_file = getenv("MSG_FICH"); // obtener el archivo desde la variable de entorno
-    if (!msg_file) {
-        perror("Variable de entorno MSG_FICH no configurada");
-        return 0;
+// Función para leer la política de desbordamiento de las colas de salida (OUTBOX_POLICY)
+int parse_overflow_policy(const char *name) {
+    if (!name || strcmp(name, "drop-newest") == 0) {
+        return OVERFLOW_DROP_NEWEST;
     }
+    if (strcmp(name, "drop-oldest") == 0) {
+        return OVERFLOW_DROP_OLDEST;
+    }
+    if (strcmp(name, "disconnect") == 0) {
+        return OVERFLOW_DISCONNECT;
+    }
+    printf("Política de desbordamiento desconocida '%s'; se usa drop-newest.\n", name);
+    return OVERFLOW_DROP_NEWEST;
+}
 
-    FILE* file = fopen(msg_file, "r"); // abrir el archivo para lectura
-    if (!file) {
-        perror("Error al abrir el archivo de mensajes para lectura");
-        return 0;
+// Función para añadir un usuario a la lista de usuarios conectados (devuelve su handle o -1). El
+// llamador ya ha comprobado que el usuario no tiene otra sesión (user: su id si ya está registrado,
+// -1 si no). La cola de salida y el pidfd se preparan antes de tomar el cerrojo de las sesiones, de
+// modo que las particiones solo esperan a que se registre el nombre y se saque una posición libre
+int add_client(const char *client_pipe, const char *username, int user, pid_t pid, int shared_process) {
+    Outbox *outbox = outbox_open(client_pipe, &outbox_limits);
+    int pidfd = pid > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+
+    pthread_rwlock_wrlock(&session_lock);
+    if (user == -1) {
+        user = intern_user(username);
     }
 
-    int loaded_count = 0;
-    while (fscanf(file, "%s %s %d %[^\n]", 
-                   messages[loaded_count].topic, 
-                   messages[loaded_count].username, 
-                   &messages[loaded_count].lifetime, 
-                   messages[loaded_count].message) == 4) {
-        // Solo cargar los mensajes cuyo lifetime sea mayor a 0
-        if (messages[loaded_count].lifetime > 0) {
-            // Verificar si el tópico ya existe
-            int topic_exists = 0;
-            for (int i = 0; i < topic_count; i++) {
-                if (strcmp(topics[i].name, messages[loaded_count].topic) == 0) {
-                    topic_exists = 1;
-                    topics[i].has_active_messages = 1; // marcamos que el tópico tiene mensajes activos
-                    break;
-                }
-            }
+    // Añadir el cliente en una posición libre (o ampliar la tabla); sin cola de salida no recibiría nada
+    int client = -1;
+    if (user != -1 && outbox) {
+        client = client_free;
+        if (client != -1) {
+            client_free = clients[client].next_free;
+        } else if (client_slots < client_cap || grow_table((void **)&clients, &client_cap, sizeof(Client))) {
+            client = client_slots++;
+        }
+    }
 
-            // Si el tópico no existe, agregarlo
-            if (!topic_exists) {
-                // Añadir un nuevo tópico al arreglo
-                strcpy(topics[topic_count].name, messages[loaded_count].topic);
-                topics[topic_count].has_active_messages = 1; // tópico con mensaje activo
-                topic_count++;
-            }
+    if (client != -1) {
+        strncpy(clients[client].client_pipe, client_pipe, sizeof(clients[client].client_pipe) - 1);
+        clients[client].user = user;
+        clients[client].pid = pid;
+        clients[client].shared_process = shared_process;
+        clients[client].pidfd = pidfd;
+        clients[client].outbox = outbox;
+        clients[client].ring = NULL;
+        clients[client].in_use = 1;
+        clients[client].leaving = 0;
+        users[user].client = client;
+        client_count++;
+    }
+    pthread_rwlock_unlock(&session_lock);
 
-            loaded_count++; // incrementar el contador si el mensaje es válido
+    if (client == -1) {
+        if (outbox) {
+            outbox_close(outbox);
         }
+        if (pidfd != -1) {
+            close(pidfd);
+        }
+        printf("No se puede agregar el cliente %s. %s.\n", username, outbox ? "Presupuesto de memoria agotado" : "Sin memoria para su cola de salida");
+        return -1;
     }
 
-    fclose(file); // cerrar el archivo después de leer
-    return loaded_count; // retornar el número de mensajes cargados
+    // Vigilar el proceso del cliente para expulsarlo si termina sin cerrar la sesión
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = PROCESS_EVENT_BASE * (client + 1) + pidfd };
+    if (pidfd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) == -1) {
+        close(pidfd);
+        clients[client].pidfd = -1; // solo lo usa el hilo de entrada
+    }
+    printf("Cliente agregado: %s (PID: %d)\n", username, pid);
+    return client;
 }
 
-
-// Función que maneja la señal SIGUSR1 (eliminación de hilos)
-void thread_signal_handler(int sig) {
-    if (sig == SIGUSR1) {
-        terminate_thread = 1;
+// Función para buscar la posición de un usuario en la lista de suscriptores de un tópico (-1 si no está)
+int find_subscriber(const Topic *topic, int user) {
+    for (int i = 0; i < topic->subscriber_count; i++) {
+        if (topic->subscribers[i] == user) {
+            return i;
+        }
     }
+    return -1;
 }
 
-// Función para disminuir el lifetime de los mensajes cada segundo y almacenar solamente los mensajes persistentes en el archivo
-void* manage_lifetime(void* arg) {
-    struct sigaction sa;
-    sa.sa_handler = thread_signal_handler;  // registrar el manejador de señales
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGUSR1, &sa, NULL);  // asignar el manejador para SIGUSR1
-
-    // Cargar los mensajes si se reinicia el manager y había alguno en el archivo
-    message_count = load_messages(); // cargar mensajes desde el archivo
+// Función para comparar dos mensajes retenidos por su número (para qsort)
+int compare_message_id(const void *a, const void *b) {
+    uint64_t id_a = (*(StoredMessage *const *)a)->id, id_b = (*(StoredMessage *const *)b)->id;
+    return id_a < id_b ? -1 : id_a > id_b;
+}
 
-    while (!terminate_thread) {
-        sleep(1);  // esperar 1 segundo para actualizar el archivo
+// Función para reenviar el siguiente tramo de los mensajes retenidos de los tópicos que cubre una
+// suscripción (el propio tópico o, si es un patrón, los tópicos que coinciden con él). Se encolan
+// las notificaciones ya codificadas de cada mensaje hasta ocupar REPLAY_HIGH_WATER bytes de la
+// cola; entonces se pide un aviso para seguir cuando se vacíe. Devuelve 1 si ya no queda nada
+int replay_step(Replay *replay) {
+    Client *client = &clients[replay->client];
+    if (!client->outbox) {
+        return 1;
+    }
+    matched_count = 0;
+    if (topics[replay->topic].is_pattern) {
+        match_pattern(0, topics[replay->topic].name);
+    } else {
+        add_match(replay->topic);
+    }
 
-        // Decrementar el lifetime de los mensajes
-        for (int i = 0; i < message_count; i++) {
-            if (messages[i].lifetime > 0) {
-                messages[i].lifetime--;  // decrementar el lifetime
+    // Recoger los mensajes que faltan por reenviar (los tópicos pueden haber cambiado desde el tramo anterior)
+    int count = 0;
+    for (int i = 0; i < matched_count; i++) {
+        for (StoredMessage *m = topics[matched_topics[i]].first_message; m; m = m->next) {
+            if (m->id < replay->next_id || m->id > replay->last_id) {
+                continue;
             }
-        }
-
-        // Eliminar mensajes con lifetime == 0
-        int new_message_count = 0;
-        for (int i = 0; i < message_count; i++) {
-            if (messages[i].lifetime > 0) {
-                messages[new_message_count] = messages[i];
-                new_message_count++;
+            if (count == replay_batch_cap && !grow_table((void **)&replay_batch, &replay_batch_cap, sizeof(StoredMessage *))) {
+                break; // sin memoria: se reenvía lo recogido
             }
+            replay_batch[count++] = m;
         }
-        message_count = new_message_count;  // actualizar el contador de mensajes
-
-        // Comprobar si algún tópico tiene mensajes activos
-        for (int i = 0; i < topic_count; i++) {
-            int topic_has_active_messages = 0;
-            for (int j = 0; j < message_count; j++) {
-                if (strcmp(topics[i].name, messages[j].topic) == 0 && messages[j].lifetime > 0) {
-                    topic_has_active_messages = 1;
-                    break;
-                }
-            }
-            topics[i].has_active_messages = topic_has_active_messages;
+    }
+    qsort(replay_batch, count, sizeof(StoredMessage *), compare_message_id);
+
+    size_t queued = outbox_pending(client->outbox);
+    for (int i = 0; i < count; i++) {
+        StoredMessage *m = replay_batch[i];
+        // Los mensajes cargados del registro se codifican la primera vez que se reenvían
+        if (!m->frame) {
+            m->frame = encode_notification(m->id, topics[m->topic].name, users[m->user].name, m->message);
         }
-
-        // Eliminar tópicos sin mensajes activos y sin suscriptores
-        for (int i = 0; i < topic_count; i++) {
-            if (!topics[i].has_active_messages && topics[i].subscriber_count == 0) {
-                for (int j = i; j < topic_count - 1; j++) {
-                    topics[j] = topics[j + 1];  // desplazar los tópicos
-                }
-                topic_count--;  // reducir el contador de tópicos
-                i--;  // ajustar el índice
-            }
+        if (m->frame && queued + m->frame->len > REPLAY_HIGH_WATER) {
+            outbox_watch_drain(client->outbox, REPLAY_LOW_WATER);
+            return 0;
         }
+        push_frame(client, m->frame);
+        queued += m->frame ? m->frame->len : 0;
+        replay->next_id = m->id + 1;
+    }
+    return 1;
+}
 
-        // Reescribir el archivo solo con los mensajes con lifetime > 0
-        const char* msg_file = getenv("MSG_FICH");
-        if (!msg_file) {
-            perror("Variable de entorno MSG_FICH no configurada");
-            return NULL;
-        }
+// Función para empezar a reenviar a un suscriptor los mensajes retenidos de su suscripción a partir
+// del número cursor (con CURSOR_LATEST no se reenvía ninguno)
+void start_replay(Client *client, int topic, uint64_t cursor) {
+    Replay replay = { client - clients, topic, cursor, next_message_id };
+    if (replay_step(&replay)) {
+        return;
+    }
+    if (replay_count == replay_cap && !grow_table((void **)&replays, &replay_cap, sizeof(Replay))) {
+        printf("Presupuesto de memoria agotado: se interrumpe el reenvío de mensajes a %s.\n", client_name(client));
+        return;
+    }
+    replays[replay_count++] = replay;
+}
 
-        FILE* file = fopen(msg_file, "w");
-        if (file) {
-            for (int i = 0; i < message_count; i++) {
-                if (messages[i].lifetime > 0) {
-                    fprintf(file, "%s %s %d %s\n",
-                            messages[i].topic,
-                            messages[i].username,
-                            messages[i].lifetime,
-                            messages[i].message);
-                }
-            }
-            fclose(file);
+// Función para continuar los reenvíos en curso (se llama cuando alguna cola vigilada se ha vaciado)
+void resume_replays() {
+    for (int i = 0; i < replay_count; ) {
+        if (replay_step(&replays[i])) {
+            replays[i] = replays[--replay_count];
         } else {
-            perror("Error al abrir el archivo de mensajes para reescritura");
+            i++;
         }
     }
-    pthread_exit(NULL); // finaliza el hilo
 }
 
-// Función para eliminar un cliente de la sesión actual
-void remove_client(const char *username) {
-    for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, username) == 0) {
-            // Enviar la señal SIGTERM al proceso del cliente para finalizar su proceso
-            if (clients[i].pid > 0) {
-                kill(clients[i].pid, SIGTERM);
-                printf("Se envió SIGTERM a %s (PID: %d)\n", username, clients[i].pid);
-            }
-            // Desplazar elementos hacia atrás para eliminar al cliente
-            for (int j = i; j < client_count - 1; j++) {
-                clients[j] = clients[j + 1];
-            }
-            client_count--; // reducir el contador de clientes
-            printf("Cliente '%s' ha sido eliminado de la lista de conectados.\n", username);
-            char formatted_message[100];
-            snprintf(formatted_message, sizeof(formatted_message), "El  cliente '%s' ha sido eliminado de la lista de conectados.\n", username);  
-            // Notificar a los clientes conectados
-            for (int i = 0; i < client_count; i++) {
-                send_response(clients[i].client_pipe, formatted_message);
-            }
-            return;
-        }
+// Función para abrir la ventana del commit en grupo si aún no está abierta
+void schedule_commit() {
+    if (sync_window_ms > 0 && !sync_armed) {
+        struct itimerspec window = { .it_value = { sync_window_ms / 1000, (sync_window_ms % 1000) * 1000000 } };
+        timerfd_settime(sync_fd, 0, &window, NULL);
+        sync_armed = 1;
     }
-    printf("Cliente '%s' no encontrado.\n", username);
 }
 
-// Función para mostrar los mensajes de un topico
-void show_messages(const char *topic_name) {
-    // Comprobar si el tópico existe
-    if (!topic_exists(topic_name)) {
-        printf("El tópico '%s' no existe.\n", topic_name);
+// Función para registrar un cambio de las suscripciones o del bloqueo de un tópico (user: -1 en los
+// bloqueos) para recuperarlo al reiniciar; un patrón replicado lo registra solo la partición que responde
+void log_state(int type, int topic, int user) {
+    if (quiet_replies) {
         return;
     }
+    WalState state = { type, topics[topic].name, user != -1 ? users[user].name : "" };
+    wal_append_state(&state);
+    schedule_commit();
+}
 
-    int found_messages = 0; // contador para verificar si hay mensajes
-    const char *msg_file = getenv("MSG_FICH");  // obtener el nombre del archivo desde la variable de entorno
+// Función para quitar un suscriptor de un tópico desplazando los restantes una posición hacia atrás
+void remove_subscriber(int topic, int position) {
+    for (int k = position; k < topics[topic].subscriber_count - 1; k++) {
+        topics[topic].subscribers[k] = topics[topic].subscribers[k + 1];
+    }
+    topics[topic].subscriber_count--;
+}
 
-    if (msg_file == NULL) {
-        printf("La variable de entorno MSG_FICH no está configurada.\n");
+// Función para suscribir un usuario a un topico (o a un patrón con comodines) y recibir los mensajes
+// de ese topico; los retenidos se reenvían a partir del cursor de la solicitud
+void subscribe_topic(const Response *request, Client *client) {
+    const char *topic_name = request->topic;
+    if (strlen(topic_name) >= TOPIC_NAME_LEN) {
+        send_error(client, "Error: El nombre del tópico excede el máximo de caracteres.");
         return;
     }
-
-    FILE *file = fopen(msg_file, "r");  // abrir el archivo en modo lectura
-    if (file == NULL) {
-        perror("Error al abrir el archivo de mensajes");
+    if (topic_pattern_kind(topic_name) == -1) {
+        send_error(client, "Error: El comodín '#' solo puede ser el último nivel del tópico.");
         return;
     }
 
-    char line[512];  // buffer para leer cada línea del archivo
-    while (fgets(line, sizeof(line), file)) {
-        StoredMessage msg;
-        // Leer los datos de la línea
-        int n = sscanf(line, "%255s %255s %d %300[^\n]", msg.topic, msg.username, &msg.lifetime, msg.message);
-        if (n != 4) {
-            continue;  // Si la línea no tiene el formato correcto, pasar a la siguiente
+    const char *username = client_name(client);
+
+    // Buscar si el tópico ya existe
+    int topic = name_index_find(&topic_index, topic_name);
+
+    // Si no existe el topico, crear uno nuevo y agregar al primer suscriptor
+    if (topic == -1) {
+        topic = create_topic(topic_name);
+        // Comprobar si queda memoria para más tópicos
+        if (topic == -1 || !add_subscriber(topic, client->user)) {
+            if (topic != -1) {
+                delete_topic(topic);
+            }
+            send_error(client, "Error: máximo de tópicos alcanzado.");
+            return;
         }
+        log_state(WAL_SUBSCRIBE, topic, client->user);
 
-        // Comprobar si el mensaje pertenece al tópico dado
-        if (strcmp(msg.topic, topic_name) == 0) {
-            found_messages = 1; // se encontraron mensajes
-            printf("Usuario: %s, Mensaje: %s\n", msg.username, msg.message);  // imprimir información del mensaje
+        // Imprimir mensaje en el servidor (un patrón se replica en todas las particiones: imprime la que responde)
+        if (!quiet_replies) {
+            printf("El usuario '%s' ha creado y se ha suscrito al tópico '%s'.\n", username, topic_name);
         }
-    }
 
-    fclose(file);  // Cerrar el archivo
+        // Un patrón nuevo puede cubrir tópicos que ya tienen mensajes retenidos
+        if (topics[topic].is_pattern) {
+            start_replay(client, topic, request->cursor);
+        }
 
-    if (!found_messages) {
-        printf("No hay mensajes en el tópico '%s'.\n", topic_name);
+        // Enviar respuesta al cliente
+        send_to_client(client, "Tópico creado y suscrito.");
+        return;
     }
-}
-
 
-// Función para manejar el CTRL+C del cliente
-void handle_ctrlc(const char *username) {
-    for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, username) == 0) {
-            // Enviar la señal SIGTERM al proceso del cliente para finalizar su proceso
-            if (clients[i].pid > 0) {
-                kill(clients[i].pid, SIGINT);
-                printf("Se envió SIGINT a %s (PID: %d)\n", username, clients[i].pid);
+    // Verificar si el usuario ya está suscrito
+    if (find_subscriber(&topics[topic], client->user) != -1) {
+        // Un cliente que vuelve a conectarse pide con el cursor solo lo que se perdió
+        if (request->has_cursor) {
+            cancel_replays(client - clients, topic);
+            start_replay(client, topic, request->cursor);
+        }
+        send_to_client(client, "Ya estás suscrito al tópico.");
+        return;
+    }
+
+    // Si el usuario no está suscrito, agregarlo
+    if (add_subscriber(topic, client->user)) {
+        log_state(WAL_SUBSCRIBE, topic, client->user);
+
+        // Enviar los mensajes retenidos
+        start_replay(client, topic, request->cursor);
+
+        // Imprimir mensaje en el servidor e informar de los suscriptores actuales del tópico
+        if (!quiet_replies) {
+            printf("El usuario '%s' se ha suscrito al tópico '%s'.\n", username, topic_name);
+            printf("Usuarios suscritos al tópico '%s':\n", topic_name);
+            for (int j = 0; j < topics[topic].subscriber_count; j++) {
+                printf(" - %s\n", users[topics[topic].subscribers[j]].name);
             }
-            // Desplazar elementos hacia atrás para eliminar al cliente
-            for (int j = i; j < client_count - 1; j++) {
-                clients[j] = clients[j + 1];
+        }
+
+        send_to_client(client, "Te has suscrito al tópico.");
+    } else {
+        send_error(client, "Error: máximo de suscriptores alcanzado.");
+    }
+}
+
+// Función para desuscribir un usuario de un topico
+void unsubscribe_topic(const char *topic_name, Client *client) {
+    // Buscar el tópico al que el usuario desea desuscribirse
+    int topic = name_index_find(&topic_index, topic_name);
+    if (topic == -1) {
+        // Si no se encuentra el tópico, se envía una respuesta indicando que el tópico no existe
+        send_error(client, "El tópico no existe.");
+        return;
+    }
+
+    // Verifica si el usuario está suscrito a este tópico
+    int position = find_subscriber(&topics[topic], client->user);
+    if (position == -1) {
+        // Si el usuario no estaba suscrito al tópico, envía una respuesta al cliente
+        send_error(client, "No estás suscrito al tópico.");
+        return;
+    }
+
+    // Si el usuario está suscrito, lo elimina de la lista de suscriptores del tópico
+    remove_subscriber(topic, position);
+    log_state(WAL_UNSUBSCRIBE, topic, client->user);
+    cancel_replays(client - clients, topic);
+
+    // Envia una respuesta al cliente confirmando que se desuscribió correctamente
+    send_to_client(client, "Te has desuscrito del tópico.");
+
+    // Eliminar el tópico si se queda sin mensajes activos y sin suscriptores
+    maybe_delete_topic(topic);
+}
+
+
+// Función para crear una operación repartida entre parts particiones
+Gather *gather_create(int kind, int parts) {
+    Gather *gather = calloc(1, sizeof(Gather));
+    if (!gather) {
+        perror("Error al reservar una operación repartida");
+        exit(EXIT_FAILURE);
+    }
+    gather->kind = kind;
+    atomic_init(&gather->remaining, parts);
+    pthread_mutex_init(&gather->lock, NULL);
+    gather->user = -1;
+    gather->client = -1;
+    return gather;
+}
+
+// Función para liberar una operación repartida
+void gather_free(Gather *gather) {
+    pthread_mutex_destroy(&gather->lock);
+    free(gather->topics);
+    free(gather);
+}
+
+// Función para terminar la parte de una partición; la última en terminar entrega la operación al hilo de entrada
+void gather_done(Gather *gather) {
+    if (atomic_fetch_sub(&gather->remaining, 1) != 1) {
+        return;
+    }
+    // Apilar sin cerrojos; solo hace falta avisar si la pila estaba vacía
+    Gather *top = atomic_load(&finished_gathers);
+    do {
+        gather->next = top;
+    } while (!atomic_compare_exchange_weak(&finished_gathers, &top, gather));
+    if (top == NULL) {
+        uint64_t one = 1;
+        write(gather_fd, &one, sizeof(one));
+    }
+}
+
+// Función para añadir a una lista repartida los tópicos de la partición (un patrón, que está en
+// todas, solo lo añade su partición principal)
+void collect_topics(Gather *gather) {
+    pthread_mutex_lock(&gather->lock);
+    for (int i = 0; i < topic_slots; i++) {
+        if (!topics[i].in_use || (topics[i].is_pattern && shard_of(topics[i].name) != shard_index)) {
+            continue;
+        }
+        if (gather->topic_count == gather->topic_cap) {
+            int cap = gather->topic_cap ? gather->topic_cap * 2 : 64;
+            GatherTopic *grown = realloc(gather->topics, cap * sizeof(GatherTopic));
+            if (!grown) {
+                break; // sin memoria: se lista lo recogido
             }
-            client_count--; // reducir el contador de clientes
-            printf("Cliente '%s' ha sido eliminado de la lista de conectados.\n", username);
+            gather->topics = grown;
+            gather->topic_cap = cap;
+        }
+        GatherTopic *entry = &gather->topics[gather->topic_count++];
+        snprintf(entry->name, sizeof(entry->name), "%s", topics[i].name);
+        entry->subscribers = topics[i].subscriber_count;
+    }
+    pthread_mutex_unlock(&gather->lock);
+    gather_done(gather);
+}
+
+// Función para listar los topicos recogidos de todas las particiones
+void list_topics(const Gather *gather) {
+    char response[1024] = "Tópicos:\n";
+
+    if (gather->topic_count == 0) {
+        // Concatenar "No hay tópicos para listar." a response
+        strcat(response, "No hay tópicos para listar.\n");
+        printf("No hay tópicos para listar.\n");
+    } else {
+        // Construir la lista de tópicos
+        for (int i = 0; i < gather->topic_count; i++) {
+            char topic_info[TOPIC_NAME_LEN + 32];
+            snprintf(topic_info, sizeof(topic_info), "- %s (Suscriptores: %d)\n", gather->topics[i].name, gather->topics[i].subscribers);
+            strncat(response, topic_info, sizeof(response) - strlen(response) - 1);
+        }
+        printf("Se listaron %d tópicos.\n", gather->topic_count);
+    }
+
+    // Enviar la respuesta completa usando response (si el cliente sigue conectado)
+    if (users[gather->user].client != -1) {
+        send_reply(&clients[users[gather->user].client], REPLY_TEXT, gather->seq, response);
+    }
+}
+
+
+// Función para añadir un mensaje retenido al registro de escritura anticipada (vencimiento absoluto)
+void log_message(StoredMessage *msg) {
+    WalRecord record = { msg->id, time(NULL) + (msg->due_tick - current_tick),
+                         topics[msg->topic].name, users[msg->user].name, msg->message };
+    msg->segment = wal_append_message(&record);
+}
+
+// Función para asignar el número del siguiente mensaje publicado. Los números se reservan en el
+// registro por bloques, con antelación, para que tras reiniciar no se repitan los de los mensajes
+// no persistentes (que no se guardan). Las particiones comparten el contador: los números crecen
+// en el orden en que se publica en cada tópico, no entre tópicos de particiones distintas
+uint64_t assign_message_id() {
+    uint64_t id = ++next_message_id;
+    if (id + MESSAGE_ID_BLOCK / 2 >= reserved_message_id) {
+        metrics_lock(&id_lock);
+        if (id + MESSAGE_ID_BLOCK / 2 >= reserved_message_id) {
+            reserved_message_id = id + MESSAGE_ID_BLOCK;
+            wal_reserve_ids(reserved_message_id);
+        }
+        pthread_mutex_unlock(&id_lock);
+        schedule_commit();
+    }
+    return id;
+}
+
+// Función para confirmar un lote; la parte de un lote repartido se suma a él y lo confirma el hilo de entrada
+void finish_batch(Client *sender, uint32_t seq, Gather *gather, int accepted, int rejected, int status) {
+    if (!gather) {
+        if (sender) {
+            send_ack(sender, seq, accepted, rejected, status);
+        }
+        return;
+    }
+    pthread_mutex_lock(&gather->lock);
+    gather->accepted += accepted;
+    gather->rejected += rejected;
+    if (status != 0) {
+        gather->status = status;
+    }
+    pthread_mutex_unlock(&gather->lock);
+    gather_done(gather);
+}
+
+// Función para sincronizar los registros pendientes con un único fdatasync y
+// confirmar a continuación los mensajes persistentes que esperaban
+void commit_messages() {
+    sync_armed = 0;
+    int status = wal_commit();
+    const char *ack = status == 0 ? "Mensaje enviado con éxito." : "Error: no se pudo guardar el mensaje.";
+    pthread_rwlock_rdlock(&session_lock);
+    for (int i = 0; i < pending_ack_count; i++) {
+        PendingAck *pending = &pending_acks[i];
+        Client *client = users[pending->user].client != -1 ? &clients[users[pending->user].client] : NULL;
+        if (pending->is_batch) {
+            finish_batch(client, pending->seq, pending->gather, pending->accepted, pending->rejected, status);
+        } else if (client) {
+            send_reply(client, status == 0 ? REPLY_TEXT : REPLY_ERROR, pending->seq, ack);
+        }
+    }
+    pthread_rwlock_unlock(&session_lock);
+    pending_ack_count = 0;
+}
+
+// Función para añadir a la instantánea del registro los mensajes retenidos de la partición, el
+// bloqueo y los suscriptores de sus tópicos (los de un patrón replicado, solo desde su partición)
+void snapshot_messages() {
+    time_t now = time(NULL);
+    for (int i = 0; i < topic_slots; i++) {
+        if (!topics[i].in_use) {
+            continue;
+        }
+        for (StoredMessage *m = topics[i].first_message; m; m = m->next) {
+            WalRecord record = { m->id, now + (m->due_tick - current_tick),
+                                 topics[i].name, users[m->user].name, m->message, m->segment };
+            wal_snapshot_add(&record);
+        }
+        if (topics[i].is_pattern && shard_of(topics[i].name) != shard_index) {
+            continue;
+        }
+        if (topics[i].is_locked) {
+            wal_snapshot_add_state(&(WalState){ WAL_LOCK, topics[i].name, "" });
+        }
+        for (int j = 0; j < topics[i].subscriber_count; j++) {
+            wal_snapshot_add_state(&(WalState){ WAL_SUBSCRIBE, topics[i].name, users[topics[i].subscribers[j]].name });
+        }
+    }
+}
+
+// Función para publicar un mensaje en un tópico: lo entrega a los suscriptores y lo retiene si es
+// persistente (devuelve NULL si se publicó o el texto del error; *persisted indica si espera al commit)
+const char *publish_message(Client *sender, const char *topic_name, int lifetime, const char *text, int *persisted) {
+    *persisted = 0;
+
+    // Los comodines solo sirven para suscribirse
+    if (topic_pattern_kind(topic_name) != 0) {
+        return "Error: No se puede publicar en un patrón con comodines.";
+    }
+
+    // Verificar si el tópico existe
+    int topic = name_index_find(&topic_index, topic_name);
+
+    // Si el tópico no existe y hay que retener el mensaje, crearlo (un mensaje sin lifetime
+    // solo se entrega a las suscripciones que lo cubren y no necesita el tópico)
+    if (topic == -1 && lifetime > 0) {
+        topic = create_topic(topic_name);
+        if (topic == -1) {
+            return "Error: No se pueden crear más tópicos, límite alcanzado.";
+        }
+        printf("Tópico '%s' creado automáticamente.\n", topic_name);
+    }
+
+    // Verificar si el tópico está bloqueado
+    if (topic != -1 && topics[topic].is_locked) {
+        return "El tópico está bloqueado. No se puede enviar el mensaje.";
+    }
+
+
+    // Si el mensaje es persistente, verificar el número de mensajes persistentes en el tópico
+    // (el contador del tópico se mantiene al guardar y al vencer cada mensaje)
+    if (lifetime > 0 && topics[topic].live_messages >= MAX_PERSISTENT_PER_TOPIC) {
+        return "Error: Se ha alcanzado el límite de 5 mensajes persistentes en este tópico.";
+    }
+
+    // Almacenar el mensaje en un bloque compacto (cabecera + contenido); los mensajes
+    // sin lifetime no se retienen porque solo se entregan a los suscriptores actuales
+    StoredMessage *stored = NULL;
+    if (lifetime > 0 && !(stored = store_message(topic, sender->user, lifetime, text))) {
+        maybe_delete_topic(topic);
+        return "Error: máximo de mensajes alcanzado.";
+    }
+
+    // Enviar el mensaje a los suscriptores del tópico y de los patrones que lo cubren excepto al remitente
+    // (la notificación se codifica una vez y todas las colas comparten la misma trama)
+    uint64_t id = assign_message_id();
+    SharedFrame *frame = encode_notification(id, topic_name, client_name(sender), text);
+    int fanout = frame ? notify_matches(topic_name, sender->user, frame) : 0;
+    metrics_add(MET_MESSAGES_PUBLISHED, 1);
+    metrics_observe(HIST_FANOUT, fanout);
+
+    // Imprimir el mensaje en la consola
+    printf("Mensaje de %s enviado al tópico %s\n", client_name(sender), topic_name);
+
+    if (stored) {
+        // Registrar el mensaje persistente; la confirmación espera al commit en grupo. El mensaje
+        // conserva la trama para reenviarla a los nuevos suscriptores
+        stored->frame = frame;
+        stored->id = id;
+        log_message(stored);
+        *persisted = 1;
+    } else if (frame) {
+        shared_frame_release(frame);
+    }
+
+    return NULL;
+}
+
+// Función para dejar pendiente hasta el commit en grupo la confirmación de una solicitud
+// (0 si no queda sitio: el llamante sincroniza en el momento y confirma)
+int defer_ack(Client *sender, uint32_t seq, int is_batch, int accepted, int rejected, Gather *gather) {
+    if (pending_ack_count == pending_ack_cap && !grow_table((void **)&pending_acks, &pending_ack_cap, sizeof(PendingAck))) {
+        return 0;
+    }
+    pending_acks[pending_ack_count++] = (PendingAck){ sender->user, seq, is_batch, accepted, rejected, gather };
+    schedule_commit();
+    return 1;
+}
+
+// Función para enviar un mensaje a un tópico y confirmar al remitente
+void send_message(const Response *request, Client *sender) {
+    int persisted;
+    const char *error = publish_message(sender, request->topic, request->lifetime, request->message, &persisted);
+    if (error) {
+        metrics_add(MET_MESSAGES_REJECTED, 1);
+        send_error(sender, error);
+    } else if (!persisted || !defer_ack(sender, request->seq, 0, 0, 0, NULL)) {
+        // Enviar una respuesta al cliente que envió el mensaje (sincronizando antes si es persistente)
+        if (persisted) {
+            wal_commit();
+        }
+        send_to_client(sender, "Mensaje enviado con éxito.");
+    }
+}
+
+// Función para publicar un lote de mensajes de un cliente: los persistentes se guardan con un
+// único commit y el lote entero se confirma con una sola respuesta (la de un lote repartido entre
+// varias particiones la envía el hilo de entrada cuando terminan todas)
+void send_batch(const ShardTask *task, Client *sender) {
+    const Response *request = &task->request;
+    FrameReader reader = { .data = request->batch, .left = request->batch_len, .error = 0 };
+    char topic[sizeof(request->topic)];
+    char text[sizeof(request->message)];
+    int accepted = 0, rejected = 0, persisted = 0;
+
+    while (reader.left > 0) {
+        frame_get_string(&reader, topic, sizeof(topic));
+        int lifetime = frame_get_int(&reader);
+        frame_get_string(&reader, text, sizeof(text));
+        if (reader.error) {
+            metrics_add(MET_MESSAGES_REJECTED, 1);
+            rejected++; // resto del lote mal formado
+            break;
+        }
+        int stored;
+        const char *error = publish_message(sender, topic, lifetime, text, &stored);
+        if (error) {
+            metrics_add(MET_MESSAGES_REJECTED, 1);
+            send_error(sender, error);
+            rejected++;
+        } else {
+            accepted++;
+            persisted |= stored;
+        }
+    }
+
+    if (!persisted || !defer_ack(sender, request->seq, 1, accepted, rejected, task->gather)) {
+        finish_batch(sender, request->seq, task->gather, accepted, rejected, persisted ? wal_commit() : 0);
+    }
+}
+
+
+
+// Función para guardar en la partición un mensaje vivo cargado del registro
+void load_stored(const ShardTask *task) {
+    static SHARD_LOCAL int budget_exhausted = 0;
+    if (budget_exhausted) {
+        return;
+    }
+
+    // Si el tópico no existe, agregarlo
+    int topic = name_index_find(&topic_index, task->request.topic);
+    if (topic == -1) {
+        topic = create_topic(task->request.topic);
+    }
+    StoredMessage *msg = topic != -1 ? store_message(topic, task->user, task->request.lifetime, task->request.message) : NULL;
+    if (!msg) {
+        printf("Presupuesto de memoria agotado: no se cargan más mensajes.\n");
+        budget_exhausted = 1;
+        if (topic != -1) {
+            maybe_delete_topic(topic);
+        }
+        return;
+    }
+    msg->id = task->value;
+}
+
+// Función para aplicar en la partición una suscripción, una baja o un bloqueo cargado del registro
+// (command_type: WAL_*). Aplicar dos veces el mismo cambio no tiene efecto: el almacén y los
+// segmentos que se conservan tras un compactado pueden recogerlo los dos
+void restore_state(const ShardTask *task) {
+    int type = task->request.command_type;
+    int topic = name_index_find(&topic_index, task->request.topic);
+    if (topic == -1) {
+        if (type == WAL_UNSUBSCRIBE || type == WAL_UNLOCK) {
             return;
         }
+        topic = create_topic(task->request.topic);
+        if (topic == -1) {
+            printf("Presupuesto de memoria agotado: no se recupera el tópico '%s'.\n", task->request.topic);
+            return;
+        }
+    }
+
+    int position = find_subscriber(&topics[topic], task->user);
+    switch (type) {
+        case WAL_SUBSCRIBE:
+            if (position == -1 && !add_subscriber(topic, task->user)) {
+                printf("Presupuesto de memoria agotado: no se recuperan las suscripciones al tópico '%s'.\n", task->request.topic);
+            }
+            break;
+        case WAL_UNSUBSCRIBE:
+            if (position != -1) {
+                remove_subscriber(topic, position);
+            }
+            break;
+        case WAL_LOCK:
+            topics[topic].is_locked = 1;
+            break;
+        case WAL_UNLOCK:
+            topics[topic].is_locked = 0;
+            break;
+    }
+    maybe_delete_topic(topic);
+}
+
+// Función para numerar los mensajes de la partición importados del formato de texto original
+void number_messages() {
+    for (int i = 0; i < topic_slots; i++) {
+        if (!topics[i].in_use) {
+            continue;
+        }
+        for (StoredMessage *m = topics[i].first_message; m; m = m->next) {
+            if (m->id == 0) {
+                m->id = ++next_message_id;
+            }
+        }
+    }
+}
+
+// Función para vencer los mensajes de la rueda de tiempos y registrar su vencimiento
+// (se ejecuta en cada vencimiento del temporizador, con los ticks de un segundo transcurridos desde el anterior)
+void expire_messages(int elapsed) {
+    uint64_t start = metrics_now();
+    for (int t = 0; t < elapsed; t++) {
+        current_tick++;
+
+        // Solo se recorre la ranura del tick actual; los mensajes de vueltas futuras se saltan
+        StoredMessage *msg = wheel[current_tick % WHEEL_SLOTS];
+        while (msg) {
+            StoredMessage *next = msg->wheel_next;
+            if (msg->due_tick <= current_tick) {
+                int topic = msg->topic;
+                wal_append_tombstone(msg->id);
+                free_message(msg);
+                // Eliminar el tópico si se queda sin mensajes activos y sin suscriptores
+                maybe_delete_topic(topic);
+            }
+            msg = next;
+        }
+    }
+
+    metrics_observe(HIST_EXPIRY_SWEEP, metrics_now() - start);
+
+    // El vencimiento se registra con tombstones; el fichero solo se reescribe al compactar
+    if (wal_pending() > 0) {
+        schedule_commit();
+    }
+}
+
+// Función para escribir en el fichero de una exportación los mensajes retenidos de la partición
+// (formato "<tópico> <usuario> <lifetime restante> <mensaje>", el que se importa al arrancar sin almacén)
+void write_messages(Gather *gather) {
+    pthread_mutex_lock(&gather->lock);
+    for (int i = 0; i < topic_slots; i++) {
+        if (!topics[i].in_use) {
+            continue;
+        }
+        for (StoredMessage *m = topics[i].first_message; m; m = m->next) {
+            fprintf(gather->file, "%s %s %d %s\n", topics[i].name, users[m->user].name,
+                    (int)(m->due_tick - current_tick), m->message);
+            gather->count++;
+        }
+    }
+    pthread_mutex_unlock(&gather->lock);
+    gather_done(gather);
+}
+
+// Función para enviar una tarea a la cola de una partición
+void shard_push(int shard, const ShardTask *task) {
+    task_queue_push(shards[shard].queue, task);
+}
+
+// Función para enviar una tarea a todas las particiones
+void shard_broadcast(const ShardTask *task) {
+    for (int s = 0; s < shard_count; s++) {
+        shard_push(s, task);
+    }
+}
+
+// Función para terminar la salida de un cliente cuando todas sus particiones han atendido lo que
+// envió antes y han cancelado sus reenvíos
+void finish_leave(const Gather *gather) {
+    const char *username = client_name(&clients[gather->client]);
+    drop_client(gather->client);
+    printf("Cliente '%s' ha sido eliminado de la lista de conectados.\n", username);
+    if (!gather->notify) {
+        return;
+    }
+    char formatted_message[100];
+    snprintf(formatted_message, sizeof(formatted_message), "El  cliente '%s' ha sido eliminado de la lista de conectados.\n", username);
+    // Notificar a los clientes conectados
+    for (int i = 0; i < client_slots; i++) {
+        if (clients[i].in_use) {
+            send_to_client(&clients[i], formatted_message);
+        }
+    }
+}
+
+// Función para construir la vista de tópicos de la consola con los recogidos de todas las particiones
+View *build_topics_view(const Gather *gather) {
+    size_t strings_len = 0;
+    for (int i = 0; i < gather->topic_count; i++) {
+        strings_len += strlen(gather->topics[i].name) + 1;
+    }
+    View *view = view_create(VIEW_TOPICS, gather->topic_count, strings_len);
+    if (view) {
+        for (int i = 0; i < gather->topic_count; i++) {
+            view->topics[view->count].name = view_string(view, gather->topics[i].name);
+            view->topics[view->count].subscribers = gather->topics[i].subscribers;
+            view->count++;
+        }
+    }
+    return view;
+}
+
+// Función para completar en el hilo de entrada una operación cuyas partes han terminado todas
+void complete_gather(Gather *gather) {
+    switch (gather->kind) {
+        case GATHER_TOPICS:
+            list_topics(gather);
+            break;
+        case GATHER_VIEW_TOPICS:
+            console_reply(build_topics_view(gather));
+            break;
+        case GATHER_BATCH:
+            if (users[gather->user].client != -1) {
+                send_ack(&clients[users[gather->user].client], gather->seq, gather->accepted, gather->rejected, gather->status);
+            }
+            break;
+        case GATHER_LEAVE:
+            finish_leave(gather);
+            break;
+        case GATHER_EXPORT:
+            fclose(gather->file);
+            printf("Se exportaron %d mensajes a '%s'.\n", gather->count, getenv("MSG_FICH"));
+            break;
+        case GATHER_SNAPSHOT:
+            wal_snapshot_end(gather->background);
+            break;
+    }
+    gather->done = 1;
+    if (!gather->waited) {
+        gather_free(gather);
+    }
+}
+
+// Función para completar las operaciones repartidas terminadas, en el orden en que terminaron
+void finish_gathers() {
+    // Desactivar el aviso antes de vaciar la pila: lo que se apile después vuelve a avisar
+    uint64_t value;
+    read(gather_fd, &value, sizeof(value));
+    Gather *finished = atomic_exchange(&finished_gathers, NULL);
+
+    // La pila está en orden inverso
+    Gather *ordered = NULL;
+    while (finished) {
+        Gather *next = finished->next;
+        finished->next = ordered;
+        ordered = finished;
+        finished = next;
+    }
+    while (ordered) {
+        Gather *next = ordered->next;
+        complete_gather(ordered);
+        ordered = next;
+    }
+}
+
+// Función para esperar en el hilo de entrada a que termine alguna operación repartida y completarla
+void await_gathers() {
+    struct pollfd pfd = { .fd = gather_fd, .events = POLLIN };
+    poll(&pfd, 1, -1);
+    finish_gathers();
+}
+
+// Función para esperar a que se complete una operación repartida creada con waited = 1 y liberarla
+void await_gather(Gather *gather) {
+    while (!gather->done) {
+        await_gathers();
+    }
+    gather_free(gather);
+}
+
+// Función para compactar el registro con los mensajes retenidos de todas las particiones
+// (en segundo plano si background != 0; si no, se espera a que termine)
+void compact_messages(int background) {
+    if (!wal_snapshot_begin()) {
+        return; // ya hay una compactación en curso
+    }
+    Gather *gather = gather_create(GATHER_SNAPSHOT, shard_count);
+    gather->background = background;
+    gather->waited = !background;
+    shard_broadcast(&(ShardTask){ .kind = TASK_SNAPSHOT, .gather = gather });
+    if (!background) {
+        await_gather(gather);
+    }
+}
+
+// Función para enviar a su partición un mensaje vivo del registro (se llama por cada mensaje al abrirlo)
+void load_message(const WalRecord *record) {
+    static int budget_exhausted = 0;
+    long lifetime = (long)(record->expiry - time(NULL));
+    if (lifetime <= 0 || budget_exhausted) {
+        return;
+    }
+
+    ShardTask task = { .kind = TASK_LOAD, .value = record->id };
+    pthread_rwlock_wrlock(&session_lock);
+    task.user = intern_user(record->user);
+    pthread_rwlock_unlock(&session_lock);
+    if (task.user == -1) {
+        printf("Presupuesto de memoria agotado: no se cargan más mensajes.\n");
+        budget_exhausted = 1;
+        return;
+    }
+    task.request.lifetime = (int)lifetime;
+    snprintf(task.request.topic, sizeof(task.request.topic), "%s", record->topic);
+    snprintf(task.request.message, sizeof(task.request.message), "%s", record->message);
+    shard_push(shard_of(record->topic), &task);
+}
+
+// Función para enviar a su partición (a todas si es un patrón) una suscripción, una baja o un
+// bloqueo del registro (se llama por cada cambio al abrirlo)
+void load_state(const WalState *state) {
+    ShardTask task = { .kind = TASK_RESTORE, .user = -1 };
+    if (state->user[0] != '\0') {
+        pthread_rwlock_wrlock(&session_lock);
+        task.user = intern_user(state->user);
+        pthread_rwlock_unlock(&session_lock);
+        if (task.user == -1) {
+            printf("Presupuesto de memoria agotado: no se recupera la suscripción de '%s'.\n", state->user);
+            return;
+        }
+    }
+    task.request.command_type = state->type;
+    snprintf(task.request.topic, sizeof(task.request.topic), "%s", state->topic);
+    if (topic_pattern_kind(state->topic) == 1) {
+        shard_broadcast(&task);
+    } else {
+        shard_push(shard_of(state->topic), &task);
+    }
+}
+
+// Función para cargar los mensajes persistentes, las suscripciones y los bloqueos del almacén del
+// manager anterior (si todavía no hay almacén se importa el fichero de texto MSG_FICH)
+int load_messages() {
+    const char *store_file = getenv("MSG_STORE");
+    next_message_id = wal_open(store_file ? store_file : DEFAULT_STORE_FILE, getenv("MSG_FICH"), load_message, load_state);
+
+    // Los mensajes importados del formato de texto original reciben un id nuevo y se escribe el almacén
+    Gather *gather = gather_create(GATHER_NUMBER, shard_count);
+    gather->waited = 1;
+    shard_broadcast(&(ShardTask){ .kind = TASK_NUMBER, .gather = gather });
+    await_gather(gather);
+
+    // Reservar los primeros números de mensaje de esta ejecución antes de publicar ninguno
+    reserved_message_id = next_message_id + MESSAGE_ID_BLOCK;
+    wal_reserve_ids(reserved_message_id);
+    wal_commit();
+    if (wal_needs_rewrite()) {
+        compact_messages(0);
+    }
+    return message_count; // retornar el número de mensajes cargados
+}
+
+// Función para sacar a un cliente de la sesión: se marca como saliente (ya no se atienden sus
+// solicitudes) y se quita de la lista cuando todas las particiones han cancelado sus reenvíos
+void leave_client(int client, int notify) {
+    clients[client].leaving = 1;
+    Gather *gather = gather_create(GATHER_LEAVE, shard_count);
+    gather->client = client;
+    gather->notify = notify;
+    shard_broadcast(&(ShardTask){ .kind = TASK_LEAVE, .value = client, .gather = gather });
+}
+
+// Función para expulsar a un cliente que ya no puede recibir nada (su proceso terminó, su pipe no
+// tiene lector o su cola de salida se desbordó): sale de la sesión como con exit
+void evict_client(int client, const char *reason) {
+    if (!clients[client].in_use || clients[client].leaving) {
+        return;
+    }
+    printf("Cliente '%s' (PID: %d) expulsado: %s.\n", client_name(&clients[client]), clients[client].pid, reason);
+    metrics_add(MET_CLIENTS_EVICTED, 1);
+    leave_client(client, 1);
+}
+
+// Función para atender el aviso de que terminó el proceso de un cliente (por su pidfd)
+void client_process_exited(uint64_t event) {
+    int client = (int)(event / PROCESS_EVENT_BASE) - 1;
+    int pidfd = (int)(event % PROCESS_EVENT_BASE);
+    // El aviso puede ser de un cliente ya quitado en este mismo lote de eventos cuya posición y
+    // descriptor se han reutilizado: solo cuenta si el proceso vigilado ha terminado de verdad
+    struct pollfd exited = { .fd = pidfd, .events = POLLIN };
+    if (client >= client_slots || !clients[client].in_use || clients[client].pidfd != pidfd || poll(&exited, 1, 0) != 1) {
+        return;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pidfd, NULL); // sigue activo hasta que se cierre
+    evict_client(client, "su proceso ha terminado sin cerrar la sesión");
+}
+
+// Función para expulsar a los clientes cuya cola de salida ha dejado de admitir tramas
+void evict_failed_outboxes() {
+    for (int i = 0; i < client_slots; i++) {
+        if (clients[i].in_use && !clients[i].leaving && clients[i].outbox) {
+            int status = outbox_status(clients[i].outbox);
+            if (status == OUTBOX_PEER_GONE) {
+                evict_client(i, "su pipe ya no tiene lector");
+            } else if (status == OUTBOX_OVERFLOW) {
+                evict_client(i, "no lee y su cola de salida se ha desbordado");
+            }
+        }
+    }
+}
+
+// Función para comprobar con kill(pid, 0) los procesos de los clientes que no tienen pidfd
+// (núcleos anteriores a pidfd_open); se llama con cada tick del temporizador
+void check_client_processes() {
+    for (int i = 0; i < client_slots; i++) {
+        if (clients[i].in_use && clients[i].pidfd == -1 && clients[i].pid > 0 &&
+            kill(clients[i].pid, 0) == -1 && errno == ESRCH) {
+            evict_client(i, "su proceso ha terminado sin cerrar la sesión");
+        }
+    }
+}
+
+// Función para eliminar un cliente de la sesión actual (signal_client: terminar también su proceso;
+// no hace falta cuando es el propio cliente quien sale, y el proceso puede alojar otras sesiones)
+void remove_client(const char *username, int signal_client) {
+    int user = name_index_find(&user_index, username);
+    int client = user != -1 ? users[user].client : -1;
+    if (client == -1 || clients[client].leaving) {
+        printf("Cliente '%s' no encontrado.\n", username);
+        return;
+    }
+
+    // Enviar la señal SIGTERM al proceso del cliente para finalizar su proceso (si no aloja otras
+    // sesiones: a esas les llega el cierre de su pipe)
+    if (signal_client && clients[client].pid > 0 && !clients[client].shared_process) {
+        kill(clients[client].pid, SIGTERM);
+        printf("Se envió SIGTERM a %s (PID: %d)\n", username, clients[client].pid);
+    }
+    leave_client(client, 1);
+}
+
+// Función para exportar los mensajes retenidos de todas las particiones al fichero de texto MSG_FICH
+void export_messages() {
+    const char *msg_file = getenv("MSG_FICH");
+    if (!msg_file) {
+        printf("La variable de entorno MSG_FICH no está configurada.\n");
+        return;
+    }
+
+    FILE *file = fopen(msg_file, "w");
+    if (!file) {
+        perror("Error al abrir el archivo de mensajes para exportar");
+        return;
+    }
+    Gather *gather = gather_create(GATHER_EXPORT, shard_count);
+    gather->file = file;
+    shard_broadcast(&(ShardTask){ .kind = TASK_EXPORT, .gather = gather });
+}
+
+// Función para manejar el CTRL+C del cliente
+void handle_ctrlc(const char *username) {
+    int user = name_index_find(&user_index, username);
+    int client = user != -1 ? users[user].client : -1;
+    if (client == -1 || clients[client].leaving) {
+        printf("Cliente '%s' no encontrado.\n", username);
+        return;
+    }
+
+    // El cliente avisa del CTRL+C mientras termina por sí mismo: no se señala su proceso,
+    // que además puede alojar otras sesiones
+    leave_client(client, 0);
+}
+
+// Función para notificar un aviso a todos los suscriptores conectados de un tópico (y de los patrones que lo cubren)
+void notify_subscribers(int topic, const char *notification) {
+    SharedFrame *frame = encode_text(REPLY_TEXT, 0, notification);
+    if (frame) {
+        notify_matches(topics[topic].name, -1, frame);
+        shared_frame_release(frame);
     }
-    printf("Cliente '%s' no encontrado.\n", username);
 }
 
 // Función para bloquear el envío de mensajes en un topico
 void lock_topic(const char *topic_name) {
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            if (!topics[i].is_locked) {
-                topics[i].is_locked = 1; // bloquear el tópico
-                printf("Tópico '%s' bloqueado.\n", topic_name);
-
-                // Notificar a los suscriptores del bloqueo
-                char notification[256];
-                snprintf(notification, sizeof(notification), "El tópico '%s' ha sido bloqueado. No se pueden enviar mensajes temporalmente.", topic_name);
-                for (int j = 0; j < topics[i].subscriber_count; j++) {
-                    for (int k = 0; k < client_count; k++) {
-                        if (strcmp(clients[k].username, topics[i].subscribers[j]) == 0) {
-                            send_response(clients[k].client_pipe, notification);
-                            break;
-                        }
-                    }
-                }
-            } else {
-                printf("El tópico '%s' ya está bloqueado.\n", topic_name);
-            }
-            return;
-        }
+    int topic = name_index_find(&topic_index, topic_name);
+    if (topic == -1) {
+        printf("No se encontró el tópico '%s' para bloquear.\n", topic_name);
+        return;
+    }
+
+    if (!topics[topic].is_locked) {
+        topics[topic].is_locked = 1; // bloquear el tópico
+        log_state(WAL_LOCK, topic, -1);
+        printf("Tópico '%s' bloqueado.\n", topic_name);
+
+        // Notificar a los suscriptores del bloqueo
+        char notification[256];
+        snprintf(notification, sizeof(notification), "El tópico '%s' ha sido bloqueado. No se pueden enviar mensajes temporalmente.", topic_name);
+        notify_subscribers(topic, notification);
+    } else {
+        printf("El tópico '%s' ya está bloqueado.\n", topic_name);
     }
-    printf("No se encontró el tópico '%s' para bloquear.\n", topic_name);
 }
 
 // Función para bloquear el envío de mensajes en un topico
 void unlock_topic(const char* topic_name) {
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            if (topics[i].is_locked) {
-                topics[i].is_locked = 0;  // desbloquear el tópico
-                printf("El tópico '%s' ha sido desbloqueado para el envío de mensajes.\n", topic_name);
-
-                // Notificar a los suscriptores del desbloqueo
-                char notification[256];
-                snprintf(notification, sizeof(notification), "El tópico '%s' ha sido desbloqueado. Ya puedes enviar mensajes.", topic_name);
-                for (int j = 0; j < topics[i].subscriber_count; j++) {
-                    for (int k = 0; k < client_count; k++) {
-                        if (strcmp(clients[k].username, topics[i].subscribers[j]) == 0) {
-                            send_response(clients[k].client_pipe, notification);
-                            break;
-                        }
-                    }
-                }
+    int topic = name_index_find(&topic_index, topic_name);
+    if (topic == -1) {
+        printf("Error: Tópico '%s' no encontrado.\n", topic_name);
+        return;
+    }
+
+    if (topics[topic].is_locked) {
+        topics[topic].is_locked = 0;  // desbloquear el tópico
+        log_state(WAL_UNLOCK, topic, -1);
+        printf("El tópico '%s' ha sido desbloqueado para el envío de mensajes.\n", topic_name);
+
+        // Notificar a los suscriptores del desbloqueo
+        char notification[256];
+        snprintf(notification, sizeof(notification), "El tópico '%s' ha sido desbloqueado. Ya puedes enviar mensajes.", topic_name);
+        notify_subscribers(topic, notification);
+
+        // Un tópico bloqueado se conserva aunque se quede sin mensajes ni suscriptores
+        maybe_delete_topic(topic);
+    } else {
+        printf("El tópico '%s' ya está desbloqueado.\n", topic_name);
+    }
+}
+
+
+// Función para enviar un comando del manager sobre un tópico a la partición que lo posee
+void route_topic_command(int kind, const char *topic_name) {
+    ShardTask task = { .kind = kind };
+    snprintf(task.request.topic, sizeof(task.request.topic), "%s", topic_name);
+    shard_push(shard_of(topic_name), &task);
+}
+
+// Función para ejecutar un comando del manager que modifica el estado (las consultas las responde la consola)
+void handle_manager_command(const char *input) {
+    // Comando remove <user>
+    if (strncmp(input, "remove ", 7) == 0) {
+        char username[USERNAME_LEN];
+        sscanf(input + 7, "%256s", username);
+        remove_client(username, 1); // Eliminar cliente
+    }
+    // Comando close
+    else if (strcmp(input, "close") == 0) {
+        terminate_server = 1; // el bucle de eventos cierra las conexiones al terminar
+    }
+    // Comando export
+    else if (strcmp(input, "export") == 0) {
+        export_messages();
+    }
+    // Comando lock <topic>
+    else if (strncmp(input, "lock ", 5) == 0){
+        char topic[TOPIC_NAME_LEN];
+        sscanf(input + 5, "%128s", topic);
+        route_topic_command(TASK_LOCK, topic);
+    }
+    // Comando unlock <topic>
+    else if (strncmp(input, "unlock ", 7) == 0){
+        char topic[TOPIC_NAME_LEN];
+        sscanf(input + 7, "%128s", topic);
+        route_topic_command(TASK_UNLOCK, topic);
+    }
+    else {
+        printf("Comando desconocido: %s\n", input);
+    }
+}
+
+
+// Función para proyectar los anillos de memoria compartida que creó un cliente para su sesión
+void attach_ring(Client *client) {
+    if (client->ring || !client->outbox) {
+        send_error(client, "Error: No se puede activar el transporte de memoria compartida.");
+        return;
+    }
+    char name[RING_NAME_LEN];
+    ring_region_name(name, client->client_pipe);
+    RingRegion *ring = ring_region_attach(name);
+    if (!ring) {
+        perror("Error al proyectar la memoria compartida del cliente");
+        send_error(client, "Error: No se puede activar el transporte de memoria compartida.");
+        return;
+    }
+    shm_unlink(name); // ambos extremos ya la tienen proyectada: desaparece al terminar la sesión
+
+    // Las respuestas pendientes y las siguientes van al anillo; los comandos del cliente se
+    // atienden con el primer timbre, que llega por la pipe detrás de los que ya envió por ella
+    client->ring = ring;
+    outbox_attach_ring(client->outbox, ring);
+    atomic_store(&ring->attached, 1);
+    printf("Transporte de memoria compartida activado para %s.\n", client_name(client));
+    send_to_client(client, "Transporte de memoria compartida activado.");
+}
+
+// Función para enviar la solicitud de un cliente sobre un tópico a la partición que lo posee; un
+// patrón se suscribe y se da de baja en todas para cubrir sus tópicos (solo responde la principal)
+void route_request(const Response *msg, int user) {
+    ShardTask task = { .kind = TASK_REQUEST, .user = user, .request = *msg };
+    int home = shard_of(msg->topic);
+    if ((msg->command_type == CMD_SUBSCRIBE || msg->command_type == CMD_UNSUBSCRIBE) && topic_pattern_kind(msg->topic) == 1) {
+        for (int s = 0; s < shard_count; s++) {
+            task.quiet = s != home;
+            shard_push(s, &task);
+        }
+    } else {
+        shard_push(home, &task);
+    }
+}
+
+// Función para repartir un lote entre las particiones de sus tópicos: cada parte lleva, tal y como
+// llegaron codificados, los mensajes de una partición. Si hay varias partes, el hilo de entrada
+// confirma el lote cuando terminan todas
+void route_batch(const Response *msg, int user) {
+    ShardTask task = { .kind = TASK_REQUEST, .user = user, .request = *msg };
+    char *parts[MAX_TOPIC_SHARDS] = { NULL };
+    size_t lengths[MAX_TOPIC_SHARDS] = { 0 };
+    int part_count = 0, rejected = 0;
+
+    if (shard_count == 1) {
+        parts[0] = malloc(msg->batch_len + 1);
+        if (parts[0]) {
+            memcpy(parts[0], msg->batch, msg->batch_len);
+            lengths[0] = msg->batch_len;
+            part_count = 1;
+        }
+    } else {
+        FrameReader reader = { .data = msg->batch, .left = msg->batch_len, .error = 0 };
+        char topic[sizeof(msg->topic)];
+        char text[sizeof(msg->message)];
+        while (reader.left > 0) {
+            const char *start = reader.data;
+            frame_get_string(&reader, topic, sizeof(topic));
+            frame_get_int(&reader);
+            frame_get_string(&reader, text, sizeof(text));
+            if (reader.error) {
+                metrics_add(MET_MESSAGES_REJECTED, 1);
+                rejected++; // resto del lote mal formado
+                break;
+            }
+            int s = shard_of(topic);
+            if (!parts[s] && (parts[s] = malloc(msg->batch_len)) != NULL) {
+                part_count++;
+            }
+            if (parts[s]) {
+                memcpy(parts[s] + lengths[s], start, reader.data - start);
+                lengths[s] += reader.data - start;
             } else {
-                printf("El tópico '%s' ya está desbloqueado.\n", topic_name);
+                metrics_add(MET_MESSAGES_REJECTED, 1);
+                rejected++; // sin memoria para la parte de su partición
             }
-            return;
         }
     }
-    printf("Error: Tópico '%s' no encontrado.\n", topic_name);
+
+    if (part_count == 0) {
+        send_ack(&clients[users[user].client], msg->seq, 0, rejected, 0);
+        return;
+    }
+    if (part_count > 1 || rejected) {
+        task.gather = gather_create(GATHER_BATCH, part_count);
+        task.gather->user = user;
+        task.gather->seq = msg->seq;
+        task.gather->rejected = rejected;
+    }
+    for (int s = 0; s < shard_count; s++) {
+        if (parts[s]) {
+            task.request.batch = parts[s];
+            task.request.batch_len = lengths[s];
+            shard_push(s, &task);
+        }
+    }
+}
+
+// Función para programar el temporizador de terminaciones con la primera pendiente (o desarmarlo)
+void arm_kill_timer() {
+    struct itimerspec when = { 0 };
+    if (pending_kill_head < pending_kill_count) {
+        when.it_value = pending_kills[pending_kill_head].due;
+    }
+    timerfd_settime(kill_timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+// Función para terminar un proceso después de REJECT_KILL_DELAY_MS sin detener el bucle de eventos
+void schedule_kill(pid_t pid) {
+    if (pid <= 0) {
+        return;
+    }
+    if (pending_kill_count == pending_kill_cap && pending_kill_head > 0) {
+        // Aprovechar las posiciones ya atendidas antes de ampliar la tabla
+        memmove(pending_kills, pending_kills + pending_kill_head, (pending_kill_count - pending_kill_head) * sizeof(PendingKill));
+        pending_kill_count -= pending_kill_head;
+        pending_kill_head = 0;
+    }
+    if (pending_kill_count == pending_kill_cap && !grow_table((void **)&pending_kills, &pending_kill_cap, sizeof(PendingKill))) {
+        kill(pid, SIGTERM); // sin memoria: se termina en el momento
+        return;
+    }
+    PendingKill *pending = &pending_kills[pending_kill_count++];
+    pending->pid = pid;
+    clock_gettime(CLOCK_MONOTONIC, &pending->due);
+    pending->due.tv_sec += REJECT_KILL_DELAY_MS / 1000;
+    pending->due.tv_nsec += (REJECT_KILL_DELAY_MS % 1000) * 1000000L;
+    if (pending->due.tv_nsec >= 1000000000L) {
+        pending->due.tv_sec++;
+        pending->due.tv_nsec -= 1000000000L;
+    }
+    // Todas vencen tras el mismo plazo: solo hace falta armar el temporizador si era la única
+    if (pending_kill_count - pending_kill_head == 1) {
+        arm_kill_timer();
+    }
+}
+
+// Función para terminar los procesos de los inicios de sesión rechazados cuyo plazo ha vencido
+void run_pending_kills() {
+    uint64_t expirations;
+    read(kill_timer_fd, &expirations, sizeof(expirations));
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (pending_kill_head < pending_kill_count) {
+        PendingKill *pending = &pending_kills[pending_kill_head];
+        if (pending->due.tv_sec > now.tv_sec || (pending->due.tv_sec == now.tv_sec && pending->due.tv_nsec > now.tv_nsec)) {
+            break;
+        }
+        kill(pending->pid, SIGTERM); // cierra el cliente rechazado
+        pending_kill_head++;
+    }
+    if (pending_kill_head == pending_kill_count) {
+        pending_kill_head = pending_kill_count = 0;
+    }
+    arm_kill_timer();
+}
+
+// Función para rechazar un inicio de sesión: se responde en el momento y el proceso se termina
+// cuando ya ha podido leer la respuesta
+void reject_login(const Response *msg, const char *reason) {
+    printf("%s", reason);
+    send_response(msg->client_pipe, msg->seq, reason);
+    // Un proceso con varias sesiones solo recibe la respuesta: terminarlo cerraría también las demás
+    if (!(msg->login_flags & LOGIN_SHARED_PROCESS)) {
+        schedule_kill(msg->pid);
+    }
 }
 
+// Función para dar de alta la sesión de un usuario que no tiene otra
+void admit_login(const Response *msg, int user) {
+    int new_client = add_client(msg->client_pipe, msg->username, user, msg->pid, (msg->login_flags & LOGIN_SHARED_PROCESS) != 0);
+    char res[512];
+    if (new_client != -1) {
+        reply_client = new_client;
+        reply_seq = msg->seq;
+        sprintf(res, "Bienvenido, %s", msg->username);
+        send_to_client(&clients[new_client], res);
+    } else {
+        // Sin memoria para otro cliente: presupuesto agotado o sin cola de salida
+        sprintf(res, "ERR: Out of memory for a new session (memory budget: %zu of %zu KB in use).\n",
+                mem_used() / 1024, mem_budget() / 1024);
+        reject_login(msg, res);
+    }
+}
 
-// Función para manejar el envío de comandos del manager
-void* command_sender(void* arg) {
-    struct sigaction sa;
-    sa.sa_handler = thread_signal_handler; // registrar el manejador de señales
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGUSR1, &sa, NULL);  // asignar el manejador para SIGUSR1
+// Función para atender un inicio de sesión (user: id del nombre de usuario, -1 si no está registrado)
+void handle_login(const Response *msg, int user) {
+    int old_client = user != -1 ? users[user].client : -1;
+    char res[512];
+    // Verificar si el nombre de usuario ya está en uso
+    if (old_client != -1 && !clients[old_client].leaving) {
+        sprintf(res, "ERR: Username '%s' is already in use.\n", msg->username);
+        reject_login(msg, res);
+    } else if (msg->username[0] == '\0') { // verificar que el nombre no esté vacío
+        reject_login(msg, "ERR: Invalid username.\n");
+    } else if (old_client != -1) {
+        // La sesión anterior del usuario aún está saliendo: se aparca el inicio de sesión hasta que
+        // la quiten sus particiones (sin memoria para aparcarlo, se espera en el momento)
+        if (parked_login_count < parked_login_cap || grow_table((void **)&parked_logins, &parked_login_cap, sizeof(Response))) {
+            parked_logins[parked_login_count++] = *msg;
+            return;
+        }
+        while (users[user].client != -1) {
+            await_gathers();
+        }
+        admit_login(msg, user);
+    } else {
+        admit_login(msg, user);
+    }
+}
 
-    char input[256];
-    while (!terminate_thread) {     
-        if (fgets(input, sizeof(input), stdin) == NULL) {
-            if (terminate_thread){
-                printf("Recibida señal de terminación\n");
-                break; 
-            }  
+// Función para atender, en orden de llegada, los inicios de sesión aparcados cuyo usuario ya no
+// tiene una sesión saliendo
+void admit_parked_logins() {
+    for (int i = 0; i < parked_login_count; ) {
+        int user = name_index_find(&user_index, parked_logins[i].username);
+        if (users[user].client != -1 && clients[users[user].client].leaving) {
+            i++;
             continue;
         }
-        input[strcspn(input, "\n")] = 0; // eliminar salto de línea para que se pueda procesar bien el comando
-
-        // Comando remove <user>
-        if (strncmp(input, "remove ", 7) == 0) {
-            char username[USERNAME_LEN];
-            sscanf(input + 7, "%s", username);
-            pthread_mutex_lock(&mutex);
-            remove_client(username); // Eliminar cliente
-            pthread_mutex_unlock(&mutex);
-        }
-        // Comando close
-        else if (strcmp(input, "close") == 0) {
-            close_all_connections(); 
-            unlink(SERVER_PIPE); 
-            exit(0); 
-        }
-        // Comando users
-        else if (strcmp(input, "users") == 0) {
-            pthread_mutex_lock(&mutex);
-            printf("Lista de usuarios conectados:\n");
-            list_connected_users();
-            pthread_mutex_unlock(&mutex);
-        }
-        // Comando topics
-        else if (strcmp(input, "topics") == 0) {
-            pthread_mutex_lock(&mutex);
-            printf("Tópicos:\n");
-            if (topic_count == 0) {
-                printf("No se encontraron tópicos para listar.\n");
+        Response msg = parked_logins[i];
+        parked_login_count--;
+        memmove(&parked_logins[i], &parked_logins[i + 1], (parked_login_count - i) * sizeof(Response));
+        handle_login(&msg, user);
+        reply_client = -1;
+    }
+}
+
+// Función para procesar una solicitud completa recibida por la pipe del servidor
+void process_request(Response *msg) {
+    msg->username[sizeof(msg->username) - 1] = '\0';
+    msg->topic[sizeof(msg->topic) - 1] = '\0';
+
+    // Resolver una sola vez el cliente que envía la solicitud (uno que está saliendo ya no tiene sesión)
+    int user = name_index_find(&user_index, msg->username);
+    Client *client = (user != -1 && users[user].client != -1 && !clients[users[user].client].leaving) ? &clients[users[user].client] : NULL;
+    reply_client = client ? client - clients : -1;
+    reply_seq = msg->seq;
+    metrics_command(msg->command_type);
+
+    // Los comandos de una sesión necesitan que el usuario haya iniciado sesión
+    int needs_session = msg->command_type == CMD_SUBSCRIBE || msg->command_type == CMD_TOPICS ||
+                        msg->command_type == CMD_UNSUBSCRIBE || msg->command_type == CMD_MSG ||
+                        msg->command_type == CMD_ATTACH_RING || msg->command_type == CMD_MSG_BATCH;
+    if (!client && needs_session) {
+        send_response(msg->client_pipe, msg->seq, "ERR: No has iniciado sesión.");
+        return;
+    }
+
+    switch (msg->command_type) {
+        // Mensaje de conexión
+        case CMD_LOGIN:
+            handle_login(msg, user);
+            break;
+
+        // Manejo de la creación de un tópico (en la partición del tópico)
+        case CMD_SUBSCRIBE:
+            route_request(msg, user);
+            break;
+
+        // Manejo de listar los topicos (se recogen de todas las particiones)
+        case CMD_TOPICS: {
+            printf("Listar tópicos para el usuario '%s'.\n", msg->username);
+            Gather *gather = gather_create(GATHER_TOPICS, shard_count);
+            gather->user = user;
+            gather->seq = msg->seq;
+            shard_broadcast(&(ShardTask){ .kind = TASK_TOPICS, .gather = gather });
+            break;
+        }
+
+        // Manejo del comando exit del cliente
+        case CMD_EXIT:
+            printf("Cliente '%s' ha salido.\n", msg->username);
+            remove_client(msg->username, 0);
+            break;
+
+        // Manejo de la desuscripcion de un cliente en un topico
+        case CMD_UNSUBSCRIBE:
+            printf("El usuario '%s'se ha desuscrito del tópico '%s'\n", msg->username, msg->topic);
+            route_request(msg, user);
+            break;
+
+        // Manejo del envío de un mensaje y almacenamiento en un archivo si es persistente
+        case CMD_MSG:
+            route_request(msg, user);
+            break;
+
+        // Manejo del CTRL+C del cliente
+        case CMD_CTRLC:
+            handle_ctrlc(msg->username);
+            break;
+
+        // Activación del transporte de memoria compartida
+        case CMD_ATTACH_RING:
+            attach_ring(client);
+            break;
+
+        // Manejo del envío de un lote de mensajes (repartido entre las particiones de sus tópicos)
+        case CMD_MSG_BATCH:
+            route_batch(msg, user);
+            break;
+
+        default:
+            // Enviar respuesta de comando no reconocido
+            send_response(msg->client_pipe, msg->seq, "Comando no reconocido.");
+            printf("Comando no reconocido: tipo %d\n", msg->command_type);
+            break;
+    }
+    reply_client = -1;
+}
+
+// Función para decodificar una trama de solicitud de un cliente (0 si no es válida)
+int decode_request(const char *frame, Response *msg) {
+    FrameHeader header;
+    FrameReader reader;
+    frame_open(&reader, &header, frame);
+
+    msg->command_type = header.type;
+    msg->seq = header.seq;
+    msg->pid = frame_get_int(&reader);
+    frame_get_string(&reader, msg->username, sizeof(msg->username));
+    msg->topic[0] = '\0';
+    msg->lifetime = 0;
+    msg->cursor = CURSOR_ALL;
+    msg->has_cursor = 0;
+    msg->login_flags = 0;
+    msg->message[0] = '\0';
+    snprintf(msg->client_pipe, sizeof(msg->client_pipe), CLIENT_PIPE_FORMAT, msg->pid);
+
+    switch (header.type) {
+        case CMD_LOGIN:
+            frame_get_string(&reader, msg->client_pipe, sizeof(msg->client_pipe));
+            if (reader.left > 0) {
+                msg->login_flags = frame_get_int(&reader);
             }
-            else{
-                for (int i = 0; i < topic_count; i++) {
-                printf(" - %s (Suscriptores: %d)\n", topics[i].name, topics[i].subscriber_count);
-                }
+            break;
+        case CMD_SUBSCRIBE:
+            frame_get_string(&reader, msg->topic, sizeof(msg->topic));
+            msg->has_cursor = reader.left > 0;
+            if (msg->has_cursor) {
+                msg->cursor = frame_get_u64(&reader);
+            }
+            break;
+        case CMD_UNSUBSCRIBE:
+            frame_get_string(&reader, msg->topic, sizeof(msg->topic));
+            break;
+        case CMD_MSG:
+            frame_get_string(&reader, msg->topic, sizeof(msg->topic));
+            msg->lifetime = frame_get_int(&reader);
+            frame_get_string(&reader, msg->message, sizeof(msg->message));
+            break;
+        case CMD_MSG_BATCH:
+            msg->batch = reader.data;
+            msg->batch_len = reader.left;
+            return !reader.error;
+    }
+    // La carga tiene que acabar justo con el último campo
+    return !reader.error && reader.left == 0;
+}
+
+// Función para decidir si una trama completa es una solicitud válida (con la que se retoma la
+// lectura de la pipe del servidor tras una cabecera no válida)
+int request_frame_valid(const char *frame, size_t len) {
+    FrameHeader header;
+    memcpy(&header, frame, sizeof(header));
+    if (header.type > CMD_MSG_BATCH) {
+        return 0;
+    }
+    Response msg;
+    if (!decode_request(frame, &msg) || msg.pid <= 0 || msg.username[0] == '\0') {
+        return 0;
+    }
+    // Los mensajes de un lote tienen que ocupar toda la carga
+    FrameReader reader = { .data = msg.batch, .left = header.type == CMD_MSG_BATCH ? msg.batch_len : 0, .error = 0 };
+    while (reader.left > 0 && !reader.error) {
+        frame_get_string(&reader, msg.topic, sizeof(msg.topic));
+        frame_get_int(&reader);
+        frame_get_string(&reader, msg.message, sizeof(msg.message));
+    }
+    return !reader.error;
+}
+
+
+// Función para atender los comandos que un cliente dejó en el anillo de su sesión
+void drain_ring(int client) {
+    RingRegion *ring = clients[client].ring;
+    char frame[MAX_REQUEST_LEN];
+    Response msg;
+    uint32_t len;
+
+    do {
+        while ((len = ring_pop(&ring->up, frame, sizeof(frame))) != 0) {
+            if (len > sizeof(frame) || frame_check(frame, len, sizeof(frame)) != len || !decode_request(frame, &msg)) {
+                printf("Trama no válida en el anillo de %s, se descarta.\n", client_name(&clients[client]));
+                continue;
+            }
+            // El inicio de sesión y la negociación del transporte solo se aceptan por la pipe
+            if (msg.command_type == CMD_LOGIN || msg.command_type == CMD_ATTACH_RING || msg.command_type == CMD_DOORBELL) {
+                continue;
+            }
+            // Los comandos del anillo siempre son de la sesión que lo creó
+            snprintf(msg.client_pipe, sizeof(msg.client_pipe), "%s", clients[client].client_pipe);
+            snprintf(msg.username, sizeof(msg.username), "%s", client_name(&clients[client]));
+            msg.pid = clients[client].pid;
+            process_request(&msg);
+            if (!clients[client].in_use || clients[client].ring != ring || clients[client].leaving) {
+                return; // el cliente salió: el anillo ya no es nuestro
+            }
+        }
+    } while (!ring_sleep(&ring->up));
+}
+
+// Función para atender el timbre de un cliente que dejó comandos en el anillo de su sesión
+void ring_doorbell(const Response *msg) {
+    metrics_command(CMD_DOORBELL);
+    int user = name_index_find(&user_index, msg->username);
+    if (user != -1 && users[user].client != -1 && clients[users[user].client].ring && !clients[users[user].client].leaving) {
+        drain_ring(users[user].client);
+    }
+}
+
+// Función para leer y procesar todas las solicitudes disponibles en la pipe del servidor
+void read_requests(int server_fd) {
+    static FrameStream ingress = { .accept = request_frame_valid }; // tramas leídas de la pipe pendientes de procesar (empieza vacío)
+    Response msg;
+    const char *frame;
+    size_t len;
+    int status;
+
+    while (1) {
+        // Leer todas las solicitudes disponibles en la pipe (hasta llenar el buffer)
+        ssize_t bytesRead = frame_stream_fill(&ingress, server_fd);
+        if (bytesRead <= 0) {
+            if (bytesRead < 0 && errno != EAGAIN) {
+                perror("Error al leer el mensaje del cliente");
+            }
+            return;
+        }
+
+        // Procesar cada solicitud completa; un resto parcial se conserva para la siguiente lectura
+        while ((status = frame_stream_next(&ingress, MAX_REQUEST_LEN, &frame, &len)) != 0) {
+            if (status == -1) {
+                // Se pierde la trama no válida y lo que la sigue hasta la siguiente solicitud válida
+                metrics_add(MET_FRAMES_INVALID, 1);
+                printf("Trama no válida en la pipe del servidor, se descarta.\n");
+            } else if (!decode_request(frame, &msg)) {
+                printf("Solicitud mal formada (tipo %d), se descarta.\n", msg.command_type);
+            } else if (msg.command_type == CMD_DOORBELL) {
+                ring_doorbell(&msg);
+            } else {
+                process_request(&msg);
+            }
+        }
+    }
+}
+
+// Función para construir la vista de los usuarios conectados que pide la consola del manager
+View *build_users_view() {
+    size_t strings_len = 0;
+    for (int i = 0; i < client_slots; i++) {
+        if (clients[i].in_use) {
+            strings_len += strlen(client_name(&clients[i])) + strlen(clients[i].client_pipe) + 2;
+        }
+    }
+    View *view = view_create(VIEW_USERS, client_count, strings_len);
+    if (view) {
+        for (int i = 0; i < client_slots; i++) {
+            if (clients[i].in_use) {
+                view->users[view->count].name = view_string(view, client_name(&clients[i]));
+                view->users[view->count].client_pipe = view_string(view, clients[i].client_pipe);
+                view->count++;
             }
-            pthread_mutex_unlock(&mutex);
         }
-        // Comando show <topic>
-        else if (strncmp(input, "show ", 5) == 0){
-            char topic[TOPIC_NAME_LEN];
-            sscanf(input + 5, "%s", topic);
-            pthread_mutex_lock(&mutex);
-            show_messages(topic);
-            pthread_mutex_unlock(&mutex);
+    }
+    return view;
+}
+
+// Función para construir en la partición del tópico la vista de sus mensajes retenidos
+// (solo se copian los mensajes retenidos del tópico consultado)
+View *build_messages_view(const char *topic_name) {
+    int topic = name_index_find(&topic_index, topic_name);
+    int count = topic != -1 ? topics[topic].live_messages : 0;
+    size_t strings_len = strlen(topic_name) + 1;
+    for (StoredMessage *m = topic != -1 ? topics[topic].first_message : NULL; m; m = m->next) {
+        strings_len += strlen(users[m->user].name) + m->length + 2;
+    }
+    View *view = view_create(VIEW_MESSAGES, count, strings_len);
+    if (view) {
+        view->topic = view_string(view, topic_name);
+        view->found = topic != -1;
+        for (StoredMessage *m = topic != -1 ? topics[topic].first_message : NULL; m; m = m->next) {
+            view->messages[view->count].user = view_string(view, users[m->user].name);
+            view->messages[view->count].message = view_string(view, m->message);
+            view->count++;
+        }
+    }
+    return view;
+}
+
+// Función para atender las peticiones de la consola del manager: ejecutar los comandos y responder
+// las consultas (los usuarios desde el hilo de entrada, los tópicos y los mensajes desde sus particiones)
+void read_console_requests(int console_fd) {
+    ConsoleRequest request;
+    int status;
+    while ((status = console_read_request(&request)) == 1) {
+        if (!request.is_view) {
+            handle_manager_command(request.text);
+        } else if (request.kind == VIEW_USERS) {
+            console_reply(build_users_view());
+        } else if (request.kind == VIEW_TOPICS) {
+            shard_broadcast(&(ShardTask){ .kind = TASK_TOPICS, .gather = gather_create(GATHER_VIEW_TOPICS, shard_count) });
+        } else {
+            route_topic_command(TASK_VIEW, request.text);
+        }
+    }
+    if (status == -1) {
+        // Fin de la entrada estándar: dejar de vigilar la consola
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, console_fd, NULL);
+    }
+}
+
+// Función para añadir un descriptor al bucle de eventos del servidor
+int watch_fd(int fd, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.u64 = (uint64_t)fd };
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Función para atender en su partición la solicitud de un cliente sobre un tópico. El cliente sigue
+// conectado: solo se quita cuando todas sus particiones han atendido lo que envió antes de salir
+void run_request(const ShardTask *task) {
+    const Response *msg = &task->request;
+    Client *client = &clients[users[task->user].client];
+    reply_client = client - clients;
+    reply_seq = msg->seq;
+    quiet_replies = task->quiet;
+
+    switch (msg->command_type) {
+        case CMD_SUBSCRIBE:
+            subscribe_topic(msg, client);
+            break;
+        case CMD_UNSUBSCRIBE:
+            unsubscribe_topic(msg->topic, client);
+            break;
+        case CMD_MSG:
+            send_message(msg, client);
+            break;
+        case CMD_MSG_BATCH:
+            send_batch(task, client);
+            free((char *)msg->batch);
+            break;
+    }
+    reply_client = -1;
+    quiet_replies = 0;
+}
+
+// Función para ejecutar una tarea en la partición del hilo actual (0 si es la de terminar)
+int run_task(const ShardTask *task) {
+    switch (task->kind) {
+        case TASK_REQUEST:
+            run_request(task);
+            break;
+        case TASK_TOPICS:
+            collect_topics(task->gather);
+            break;
+        case TASK_LOAD:
+            load_stored(task);
+            break;
+        case TASK_RESTORE:
+            restore_state(task);
+            break;
+        case TASK_NUMBER:
+            number_messages();
+            gather_done(task->gather);
+            break;
+        case TASK_EXPIRE:
+            expire_messages((int)task->value);
+            break;
+        case TASK_RESUME:
+            resume_replays();
+            break;
+        case TASK_LEAVE:
+            cancel_replays((int)task->value, -1);
+            gather_done(task->gather);
+            break;
+        case TASK_LOCK:
+            lock_topic(task->request.topic);
+            break;
+        case TASK_UNLOCK:
+            unlock_topic(task->request.topic);
+            break;
+        case TASK_VIEW:
+            console_reply(build_messages_view(task->request.topic));
+            break;
+        case TASK_EXPORT:
+            write_messages(task->gather);
+            break;
+        case TASK_SNAPSHOT:
+            snapshot_messages();
+            gather_done(task->gather);
+            break;
+        case TASK_STOP:
+            return 0;
+    }
+    return 1;
+}
+
+// Función del hilo de una partición: atiende su cola de tareas y su ventana del commit en grupo
+void *shard_main(void *arg) {
+    Shard *shard = arg;
+    shard_index = shard - shards;
+    sync_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    int loop_fd = epoll_create1(0);
+    ShardTask *batch = malloc(SHARD_BATCH * sizeof(ShardTask));
+    if (sync_fd == -1 || loop_fd == -1 || !batch) {
+        perror("Error al crear el bucle de eventos de una partición");
+        exit(EXIT_FAILURE);
+    }
+    int queue_fd = task_queue_fd(shard->queue);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = (uint64_t)sync_fd };
+    epoll_ctl(loop_fd, EPOLL_CTL_ADD, sync_fd, &ev);
+    ev.data.u64 = (uint64_t)queue_fd;
+    epoll_ctl(loop_fd, EPOLL_CTL_ADD, queue_fd, &ev);
+
+    int running = 1;
+    while (running) {
+        struct epoll_event events[2];
+        int n = epoll_wait(loop_fd, events, 2, -1);
+        for (int i = 0; i < n; i++) {
+            if ((int)events[i].data.u64 == sync_fd) {
+                uint64_t expirations;
+                read(sync_fd, &expirations, sizeof(expirations));
+                commit_messages();
+            }
         }
-        // Comando lock <topic>
-        else if (strncmp(input, "lock ", 5) == 0){
-            char topic[TOPIC_NAME_LEN];
-            sscanf(input + 5, "%s", topic);
-            pthread_mutex_lock(&mutex);
-            lock_topic(topic);
-            pthread_mutex_unlock(&mutex);
+
+        // Un lote de tareas por vuelta, con el cerrojo de las sesiones tomado una sola vez; si
+        // quedan más, el descriptor de la cola sigue activo y la siguiente vuelta las atiende
+        size_t count = task_queue_pop(shard->queue, batch, SHARD_BATCH);
+        if (count > 0) {
+            pthread_rwlock_rdlock(&session_lock);
+            for (size_t i = 0; i < count; i++) {
+                running &= run_task(&batch[i]);
+            }
+            pthread_rwlock_unlock(&session_lock);
         }
-        // Comando unlock <topic>
-        else if (strncmp(input, "unlock ", 7) == 0){
-            char topic[TOPIC_NAME_LEN];
-            sscanf(input + 7, "%s", topic);
-            pthread_mutex_lock(&mutex);
-            unlock_topic(topic);
-            pthread_mutex_unlock(&mutex);
+
+        // Sin ventana de commit en grupo, cada lote de tareas se sincroniza al terminar
+        if (sync_window_ms <= 0 && wal_pending() > 0) {
+            commit_messages();
         }
-        else {
-            printf("Comando desconocido: %s\n", input);
+    }
+
+    // Sincronizar lo pendiente antes de terminar
+    commit_messages();
+    free(batch);
+    close(sync_fd);
+    close(loop_fd);
+    return NULL;
+}
+
+// Función para arrancar las particiones de los tópicos (TOPIC_SHARDS hilos)
+void start_shards(int count) {
+    shard_count = count < 1 ? 1 : count > MAX_TOPIC_SHARDS ? MAX_TOPIC_SHARDS : count;
+
+    // Las particiones solo leen las sesiones: se da preferencia al hilo de entrada, que las modifica
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&session_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    gather_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (gather_fd == -1) {
+        perror("Error al crear las particiones de los tópicos");
+        exit(EXIT_FAILURE);
+    }
+    for (int s = 0; s < shard_count; s++) {
+        shards[s].queue = task_queue_create(sizeof(ShardTask), SHARD_QUEUE_LEN);
+        if (!shards[s].queue || pthread_create(&shards[s].thread, NULL, shard_main, &shards[s]) != 0) {
+            perror("Error al crear las particiones de los tópicos");
+            exit(EXIT_FAILURE);
         }
     }
-    pthread_exit(NULL); // terminar el hilo
+}
+
+// Función para detener las particiones: atienden lo que tenían en cola, sincronizan y terminan
+void stop_shards() {
+    shard_broadcast(&(ShardTask){ .kind = TASK_STOP });
+    for (int s = 0; s < shard_count; s++) {
+        pthread_join(shards[s].thread, NULL);
+        task_queue_destroy(shards[s].queue);
+    }
+    // Completar las operaciones que terminaron las últimas tareas
+    finish_gathers();
+    close(gather_fd);
 }
 
 
 int main() {
-    Response msg;
-    
     const char *MSG_FICH = "MSG_FICH";  // Declarar MSG_FICH como una cadena
     const char *file_name = "mensajes.txt";
     
@@ -793,14 +2794,6 @@ int main() {
         perror("Error al establecer la variable de entorno");
         return 1;
     }
-    
-    // Cargar los mensajes del fichero del manager anterior
-    load_messages();
-
-    // Configurar el manejador de señal para SIGINT
-    signal(SIGINT, handle_sigint);
-    // Configurar el manejador de señal para SIGUSR1
-    signal(SIGUSR1, thread_signal_handler);
 
     // Comprobar que solo hay un manager en ejecución
     if (access(SERVER_PIPE, F_OK) == 0){
@@ -808,131 +2801,171 @@ int main() {
         exit(1);
     }
 
+    // Presupuesto de memoria para tópicos, clientes y mensajes (MEM_BUDGET_MB, en megabytes)
+    const char *budget_env = getenv("MEM_BUDGET_MB");
+    size_t budget_mb = budget_env ? strtoul(budget_env, NULL, 10) : DEFAULT_MEM_BUDGET_MB;
+    mem_init(budget_mb * 1024 * 1024);
+
+    // Ventana del commit en grupo de los mensajes persistentes (MSG_SYNC_MS, en milisegundos)
+    const char *sync_env = getenv("MSG_SYNC_MS");
+    if (sync_env) {
+        sync_window_ms = strtol(sync_env, NULL, 10);
+    }
+
+    // Recibir SIGINT (CTRL+C) como un evento más del bucle en lugar de en un manejador asíncrono
+    // (antes de crear ningún hilo, para que todos lo hereden bloqueado)
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK);
+
+    // Particiones de los tópicos (TOPIC_SHARDS hilos); el hilo principal recibe las solicitudes y se las reparte
+    const char *shards_env = getenv("TOPIC_SHARDS");
+    start_shards(shards_env ? atoi(shards_env) : DEFAULT_TOPIC_SHARDS);
+
+    // Cargar los mensajes del registro del manager anterior
+    load_messages();
+
+    // Ignorar SIGPIPE: escribir en la pipe de un cliente que ya no lee devuelve EPIPE
+    signal(SIGPIPE, SIG_IGN);
+
     // Crear la pipe del servidor
     mkfifo(SERVER_PIPE, 0600);
 
-    // Inicializar el mutex
-    pthread_mutex_init(&mutex, NULL); 
-
-    // Iniciar el hilo para gestionar el lifetime de los mensajes
-    if (pthread_create(&lifetime_thread, NULL, manage_lifetime, NULL) != 0) {
-        perror("Error al crear el hilo de gestión de lifetime");
+    // Abrir la pipe una sola vez en modo lectura/escritura: al ser también escritor,
+    // el servidor nunca recibe EOF cuando los clientes cierran su extremo
+    int server_fd = open(SERVER_PIPE, O_RDWR | O_NONBLOCK);
+    if (server_fd == -1) {
+        perror("Error al abrir la pipe del servidor");
+        unlink(SERVER_PIPE);
         return 1;
     }
 
-    // Crea un hilo para ejecutar los comandos ya que el hilo principal escucha los comandos del cliente
-    if (pthread_create(&command_thread, NULL, command_sender, NULL) != 0) {
-        perror("Error al crear el hilo de envío de comandos");
+    // Temporizador de las terminaciones diferidas de los inicios de sesión rechazados
+    kill_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+    // Temporizador de un segundo para gestionar el lifetime de los mensajes
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct itimerspec interval = { .it_interval = { 1, 0 }, .it_value = { 1, 0 } };
+    timerfd_settime(timer_fd, 0, &interval, NULL);
+
+    // Límites de las colas de salida de los clientes (OUTBOX_HIGH_KB y OUTBOX_LOW_KB, en kilobytes) y
+    // política de desbordamiento (OUTBOX_POLICY: drop-newest, drop-oldest o disconnect)
+    const char *high_env = getenv("OUTBOX_HIGH_KB");
+    const char *low_env = getenv("OUTBOX_LOW_KB");
+    if (high_env && strtoul(high_env, NULL, 10) > 0) {
+        outbox_limits.high_water = strtoul(high_env, NULL, 10) * 1024;
+    }
+    outbox_limits.low_water = low_env ? strtoul(low_env, NULL, 10) * 1024 : outbox_limits.high_water / 2;
+    if (outbox_limits.low_water > outbox_limits.high_water) {
+        outbox_limits.low_water = outbox_limits.high_water;
+    }
+    outbox_limits.policy = parse_overflow_policy(getenv("OUTBOX_POLICY"));
+
+    // Hilos de entrega que escriben en las pipes de los clientes (DELIVERY_WORKERS, 0 = uno por núcleo)
+    const char *workers_env = getenv("DELIVERY_WORKERS");
+    delivery_start(workers_env ? atoi(workers_env) : 0);
+
+    // El bucle de eventos del hilo de entrada atiende la pipe del servidor, las peticiones de la consola
+    // del manager, el temporizador, las señales y las operaciones repartidas que terminan; los tópicos
+    // los atienden las particiones, la escritura a los clientes los hilos de entrega y la lectura y
+    // la impresión de la consola, su propio hilo
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1 || signal_fd == -1 || timer_fd == -1 || kill_timer_fd == -1) {
+        perror("Error al crear el bucle de eventos");
+        unlink(SERVER_PIPE);
         return 1;
     }
+    watch_fd(server_fd, EPOLLIN);
+    watch_fd(timer_fd, EPOLLIN);
+    watch_fd(kill_timer_fd, EPOLLIN);
+    watch_fd(signal_fd, EPOLLIN);
+    watch_fd(gather_fd, EPOLLIN);
+    watch_fd(wal_event_fd(), EPOLLIN);
+    watch_fd(delivery_drain_fd(), EPOLLIN);
+    watch_fd(delivery_evict_fd(), EPOLLIN);
+    int console_fd = console_start();
+    if (console_fd == -1 || watch_fd(console_fd, EPOLLIN) == -1) {
+        perror("No se puede atender la consola del manager");
+    }
+
+    // Volcado periódico de las métricas en formato de Prometheus (METRICS_FILE, cada METRICS_INTERVAL segundos)
+    const char *metrics_file = getenv("METRICS_FILE");
+    const char *metrics_interval = getenv("METRICS_INTERVAL");
+    if (metrics_file && metrics_start_dump(metrics_file, metrics_interval ? atoi(metrics_interval) : DEFAULT_METRICS_INTERVAL) == -1) {
+        perror("No se pueden volcar las métricas");
+    }
 
     // Texto inicial
     printf("Esperando conexiones...\n");
 
-    while (!terminate_thread) {
-        // Esperar por un mensaje del cliente
-        int fd = open(SERVER_PIPE, O_RDONLY);
-        if (fd == -1) {
-            perror("Error al abrir la pipe del servidor");
-            continue; // Volver a intentar en el siguiente ciclo
-        }
-        // Leer la solicitud del cliente
-        ssize_t bytesRead = read(fd, &msg, sizeof(Response));
-        if (bytesRead < 0) {
-            perror("Error al leer el mensaje del cliente");
-            close(fd);
-            continue; // Volver a intentar en el siguiente ciclo
-        } else if (bytesRead == 0) {
-            close(fd); // Uso para evitar duplicar el mensaje de bienvenida
-            continue; // Volver a intentar en el siguiente ciclo
-        }
-
-        // Se bloquea el mutex
-        pthread_mutex_lock(&mutex);
-
-        switch (msg.command_type) {
-            // Mensaje de conexión
-            case 0: 
-                char res[512];
-                if (client_count < MAX_USERS) {
-                    int duplicate_found = 0; 
-                    // Verificar si el nombre de usuario ya está en uso
-                    for (int i = 0; i < client_count; i++) {
-                        if (strcmp(clients[i].username, msg.username) == 0) {
-                            printf("ERR: Username '%s' is already in use.\n", msg.username);
-                            duplicate_found = 1;
-                            sprintf(res, "ERR: Username '%s' is already in use.\n", msg.username);
-                            send_response(msg.client_pipe, res);
-                            sleep(1);
-                            kill(msg.pid, SIGTERM); // cierra el nuevo cliente
-                        }
-                    }
+    while (!terminate_server) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("Error en epoll_wait");
+            }
+            continue;
+        }
 
-                    // Si no se encuentra un duplicado, agregar al nuevo cliente
-                    if (duplicate_found == 0) {
-                        if (msg.username[0] != '\0') { // verificar que el nombre no esté vacío
-                            sprintf(res, "Bienvenido, %s", msg.username);
-                            send_response(msg.client_pipe, res);
-                            add_client(msg.client_pipe, msg.username, msg.pid);
-                        } else {
-                            printf("ERR: Invalid username.\n");
-                            send_response(msg.client_pipe, "ERR: Invalid username.\n");
-                            sleep(1);
-                            kill(msg.pid, SIGTERM); 
-                        }
+        for (int i = 0; i < n; i++) {
+            int fd = (int)events[i].data.u64;
+            if (events[i].data.u64 >= PROCESS_EVENT_BASE) {
+                client_process_exited(events[i].data.u64);
+            } else if (fd == server_fd) {
+                read_requests(server_fd);
+            } else if (fd == console_fd) {
+                read_console_requests(console_fd);
+            } else if (fd == timer_fd) {
+                uint64_t ticks;
+                if (read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+                    shard_broadcast(&(ShardTask){ .kind = TASK_EXPIRE, .value = ticks });
+                    check_client_processes();
+                    if (wal_should_compact(message_count)) {
+                        compact_messages(1);
                     }
-                } else {            
-                    printf("ERR: Max number of users reached (%d).\n", MAX_USERS);
-                    sprintf(res, "ERR: Max number of users reached (%d).\n", MAX_USERS);
-                    send_response(msg.client_pipe, res);
-                    sleep(1);
-                    kill(msg.pid, SIGTERM);
                 }
-            break;
-
-            // Manejo de la creación de un tópico
-            case 1: 
-                subscribe_topic(msg.topic, msg.client_pipe, msg.username);
-                break;
-
-            // Manejo de listar los topicos
-            case 2:
-                printf("Listar tópicos para el usuario '%s'.\n", msg.username);
-                list_topics(msg.client_pipe);
-                break;
-
-            // Manejo del comando exit del cliente
-            case 3:
-                printf("Cliente '%s' ha salido.\n", msg.username);
-                remove_client(msg.username);
-                break;
-                
-            // Manejo de la desuscripcion de un cliente en un topico
-            case 4:
-                printf("El usuario '%s'se ha desuscrito del tópico '%s'\n", msg.username, msg.topic);
-                unsubscribe_topic(msg.topic, msg.client_pipe, msg.username);
-                break;
-
-            // Manejo del envío de un mensaje y almacenamiento en un archivo si es persistente
-            case 5:
-                send_message(&msg);
-                break;
-
-            // Manejo del CTRL+C del cliente
-            case 6:
-                handle_ctrlc(msg.username);
-                break;
-                
-            default:
-                // Enviar respuesta de comando no reconocido
-                int client_fd = open(msg.client_pipe, O_WRONLY);
-                write(client_fd, "Comando no reconocido.", 22);
-                close(client_fd);
-                printf("Comando no reconocido: tipo %d\n", msg.command_type);
-                break;
+            } else if (fd == kill_timer_fd) {
+                run_pending_kills();
+            } else if (fd == gather_fd) {
+                finish_gathers();
+            } else if (fd == wal_event_fd()) {
+                wal_compaction_done();
+            } else if (fd == delivery_drain_fd()) {
+                uint64_t value;
+                read(delivery_drain_fd(), &value, sizeof(value));
+                shard_broadcast(&(ShardTask){ .kind = TASK_RESUME });
+            } else if (fd == delivery_evict_fd()) {
+                uint64_t value;
+                read(delivery_evict_fd(), &value, sizeof(value));
+                evict_failed_outboxes();
+            } else if (fd == signal_fd) {
+                struct signalfd_siginfo info;
+                read(signal_fd, &info, sizeof(info));
+                printf("\nServidor finalizado. Limpiando recursos...\n");
+                terminate_server = 1;
+            }
         }
+        if (parked_login_count > 0) {
+            admit_parked_logins();
+        }
+    }
 
-        pthread_mutex_unlock(&mutex); // Desbloquear el mutex después de acceder a la sección crítica
+    // Las particiones sincronizan lo pendiente antes de cerrar las conexiones
+    stop_shards();
+    wal_close();
+    close_all_connections();
+    delivery_stop();
+    if (metrics_file) {
+        metrics_write(metrics_file);
     }
+    unlink(SERVER_PIPE);
+    close(server_fd);
+    close(timer_fd);
+    close(kill_timer_fd);
+    close(signal_fd);
+    close(epoll_fd);
     return 0;
 }
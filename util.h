@@ -1,19 +1,25 @@
+#define _GNU_SOURCE // pipe2, epoll y demás extensiones de Linux
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <time.h>
 
 #define SERVER_PIPE "server_pipe"
-#define MAX_TOPICS 20
-#define TOPIC_NAME_LEN 21 // espacio adicional para el caracter nulo
-#define MAX_SUBSCRIBERS 10
+#define CLIENT_PIPE_FORMAT "client_pipe_%d" // pipe de cada cliente (PID del cliente)
+#define TOPIC_NAME_LEN 129 // niveles separados por '/'; espacio adicional para el caracter nulo
 #define USERNAME_LEN 257 // espacio adicional para el caracter nulo
-#define MAX_USERS 10
-#define MAX_MESSAGES 100
 #define TAM_MSG 301 // espacio adicional para el caracter nulo